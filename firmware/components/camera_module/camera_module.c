@@ -1,5 +1,7 @@
 #include "camera_module.h"
 
+#include <string.h>
+
 #include "freertos/FreeRTOS.h"
 #include "freertos/queue.h"
 #include "freertos/task.h"
@@ -10,35 +12,296 @@
 //#include "network_module.h"
 
 #include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
 
 #include "jpeg.h"
+#include "frame_pool.h"
 
 #define CAMERA_MODULE_TASK_SIZE		2048
+//jpegenc keeps its control block and a row pointer per frame line (960 B at QVGA) on the stack below about 2 kB of encode
+//calls, jpge its encoder state (over 1 kB). camera_get_stats() reports the headroom left
+#define JPEG_ENCODE_TASK_SIZE		4096
+
+#if CONFIG_JPEG_STRIPE_PARALLEL
+#define JPEG_FRAME_ENCODE_TASKS		1	//one task owns every frame, the others encode stripes of it
+#else
+#define JPEG_FRAME_ENCODE_TASKS		CONFIG_NUM_JPEG_ENCODE_TASKS
+#endif
+
+#if CONFIG_JPEG_GRAYSCALE
+#define JPEG_COLORSPACE		YUV400
+#elif CONFIG_JPEG_SUBSAMPLING_422
+#define JPEG_COLORSPACE		YUV422
+#else
+#define JPEG_COLORSPACE		YUV420
+#endif
+
+#if CONFIG_CAMERA_FRAMESIZE_QVGA
+#define CAMERA_FRAME_SIZE	FRAMESIZE_QVGA
+#elif CONFIG_CAMERA_FRAMESIZE_HQVGA
+#define CAMERA_FRAME_SIZE	FRAMESIZE_HQVGA
+#elif CONFIG_CAMERA_FRAMESIZE_QCIF
+#define CAMERA_FRAME_SIZE	FRAMESIZE_QCIF
+#else
+#define CAMERA_FRAME_SIZE	FRAMESIZE_QQVGA
+#endif
+
+//largest frame size camera_reconfigure() can switch to, buffers that depend on the frame size are allocated for it
+#if CONFIG_CAMERA_FRAMESIZE_MAX_QVGA
+#define CAMERA_FRAME_SIZE_MAX	FRAMESIZE_QVGA
+#elif CONFIG_CAMERA_FRAMESIZE_MAX_HQVGA
+#define CAMERA_FRAME_SIZE_MAX	FRAMESIZE_HQVGA
+#elif CONFIG_CAMERA_FRAMESIZE_MAX_QCIF
+#define CAMERA_FRAME_SIZE_MAX	FRAMESIZE_QCIF
+#elif CONFIG_CAMERA_FRAMESIZE_MAX_QQVGA
+#define CAMERA_FRAME_SIZE_MAX	FRAMESIZE_QQVGA
+#else
+#define CAMERA_FRAME_SIZE_MAX	CAMERA_FRAME_SIZE
+#endif
+
+#define CAMERA_FB_COUNT		(JPEG_FRAME_ENCODE_TASKS + 1) //one per frame encode task plus one being captured
+
+#if CONFIG_JPEG_STRIP_STREAMING
+#define JPEG_STRIP_QUEUE_LEN		8
+#define JPEG_STRIP_QUEUE_RESERVE	2 //slots kept for frame done/dropped, line counts add up so data strips can be skipped
+#define JPEG_STRIP_WAIT				(200 / portTICK_PERIOD_MS) //no strips for this long means capture is stopped
+#endif
+
+//each encode task owns an encoder context so frames can be encoded concurrently on both cores.
+//tasks take turns (round robin) to get camera frames and to publish encoded frames, so frames leave in capture order
+typedef struct
+{
+	jpeg_encoder_ctx_t encoder;
+	TaskHandle_t task;
+	SemaphoreHandle_t capture_turn;
+	StaticSemaphore_t capture_turn_buf;
+	SemaphoreHandle_t publish_turn;
+	StaticSemaphore_t publish_turn_buf;
+	frame_t * frame; //pool frame being encoded, NULL - none or, with the packet sink, not stored
+	BaseType_t no_buffer; //the frame being captured found no room and is dropped
+	jpeg_t output;   //where the encoder writes it, luma map included
+#if CONFIG_CAMERA_STATS
+	jpeg_stats_t stats; //of the last frame (or part) the encoder did
+#endif
+#if CONFIG_CAMERA_ADAPTIVE
+	uint32_t adapt_rung; //whose quality the encoder has
+#endif
+} jpeg_encode_task_ctrl_t;
+
+static jpeg_encode_task_ctrl_t jpeg_encode_tasks[CONFIG_NUM_JPEG_ENCODE_TASKS];
+
+//encodes one camera frame into frame, the backend in use can be changed between frames
+typedef struct
+{
+	const char * name;
+	esp_err_t (*encode)(jpeg_encode_task_ctrl_t * self, camera_fb_t * fb, jpeg_t * frame);
+	BaseType_t analysed; //fills the frame's luma map and the task's jpeg_stats_t
+} camera_encoder_backend_t;
+
+static esp_err_t camera_encode_jpegenc (jpeg_encode_task_ctrl_t * self, camera_fb_t * fb, jpeg_t * frame);
+#if CONFIG_CAMERA_ENCODER_JPGE
+static esp_err_t camera_encode_jpge (jpeg_encode_task_ctrl_t * self, camera_fb_t * fb, jpeg_t * frame);
+static size_t camera_jpge_output (void * arg, size_t index, const void * data, size_t len);
+#endif
+
+static const camera_encoder_backend_t camera_encoder_backends[CAMERA_ENCODER_COUNT] = {
+	[CAMERA_ENCODER_JPEGENC] = {"jpegenc", camera_encode_jpegenc, pdTRUE},
+#if CONFIG_CAMERA_ENCODER_JPGE
+	[CAMERA_ENCODER_JPGE] = {"jpge", camera_encode_jpge, pdFALSE},
+#endif
+};
+
+#if CONFIG_CAMERA_ENCODER_JPGE_DEFAULT
+static volatile camera_encoder_t camera_encoder = CAMERA_ENCODER_JPGE;
+#else
+static volatile camera_encoder_t camera_encoder = CAMERA_ENCODER_JPEGENC;
+#endif
+
+#if CONFIG_JPEG_STRIPE_PARALLEL
+static jpeg_stripe_job_t jpeg_stripe_job; //frame currently split between the encode tasks
+#endif
+
+#if CONFIG_JPEG_REPLENISH
+static jpeg_replenish_t jpeg_replenish; //of the one frame encode task, partial frames must be encoded in order
+#endif
+
+#if CONFIG_CAMERA_MOTION_DETECT
+//motion detector, compares the luma map the encoder produces with every frame (one per JPEG buffer) with the map of the
+//frame encoded before it. Shared by the encode tasks
+typedef struct
+{
+	SemaphoreHandle_t mutx;
+	StaticSemaphore_t mutx_buf;
+	uint8_t * map_prev;
+	uint32_t map_size;
+	BaseType_t map_prev_valid;
+	uint32_t changed_blocks; //of the last frame
+	uint32_t still_frames;   //encoded in a row without motion
+	uint32_t skipped_frames; //since the last one encoded while idle
+} camera_motion_t;
+
+static camera_motion_t camera_motion;
+#endif
+
+//frame sizes the camera can capture as YUYV frames, smallest first
+static const framesize_t camera_frame_sizes[] = {FRAMESIZE_QQVGA, FRAMESIZE_QCIF, FRAMESIZE_HQVGA, FRAMESIZE_QVGA};
+
+#define CAMERA_FRAME_SIZES	(sizeof(camera_frame_sizes) / sizeof(camera_frame_sizes[0]))
+
+static volatile uint32_t camera_fb_count = CAMERA_FB_COUNT; //camera frame buffers, changed by camera_reconfigure()
+
+#if CONFIG_CAMERA_RECONFIGURE
+//camera configuration, changed while no encode task holds or waits for a camera frame. Every frame encode task holds one of
+//the capture tokens from once it has its capture turn until it has returned its frame, a reconfiguration takes them all.
+//Tokens are taken in capture order, so no task waits for a turn while holding a token
+typedef struct
+{
+	SemaphoreHandle_t tokens;
+	StaticSemaphore_t tokens_buf;
+	SemaphoreHandle_t mutx; //one reconfiguration at a time, encode tasks wait on it for a token while one runs
+	StaticSemaphore_t mutx_buf;
+	framesize_t frame_size;         //asked for, CONFIG_CAMERA_ADAPTIVE may capture smaller frames
+	framesize_t frame_size_current; //the camera captures
+	pixformat_t pixel_format;
+	uint32_t adapt_rung;            //of CONFIG_CAMERA_ADAPTIVE whose frame size was last applied
+} camera_geometry_t;
+
+static camera_geometry_t camera_geometry;
+#endif
 
-//jpeg frame queue used to enforce FIFO in the available frame stream, which is continuously provided by the jpeg encode task and camera driver
-//mutex is also used on each available frame buffer to prevent misuse by external parties - ie attempting to return the same frame twice w/o
-//first getting it
+#if CONFIG_CAMERA_ADAPTIVE
+//back-pressure controller. The sender reports every frame, once per CONFIG_CAMERA_ADAPT_WINDOW frames the stream steps one
+//rung down the ladder if the link fell behind and one rung up after CONFIG_CAMERA_ADAPT_UP_WINDOWS clear windows in a row
 typedef struct
 {
-	jpeg_t frame;
-	BaseType_t checked_out;
-} jpeg_frame_ctrl_t;
+	uint8_t quality;       //at most, rate control works below it. 0 - CONFIG_JPEG_QUALITY
+	uint8_t frame_divisor; //one frame in this many is encoded
+	uint8_t size_steps;    //frame sizes below the one asked for, with CONFIG_CAMERA_RECONFIGURE
+} camera_adapt_rung_t;
 
-static jpeg_frame_ctrl_t jpeg_frames_ctrl[CONFIG_NUM_JPEG_BUFFERS];
+#if CONFIG_CAMERA_RECONFIGURE
+//a smaller frame at a better quality looks better than a blocky large one, so the frame size goes down before quality does
+static const camera_adapt_rung_t camera_adapt_ladder[] = {
+	{0, 1, 0},
+	{50, 1, 0},
+	{50, 1, 1},
+	{35, 1, 1},
+	{35, 2, 1},
+	{35, 2, 2},
+	{25, 3, 2},
+	{15, 4, 3},
+};
+#else
+static const camera_adapt_rung_t camera_adapt_ladder[] = {
+	{0, 1, 0},
+	{50, 1, 0},
+	{35, 1, 0},
+	{35, 2, 0},
+	{25, 2, 0},
+	{25, 3, 0},
+	{15, 4, 0},
+};
+#endif
 
-uint8_t jpeg_buf[CONFIG_NUM_JPEG_BUFFERS][CONFIG_JPEG_BUF_SIZE_MAX];
+#define CAMERA_ADAPT_RUNGS	(sizeof(camera_adapt_ladder) / sizeof(camera_adapt_ladder[0]))
 
-static QueueHandle_t jpeg_out_queue; //queues store index of frame inside the jpeg_frames_ctrl data structure
+typedef struct
+{
+	volatile uint32_t rung;  //0 - full quality and frame rate
+	uint32_t frames;         //reported in this window
+	uint32_t send_ms;        //of the frames reported in this window
+	uint32_t send_failures;
+	uint32_t lost;           //frames stolen or dropped up to the start of the window
+	uint32_t clear_windows;  //in a row
+	uint32_t skipped_frames; //since the last one encoded, in capture order
+} camera_adapt_t;
+
+static camera_adapt_t camera_adapt;
+#endif
+
+#if CONFIG_CAMERA_STATS
+//encoder statistics of every frame, added up by the encode tasks. The histograms cover the last CONFIG_CAMERA_STATS_WINDOW
+//frames, the bins of each one are kept so it can be taken out again once it leaves the window
+#define CAMERA_STATS_NO_BIN		0xFF //failed frames have no size
+
+typedef struct
+{
+	SemaphoreHandle_t mutx;
+	StaticSemaphore_t mutx_buf;
+	camera_stats_t stats;
+	uint8_t time_bins[CONFIG_CAMERA_STATS_WINDOW];
+	uint8_t size_bins[CONFIG_CAMERA_STATS_WINDOW];
+	uint32_t next; //window slot of the next frame
+} camera_stats_ctrl_t;
+
+static camera_stats_ctrl_t camera_stats;
+#endif
+
+#if !CONFIG_JPEG_PACKET_SINK
+static frame_pool_t jpeg_frame_pool; //encoded frames, each trimmed to its size
+#endif
+
+static camera_frame_counters_t camera_counters; //updated with atomics, the encode tasks run on both cores
+
+#if CONFIG_JPEG_DROP_NEWEST
+static volatile camera_drop_policy_t camera_drop_policy = CAMERA_DROP_NEWEST;
+#else
+static volatile camera_drop_policy_t camera_drop_policy = CAMERA_DROP_OLDEST;
+#endif
+static volatile uint32_t camera_queue_depth = CONFIG_JPEG_QUEUE_DEPTH; //frames that may wait to be sent, up to CONFIG_NUM_JPEG_BUFFERS
+
+static QueueHandle_t jpeg_out_queue; //encoded frames in capture order, each holding a reference to the frame
 static StaticQueue_t jpeg_out_queue_data;
-static uint32_t jpeg_out_queue_buffer[CONFIG_NUM_JPEG_BUFFERS];
-static QueueHandle_t jpeg_in_queue;
-static StaticQueue_t jpeg_in_queue_data;
-static uint32_t jpeg_in_queue_buffer[CONFIG_NUM_JPEG_BUFFERS];
+static frame_t * jpeg_out_queue_buffer[CONFIG_NUM_JPEG_BUFFERS];
+
+#if CONFIG_JPEG_STRIP_STREAMING
+static QueueHandle_t jpeg_strip_queue; //strips of the frame being captured, from the camera driver
+static StaticQueue_t jpeg_strip_queue_data;
+static camera_strip_t jpeg_strip_queue_buffer[JPEG_STRIP_QUEUE_LEN];
+#endif
 
 static const char* TAG = "camera_module";
 
-static uint32_t find_frame_from_buf_adr (void * buf_adr);
 static void jpeg_encode_task (void *parameters);
+static esp_err_t jpeg_encode_frame (jpeg_encode_task_ctrl_t * self, camera_fb_t * fb, jpeg_t * frame);
+static BaseType_t jpeg_frame_acquire (jpeg_encode_task_ctrl_t * self);
+static void jpeg_frame_publish (jpeg_encode_task_ctrl_t * self, esp_err_t status);
+static void jpeg_frame_drop_oldest (void);
+static void jpeg_frame_drop (frame_t * frame);
+static void jpeg_frame_info_begin (jpeg_t * frame, camera_fb_t * fb);
+static inline void camera_count (uint32_t * counter);
+static void camera_count_encode (esp_err_t status);
+static BaseType_t jpeg_output_ready (jpeg_encode_task_ctrl_t * self);
+static BaseType_t camera_frame_wanted (void);
+static BaseType_t camera_motion_frame_wanted (void);
+#if CONFIG_CAMERA_ADAPTIVE
+static void camera_adapt_apply (jpeg_encode_task_ctrl_t * self);
+#endif
+#if CONFIG_CAMERA_RECONFIGURE
+static esp_err_t camera_geometry_apply (framesize_t frame_size, pixformat_t pixel_format, uint32_t fb_count);
+static framesize_t camera_geometry_frame_size (framesize_t frame_size);
+static void camera_geometry_follow (void);
+static void camera_geometry_enter (void);
+#endif
+static int32_t camera_frame_size_index (framesize_t frame_size);
+#if CONFIG_CAMERA_MOTION_DETECT
+static esp_err_t camera_motion_init (uint32_t frame_width, uint32_t frame_height);
+static void camera_motion_resize (uint32_t frame_width, uint32_t frame_height);
+static void camera_motion_update (camera_fb_t * fb, jpeg_t * frame, esp_err_t status);
+static void camera_motion_unknown (void);
+#endif
+#if CONFIG_CAMERA_STATS
+static void camera_stats_update (jpeg_encode_task_ctrl_t * self);
+static uint8_t camera_stats_bin (uint32_t value, uint32_t bin_width);
+#endif
+#if CONFIG_JPEG_STRIP_STREAMING
+static void jpeg_strip_consumer (const camera_strip_t * strip, void * arg);
+static camera_fb_t * jpeg_stream_frame (jpeg_encode_task_ctrl_t * self, jpeg_encode_task_ctrl_t * next, esp_err_t * status);
+#endif
+#if CONFIG_JPEG_STRIPE_PARALLEL
+static void jpeg_stripe_worker_task (void *parameters);
+#endif
 
 //static uint8_t camera_task_stack[CAMERA_MODULE_TASK_SIZE];
 //static StaticTask_t camera_task_buffer;
@@ -50,7 +313,13 @@ esp_err_t camera_module_init()
 {
 	esp_err_t ret_val = ESP_OK;
 
-	if (CONFIG_NUM_JPEG_BUFFERS == 0 || CONFIG_JPEG_BUF_SIZE_MAX == 0)
+	if (CONFIG_NUM_JPEG_BUFFERS == 0 || CONFIG_JPEG_BUF_SIZE_MAX == 0 || CONFIG_NUM_JPEG_ENCODE_TASKS == 0
+			|| CONFIG_JPEG_QUEUE_DEPTH == 0 || CONFIG_JPEG_QUEUE_DEPTH > CONFIG_NUM_JPEG_BUFFERS
+#if !CONFIG_JPEG_PACKET_SINK
+			|| CONFIG_JPEG_POOL_SIZE < JPEG_FRAME_ENCODE_TASKS * FRAME_POOL_SPAN(CONFIG_JPEG_BUF_SIZE_MAX) //every task reserves the largest frame
+#endif
+			|| camera_frame_size_index(CAMERA_FRAME_SIZE_MAX) < camera_frame_size_index(CAMERA_FRAME_SIZE)
+			)
 	{
 		ret_val = ESP_ERR_INVALID_SIZE;
 		return ret_val;
@@ -88,136 +357,1187 @@ esp_err_t camera_module_init()
         .ledc_channel = LEDC_CHANNEL_0,
 
         .pixel_format = PIXFORMAT_YUV422, /*PIXFORMAT_GRAYSCALE,*/ /*PIXFORMAT_RGB565*/
-        .frame_size = FRAMESIZE_QQVGA, /*FRAMESIZE_QVGA,*/     //QQVGA-QXGA Do not use sizes above QVGA when not JPEG
+        .frame_size = CAMERA_FRAME_SIZE,        //QQVGA-QXGA Do not use sizes above QVGA when not JPEG
 
         .jpeg_quality = 12, //0-63 lower number means higher quality
-        .fb_count = 2 //if more than one, i2s runs in continuous mode.
+        .fb_count = CAMERA_FB_COUNT //if more than one, i2s runs in continuous mode
     };
 
+#if CONFIG_CAMERA_RECONFIGURE
+    //YUYV frames up to the largest size fit without reallocating the frame buffers
+    camera_config.fb_size_max = resolution[CAMERA_FRAME_SIZE_MAX][0] * resolution[CAMERA_FRAME_SIZE_MAX][1] * 2;
+    camera_geometry.tokens = xSemaphoreCreateCountingStatic(JPEG_FRAME_ENCODE_TASKS, JPEG_FRAME_ENCODE_TASKS, &camera_geometry.tokens_buf);
+    camera_geometry.mutx = xSemaphoreCreateMutexStatic(&camera_geometry.mutx_buf);
+    camera_geometry.frame_size = camera_config.frame_size;
+    camera_geometry.frame_size_current = camera_config.frame_size;
+    camera_geometry.pixel_format = camera_config.pixel_format;
+    if (camera_geometry.tokens == NULL || camera_geometry.mutx == NULL)
+    {
+    	ret_val = ESP_FAIL;
+    	return ret_val;
+    }
+#endif
+
     ret_val = esp_camera_init(&camera_config);
     if (ret_val != ESP_OK)
     {
     	return ret_val;
     }
 
-    jpeg_out_queue = xQueueCreateStatic(CONFIG_NUM_JPEG_BUFFERS, sizeof(uint32_t), (uint8_t*) jpeg_out_queue_buffer, &jpeg_out_queue_data);
-    jpeg_in_queue = xQueueCreateStatic(CONFIG_NUM_JPEG_BUFFERS, sizeof(uint32_t), (uint8_t*) jpeg_in_queue_buffer, &jpeg_in_queue_data);
+    jpeg_out_queue = xQueueCreateStatic(CONFIG_NUM_JPEG_BUFFERS, sizeof(frame_t *), (uint8_t*) jpeg_out_queue_buffer, &jpeg_out_queue_data);
 
-    if (jpeg_out_queue == NULL || jpeg_in_queue == NULL)
+    if (jpeg_out_queue == NULL)
     {
     	ret_val = ESP_FAIL;
     	return ret_val;
     }
 
-    for (uint32_t i = 0; i < CONFIG_NUM_JPEG_BUFFERS; i ++)
+#if !CONFIG_JPEG_PACKET_SINK
+    ret_val = frame_pool_init(&jpeg_frame_pool, CONFIG_JPEG_POOL_SIZE);
+    if (ret_val != ESP_OK)
+    {
+    	return ret_val;
+    }
+#endif
+
+#if CONFIG_JPEG_STRIP_STREAMING
+    jpeg_strip_queue = xQueueCreateStatic(JPEG_STRIP_QUEUE_LEN, sizeof(camera_strip_t), (uint8_t*) jpeg_strip_queue_buffer, &jpeg_strip_queue_data);
+    if (jpeg_strip_queue == NULL)
     {
-    	jpeg_frames_ctrl[i].checked_out = pdFALSE;
-		jpeg_frames_ctrl[i].frame.buf = jpeg_buf[i];
-		jpeg_frames_ctrl[i].frame.buf_max_size = CONFIG_JPEG_BUF_SIZE_MAX;
-		jpeg_frames_ctrl[i].frame.buf_written_size = 0;
-        xQueueSend(jpeg_in_queue, (void *) &i, 0); //newly initialized buffers are ready to fill, send to "in" queue
+    	ret_val = ESP_FAIL;
+    	return ret_val;
     }
 
+    //a strip is one row of MCUs
+    ret_val = esp_camera_set_strip_consumer(JPEG_MCU_HEIGHT(JPEG_COLORSPACE), jpeg_strip_consumer, NULL);
+    if (ret_val != ESP_OK)
+    {
+    	return ret_val;
+    }
+#endif
+
+#if CONFIG_CAMERA_STATS
+    camera_stats.mutx = xSemaphoreCreateMutexStatic(&camera_stats.mutx_buf);
+    if (camera_stats.mutx == NULL)
+    {
+    	ret_val = ESP_FAIL;
+    	return ret_val;
+    }
+#endif
+
+#if CONFIG_CAMERA_MOTION_DETECT
+    ret_val = camera_motion_init(resolution[camera_config.frame_size][0], resolution[camera_config.frame_size][1]);
+    if (ret_val != ESP_OK)
+    {
+    	return ret_val;
+    }
+#endif
+
 //    xTaskCreatePinnedToCore(camera_module_task, "camera_module_task", 2048, NULL, CAMERA_TASK_PRIO, &camera_task, 1);
 //	camera_task = xTaskCreateStaticPinnedToCore(camera_module_task, "camera_module_task", CAMERA_MODULE_TASK_SIZE, NULL, CAMERA_TASK_PRIO, (StackType_t*)camera_task_stack, (StaticTask_t*) &camera_task_buffer, 1);
 
-    xTaskCreatePinnedToCore(jpeg_encode_task, "jpeg_encode", 2048, NULL, CAMERA_TASK_PRIO, NULL, 1);
+    for (uint32_t i = 0; i < CONFIG_NUM_JPEG_ENCODE_TASKS; i ++)
+    {
+    	jpeg_encoder_ctx_init(&jpeg_encode_tasks[i].encoder);
+    	jpeg_set_restart_interval(&jpeg_encode_tasks[i].encoder, CONFIG_JPEG_RESTART_ROWS);
+    	jpeg_set_colorspace(&jpeg_encode_tasks[i].encoder, JPEG_COLORSPACE);
+    	jpeg_set_quality(&jpeg_encode_tasks[i].encoder, CONFIG_JPEG_QUALITY);
+    	jpeg_set_target_size(&jpeg_encode_tasks[i].encoder, CONFIG_JPEG_BUF_SIZE_MAX * CONFIG_JPEG_TARGET_SIZE_PERCENT / 100);
+    	jpeg_set_huffman_optimize(&jpeg_encode_tasks[i].encoder, CONFIG_JPEG_HUFFMAN_OPTIMIZE_FRAMES);
+#if CONFIG_CAMERA_STATS
+    	jpeg_set_stats(&jpeg_encode_tasks[i].encoder, &jpeg_encode_tasks[i].stats);
+#endif
+    	jpeg_encode_tasks[i].capture_turn = xSemaphoreCreateBinaryStatic(&jpeg_encode_tasks[i].capture_turn_buf);
+    	jpeg_encode_tasks[i].publish_turn = xSemaphoreCreateBinaryStatic(&jpeg_encode_tasks[i].publish_turn_buf);
+    	if (jpeg_encode_tasks[i].capture_turn == NULL || jpeg_encode_tasks[i].publish_turn == NULL)
+    	{
+    		ret_val = ESP_FAIL;
+    		return ret_val;
+    	}
+    }
+
+#if CONFIG_JPEG_REPLENISH
+    jpeg_replenish.sig_count = JPEG_REPLENISH_SIG_COUNT(resolution[CAMERA_FRAME_SIZE_MAX][0], resolution[CAMERA_FRAME_SIZE_MAX][1]);
+    jpeg_replenish.sig = malloc(jpeg_replenish.sig_count * sizeof(uint32_t));
+    jpeg_replenish.keyframe_period = CONFIG_JPEG_REPLENISH_KEYFRAME_PERIOD;
+    jpeg_replenish.threshold = CONFIG_JPEG_REPLENISH_THRESHOLD;
+    if (jpeg_replenish.sig == NULL)
+    {
+    	ret_val = ESP_ERR_NO_MEM;
+    	return ret_val;
+    }
+
+    ret_val = jpeg_set_replenish(&jpeg_encode_tasks[0].encoder, &jpeg_replenish);
+    if (ret_val != ESP_OK)
+    {
+    	return ret_val;
+    }
+#endif
+
+    //first task starts with both turns
+    xSemaphoreGive(jpeg_encode_tasks[0].capture_turn);
+    xSemaphoreGive(jpeg_encode_tasks[0].publish_turn);
+
+    for (uint32_t i = 0; i < CONFIG_NUM_JPEG_ENCODE_TASKS; i ++)
+    {
+    	//task 0 keeps core 1 as before, the second task runs on core 0
+    	if (i < JPEG_FRAME_ENCODE_TASKS)
+    	{
+    		xTaskCreatePinnedToCore(jpeg_encode_task, "jpeg_encode", JPEG_ENCODE_TASK_SIZE, (void *) i, CAMERA_TASK_PRIO, &jpeg_encode_tasks[i].task, 1 - (i & 1));
+    	}
+#if CONFIG_JPEG_STRIPE_PARALLEL
+    	else
+    	{
+    		xTaskCreatePinnedToCore(jpeg_stripe_worker_task, "jpeg_stripe", JPEG_ENCODE_TASK_SIZE, (void *) i, CAMERA_TASK_PRIO, &jpeg_encode_tasks[i].task, 1 - (i & 1));
+    	}
+#endif
+    }
 
 	return ret_val;
 }
 
 esp_err_t camera_get_jpeg(void** buf_adr, uint32_t* size, TickType_t xTicksToWait)
 {
+#if CONFIG_JPEG_PACKET_SINK
+	return ESP_ERR_NOT_SUPPORTED; //frames go out through the encoders' sinks
+#else
+	frame_t * frame = NULL;
+	esp_err_t ret_val = camera_get_frame(&frame, xTicksToWait);
+	if (ret_val == ESP_OK)
+	{
+		*buf_adr = (void*) frame->data;
+		*size = frame->size;
+	}
+	return ret_val;
+#endif
+}
+
+esp_err_t camera_return_jpeg(void *buf_adr)
+{
+#if CONFIG_JPEG_PACKET_SINK
+	return ESP_ERR_NOT_SUPPORTED;
+#else
 	esp_err_t ret_val = ESP_OK;
 
-	uint32_t index = CONFIG_NUM_JPEG_BUFFERS;
-	if (xQueueReceive(jpeg_out_queue, (void*) &index, xTicksToWait) != pdTRUE)
+	frame_t * frame = frame_pool_find(&jpeg_frame_pool, buf_adr); //the frame's header is right before its data
+	if (frame == NULL) //buffer address not found
 	{
-		ret_val = ESP_ERR_TIMEOUT;
+		ret_val = ESP_ERR_INVALID_ARG;
 	}
-	else if (index < CONFIG_NUM_JPEG_BUFFERS && jpeg_frames_ctrl[index].checked_out == pdFALSE)
+	else
 	{
-		*buf_adr = (void*) jpeg_frames_ctrl[index].frame.buf;
-		*size = jpeg_frames_ctrl[index].frame.buf_written_size;
-		jpeg_frames_ctrl[index].checked_out = pdTRUE;
-		ret_val = ESP_OK;
+		ret_val = camera_frame_release(frame);
 	}
-	else //shouldn't happen
+	return ret_val;
+#endif
+}
+
+esp_err_t camera_get_frame(frame_t ** frame, TickType_t xTicksToWait)
+{
+#if CONFIG_JPEG_PACKET_SINK
+	return ESP_ERR_NOT_SUPPORTED;
+#else
+	if (frame == NULL)
 	{
-		ESP_LOGE(TAG, "Invalid state, unable to acquire lock on received frame buffer.");
-		ret_val = ESP_ERR_INVALID_STATE;
+		return ESP_ERR_INVALID_ARG;
+	}
+
+	//the queue's reference passes to the caller
+	if (xQueueReceive(jpeg_out_queue, (void*) frame, xTicksToWait) != pdTRUE)
+	{
+		return ESP_ERR_TIMEOUT;
+	}
+	camera_count(&camera_counters.sent);
+	return ESP_OK;
+#endif
+}
+
+void camera_frame_ref(frame_t * frame)
+{
+	frame_ref(frame);
+}
+
+esp_err_t camera_frame_release(frame_t * frame)
+{
+#if CONFIG_JPEG_PACKET_SINK
+	return ESP_ERR_NOT_SUPPORTED;
+#else
+	esp_err_t ret_val = frame_release(&jpeg_frame_pool, frame);
+	if (ret_val != ESP_OK)
+	{
+		ESP_LOGE(TAG, "Invalid state, cannot return frame buffer without first acquiring it.");
 	}
 	return ret_val;
+#endif
 }
 
-esp_err_t camera_return_jpeg(void *buf_adr)
+esp_err_t camera_set_jpeg_sink(uint32_t encoder, huffman_sink_t sink, void * arg)
 {
-	esp_err_t ret_val = ESP_OK;
+	if (encoder >= JPEG_FRAME_ENCODE_TASKS)
+	{
+		return ESP_ERR_INVALID_ARG;
+	}
 
-	uint32_t index = find_frame_from_buf_adr(buf_adr);
-	if (index >= CONFIG_NUM_JPEG_BUFFERS) //buffer address not found
+	return jpeg_set_output_sink(&jpeg_encode_tasks[encoder].encoder, sink, arg);
+}
+
+esp_err_t camera_set_encoder(camera_encoder_t encoder)
+{
+	if (encoder >= CAMERA_ENCODER_COUNT)
 	{
-		ret_val = ESP_ERR_INVALID_ARG;
+		return ESP_ERR_INVALID_ARG;
 	}
-	else if (jpeg_frames_ctrl[index].checked_out == pdTRUE)
+	if (camera_encoder_backends[encoder].encode == NULL)
 	{
-		jpeg_frames_ctrl[index].checked_out = pdFALSE;
-	    xQueueSend(jpeg_in_queue, (void *) &index, 0); //guaranteed to succeed given queue size is the number of available buffers and protection from repeated returns w/o additional checkout by mutex
-	    buf_adr = NULL;
-	    ret_val = ESP_OK;
+		return ESP_ERR_NOT_SUPPORTED;
 	}
-	else
+
+	if (encoder != camera_encoder)
 	{
-		ESP_LOGE(TAG, "Invalid state, cannot return frame buffer without first acquiring it.");
-		ret_val = ESP_ERR_INVALID_STATE;
+		ESP_LOGI(TAG, "encoder %s", camera_encoder_backends[encoder].name);
+		camera_encoder = encoder;
+	}
+	return ESP_OK;
+}
+
+camera_encoder_t camera_get_encoder(void)
+{
+	return camera_encoder;
+}
+
+esp_err_t camera_set_drop_policy(camera_drop_policy_t policy, uint32_t depth)
+{
+#if CONFIG_JPEG_PACKET_SINK
+	return ESP_ERR_NOT_SUPPORTED; //frames aren't queued
+#else
+	if (policy >= CAMERA_DROP_POLICY_COUNT || depth == 0 || depth > CONFIG_NUM_JPEG_BUFFERS)
+	{
+		return ESP_ERR_INVALID_ARG;
+	}
+
+	camera_drop_policy = policy;
+	camera_queue_depth = depth; //frames already queued beyond the new depth leave with the next published frame
+	return ESP_OK;
+#endif
+}
+
+esp_err_t camera_get_frame_info(uint32_t encoder, jpeg_frame_info_t * info)
+{
+	if (encoder >= JPEG_FRAME_ENCODE_TASKS || info == NULL)
+	{
+		return ESP_ERR_INVALID_ARG;
+	}
+
+	*info = jpeg_encode_tasks[encoder].output.info;
+	return ESP_OK;
+}
+
+void camera_get_frame_counters(camera_frame_counters_t * counters)
+{
+	counters->captured = __atomic_load_n(&camera_counters.captured, __ATOMIC_RELAXED);
+	counters->skipped = __atomic_load_n(&camera_counters.skipped, __ATOMIC_RELAXED);
+	counters->encoded = __atomic_load_n(&camera_counters.encoded, __ATOMIC_RELAXED);
+	counters->failed = __atomic_load_n(&camera_counters.failed, __ATOMIC_RELAXED);
+	counters->stolen = __atomic_load_n(&camera_counters.stolen, __ATOMIC_RELAXED);
+	counters->dropped = __atomic_load_n(&camera_counters.dropped, __ATOMIC_RELAXED);
+	counters->sent = __atomic_load_n(&camera_counters.sent, __ATOMIC_RELAXED);
+	counters->queued = uxQueueMessagesWaiting(jpeg_out_queue);
+}
+
+esp_err_t camera_set_jpeg_roi(const uint8_t * map, uint32_t mcu_cols, uint32_t mcu_rows)
+{
+	esp_err_t ret_val = ESP_OK;
+
+	for (uint32_t i = 0; i < JPEG_FRAME_ENCODE_TASKS && ret_val == ESP_OK; i ++)
+	{
+		ret_val = jpeg_set_roi_map(&jpeg_encode_tasks[i].encoder, map, mcu_cols, mcu_rows);
 	}
+
 	return ret_val;
 }
 
-static uint32_t find_frame_from_buf_adr (void * buf_adr)
+esp_err_t camera_reconfigure(framesize_t frame_size, pixformat_t pixel_format, uint32_t fb_count)
 {
-	uint32_t index = CONFIG_NUM_JPEG_BUFFERS;
-	for (uint32_t i = 0; i < CONFIG_NUM_JPEG_BUFFERS; i ++)
+#if CONFIG_CAMERA_RECONFIGURE
+	if (fb_count == 0)
 	{
-		if (jpeg_frames_ctrl[i].frame.buf == buf_adr)
-		{
-			index = i;
-			break;
-		}
+		fb_count = camera_fb_count; //unchanged
+	}
+
+	int32_t size_index = camera_frame_size_index(frame_size);
+	if (size_index < 0 || size_index > camera_frame_size_index(CAMERA_FRAME_SIZE_MAX) || fb_count < JPEG_FRAME_ENCODE_TASKS)
+	{
+		return ESP_ERR_INVALID_ARG; //every frame encode task needs a camera frame to itself
+	}
+	if (pixel_format != PIXFORMAT_YUV422)
+	{
+		return ESP_ERR_NOT_SUPPORTED; //the encoders take YUYV frames
 	}
-	return index;
+
+	xSemaphoreTake(camera_geometry.mutx, portMAX_DELAY);
+	esp_err_t ret_val = camera_geometry_apply(camera_geometry_frame_size(frame_size), pixel_format, fb_count);
+	if (ret_val == ESP_OK)
+	{
+		camera_geometry.frame_size = frame_size;
+	}
+	xSemaphoreGive(camera_geometry.mutx);
+	return ret_val;
+#else
+	return ESP_ERR_NOT_SUPPORTED; //buffers and, with CONFIG_JPEG_FIXED_FRAME, the encoder are built for CAMERA_FRAME_SIZE
+#endif
 }
 
 
 static void jpeg_encode_task (void *parameters)
 {
+	uint32_t task_index = (uint32_t) parameters;
+	jpeg_encode_task_ctrl_t * self = &jpeg_encode_tasks[task_index];
+	jpeg_encode_task_ctrl_t * next = &jpeg_encode_tasks[(task_index + 1) % JPEG_FRAME_ENCODE_TASKS];
+
 	while (1)
 	{
+		xSemaphoreTake(self->capture_turn, portMAX_DELAY);
+#if CONFIG_CAMERA_RECONFIGURE
+		if (task_index == 0)
+		{
+			camera_geometry_follow();
+		}
+		camera_geometry_enter();
+#endif
+
+#if CONFIG_CAMERA_ADAPTIVE
+	    camera_adapt_apply(self);
+#endif
+	    esp_err_t status = ESP_FAIL; //frame not encoded
+	    self->no_buffer = pdFALSE;
+
+#if CONFIG_JPEG_STRIP_STREAMING
+	    camera_fb_t * fb = jpeg_stream_frame(self, next, &status); //passes the capture turn on as soon as the frame is captured
+
+	    if (fb == NULL)
+	    {
+	    	ESP_LOGE(TAG, "NULL frame");
+	    }
+#else
 	    camera_fb_t * fb = esp_camera_fb_get(); //this function is blocking
+
+	    BaseType_t acquired = (fb != NULL && camera_frame_wanted()) ? jpeg_frame_acquire(self) : pdFALSE;
+
+	    xSemaphoreGive(next->capture_turn);
+
 	    if (fb == NULL)	//if fb is null -> send err event to fsm handle
 	    {
 //	    	hsm_send_evt_urgent(&hsm_system_mgmt, EVENT_FAULT, portMAX_DELAY);
 	    	ESP_LOGE(TAG, "NULL frame");
-	    	continue;
 	    }
+	    else if (acquired == pdTRUE && jpeg_output_ready(self))
+	    {
+		    status = jpeg_encode_frame(self, fb, &self->output);
+	    }
+#endif
 
-	    uint32_t index = CONFIG_NUM_JPEG_BUFFERS;
-	    if (xQueueReceive(jpeg_in_queue, (void*) &index, 0) != pdTRUE)
+	    if (fb != NULL)
 	    {
-	    	xQueueReceive(jpeg_out_queue, (void*) &index, 0);
+	    	camera_count(&camera_counters.captured);
+	    	if (self->no_buffer == pdTRUE)
+	    	{
+	    		camera_count(&camera_counters.dropped);
+	    	}
 	    }
 
-	    if (index < CONFIG_NUM_JPEG_BUFFERS)
+#if CONFIG_JPEG_PACKET_SINK
+	    if (status == ESP_OK)
 	    {
-		    jpeg_encode(fb->buf, fb->len, fb->width, fb->height, &jpeg_frames_ctrl[index].frame);
-		    xQueueSend(jpeg_out_queue, (void *) &index, 0); //guaranteed to succeed given queue size is the number f available buffers
+	    	camera_count(&camera_counters.sent); //the sink has sent the frame while it was encoded, nothing to publish
 	    }
+#else
+	    //publish in capture order, the turn is passed on even if this task has nothing to publish
+	    xSemaphoreTake(self->publish_turn, portMAX_DELAY);
+	    jpeg_frame_publish(self, status);
+	    xSemaphoreGive(next->publish_turn);
+#endif
 
 	    esp_camera_fb_return(fb);
+#if CONFIG_CAMERA_RECONFIGURE
+	    xSemaphoreGive(camera_geometry.tokens);
+#endif
 	    portYIELD(); //vtaskdelay?
 	}
 }
 
+static esp_err_t jpeg_encode_frame (jpeg_encode_task_ctrl_t * self, camera_fb_t * fb, jpeg_t * frame)
+{
+	const camera_encoder_backend_t * backend = &camera_encoder_backends[camera_encoder];
+
+	jpeg_frame_info_begin(frame, fb);
+	esp_err_t ret_val = backend->encode(self, fb, frame);
+	frame->info.encode_end_us = esp_timer_get_time();
+
+	camera_count_encode(ret_val);
+	if (backend->analysed == pdTRUE)
+	{
+#if CONFIG_CAMERA_MOTION_DETECT
+		camera_motion_update(fb, frame, ret_val);
+#endif
+#if CONFIG_CAMERA_STATS
+		camera_stats_update(self);
+#endif
+	}
+#if CONFIG_CAMERA_MOTION_DETECT
+	else
+	{
+		camera_motion_unknown(); //the stale map of the last analysed frame says nothing about this one
+	}
+#endif
+	return ret_val;
+}
+
+static esp_err_t camera_encode_jpegenc (jpeg_encode_task_ctrl_t * self, camera_fb_t * fb, jpeg_t * frame)
+{
+	esp_err_t ret_val;
+
+#if CONFIG_JPEG_STRIPE_PARALLEL
+	ret_val = jpeg_encode_parallel_begin(&self->encoder, &jpeg_stripe_job, fb->buf, fb->len, fb->width, fb->height, frame, CONFIG_NUM_JPEG_ENCODE_TASKS);
+	if (ret_val != ESP_OK)
+	{
+		return ret_val;
+	}
+
+	for (uint32_t part = 1; part < jpeg_stripe_job.num_parts; part ++)
+	{
+		xTaskNotifyGive(jpeg_encode_tasks[part].task);
+	}
+
+	jpeg_encode_part(&self->encoder, &jpeg_stripe_job, 0);
+
+	for (uint32_t part = 1; part < jpeg_stripe_job.num_parts; part ++)
+	{
+		ulTaskNotifyTake(pdFALSE, portMAX_DELAY); //one notification per finished part
+	}
+
+	ret_val = jpeg_encode_parallel_end(&self->encoder, &jpeg_stripe_job);
+#else
+	ret_val = jpeg_encode(&self->encoder, fb->buf, fb->len, fb->width, fb->height, frame);
+#endif
+
+	return ret_val;
+}
+
+#if CONFIG_CAMERA_ENCODER_JPGE
+//the camera driver's encoder, always 4:2:0 through RGB and without rate control. Quality is the one the jpegenc rate
+//control has settled on, so switching backends keeps the picture comparable
+static esp_err_t camera_encode_jpge (jpeg_encode_task_ctrl_t * self, camera_fb_t * fb, jpeg_t * frame)
+{
+	frame->buf_written_size = 0;
+	frame->info.quality = jpeg_get_quality(&self->encoder);
+
+	if (!fmt2jpg_cb(fb->buf, fb->len, fb->width, fb->height, fb->format, frame->info.quality, camera_jpge_output, frame)
+			|| frame->buf_written_size > frame->buf_max_size)
+	{
+		ESP_LOGW(TAG, "jpge frame doesn't fit");
+		frame->buf_written_size = 0;
+		return ESP_ERR_NO_MEM;
+	}
+
+	return ESP_OK;
+}
+
+//jpge output callback, the frame is marked as overflowed (written size past the buffer) once the buffer is full
+static size_t camera_jpge_output (void * arg, size_t index, const void * data, size_t len)
+{
+	jpeg_t * frame = (jpeg_t *) arg;
+
+	if (data == NULL)
+	{
+		return 0; //end of image
+	}
+	if (frame->buf_written_size + len > frame->buf_max_size)
+	{
+		frame->buf_written_size = frame->buf_max_size + 1;
+		return 0;
+	}
+
+	memcpy(frame->buf + frame->buf_written_size, data, len);
+	frame->buf_written_size += len;
+	return len;
+}
+#endif
+
+//JPEG buffer to encode the next frame into. With CAMERA_DROP_OLDEST frames waiting to be sent are dropped, oldest first,
+//until the new one fits. Only the pool's oldest frame gives space back, once it is held elsewhere (e.g. being sent) no
+//more are dropped. pdFALSE (and self->no_buffer set) if there is no room for it
+static BaseType_t jpeg_frame_acquire (jpeg_encode_task_ctrl_t * self)
+{
+	self->output.buf_written_size = 0;
+
+#if CONFIG_JPEG_PACKET_SINK
+	return pdTRUE; //frame goes to the sink, only its size is kept
+#else
+	frame_t * frame = frame_pool_alloc(&jpeg_frame_pool, CONFIG_JPEG_BUF_SIZE_MAX);
+	frame_t * queued = NULL;
+	while (frame == NULL && camera_drop_policy == CAMERA_DROP_OLDEST && xQueuePeek(jpeg_out_queue, (void *) &queued, 0) == pdTRUE
+			&& frame_pool_is_oldest(&jpeg_frame_pool, queued))
+	{
+		jpeg_frame_drop_oldest();
+		frame = frame_pool_alloc(&jpeg_frame_pool, CONFIG_JPEG_BUF_SIZE_MAX);
+	}
+
+	self->frame = frame;
+	if (frame == NULL)
+	{
+		self->no_buffer = pdTRUE; //frames still being sent (or held, or kept by CAMERA_DROP_NEWEST) take the pool
+		return pdFALSE;
+	}
+
+	self->output.buf = frame->data;
+	self->output.buf_max_size = frame->capacity;
+	return pdTRUE;
+#endif
+}
+
+//queues the frame the task has encoded, trimmed to its size, or frees it if it failed. At most camera_queue_depth frames
+//wait, the oldest of them or the new one is dropped depending on the policy. Called in capture order
+static void jpeg_frame_publish (jpeg_encode_task_ctrl_t * self, esp_err_t status)
+{
+#if !CONFIG_JPEG_PACKET_SINK
+	frame_t * frame = self->frame;
+	self->frame = NULL;
+
+	if (frame == NULL)
+	{
+		return;
+	}
+
+	if (status != ESP_OK)
+	{
+		frame_release(&jpeg_frame_pool, frame);
+		return;
+	}
+
+	frame_pool_trim(&jpeg_frame_pool, frame, self->output.buf_written_size);
+	frame->info = self->output.info;
+
+	if (camera_drop_policy == CAMERA_DROP_NEWEST && uxQueueMessagesWaiting(jpeg_out_queue) >= camera_queue_depth)
+	{
+		camera_count(&camera_counters.dropped);
+		jpeg_frame_drop(frame);
+		return;
+	}
+
+	while (uxQueueMessagesWaiting(jpeg_out_queue) >= camera_queue_depth || xQueueSend(jpeg_out_queue, (void *) &frame, 0) != pdTRUE)
+	{
+		jpeg_frame_drop_oldest(); //the sender only gets the freshest frames
+	}
+#endif
+}
+
+//drops the oldest frame waiting to be sent, the pool gets its space back unless a consumer still holds it
+static void jpeg_frame_drop_oldest (void)
+{
+#if !CONFIG_JPEG_PACKET_SINK
+	frame_t * frame = NULL;
+	if (xQueueReceive(jpeg_out_queue, (void*) &frame, 0) == pdTRUE)
+	{
+		camera_count(&camera_counters.stolen);
+		jpeg_frame_drop(frame);
+	}
+#endif
+}
+
+//stamps the frame with where it comes from before it is encoded, the encoder adds its quality
+static void jpeg_frame_info_begin (jpeg_t * frame, camera_fb_t * fb)
+{
+	frame->info.capture_us = fb->timestamp;
+	frame->info.seq = fb->seq;
+	frame->info.width = fb->width;
+	frame->info.height = fb->height;
+	frame->info.encode_start_us = esp_timer_get_time();
+	frame->info.encode_end_us = 0;
+}
+
+//frees an encoded frame that is never sent
+static void jpeg_frame_drop (frame_t * frame)
+{
+#if !CONFIG_JPEG_PACKET_SINK
+	frame_release(&jpeg_frame_pool, frame);
+#if CONFIG_JPEG_REPLENISH
+	jpeg_replenish.keyframe_pending = true; //the receiver misses the frame's changes, it needs a complete one
+#endif
+#endif
+}
+
+static inline void camera_count (uint32_t * counter)
+{
+	__atomic_fetch_add(counter, 1, __ATOMIC_RELAXED);
+}
+
+static void camera_count_encode (esp_err_t status)
+{
+	camera_count((status == ESP_OK) ? &camera_counters.encoded : &camera_counters.failed);
+}
+
+//false for frames that are left out, by the back-pressure controller or because nothing moves. Called in capture order
+static BaseType_t camera_frame_wanted (void)
+{
+#if CONFIG_CAMERA_ADAPTIVE
+	if (++ camera_adapt.skipped_frames < camera_adapt_ladder[camera_adapt.rung].frame_divisor)
+	{
+		camera_count(&camera_counters.skipped);
+		return pdFALSE;
+	}
+	camera_adapt.skipped_frames = 0;
+#endif
+	return camera_motion_frame_wanted();
+}
+
+//false for frames that are skipped because nothing has moved for a while, one in CONFIG_CAMERA_MOTION_IDLE_DIVISOR is still
+//encoded (and sent) so motion is noticed. Called in capture order
+static BaseType_t camera_motion_frame_wanted (void)
+{
+#if CONFIG_CAMERA_MOTION_DETECT
+	BaseType_t wanted = pdTRUE;
+
+	xSemaphoreTake(camera_motion.mutx, portMAX_DELAY);
+	if (camera_motion.still_frames >= CONFIG_CAMERA_MOTION_HOLD_FRAMES && ++ camera_motion.skipped_frames < CONFIG_CAMERA_MOTION_IDLE_DIVISOR)
+	{
+		wanted = pdFALSE;
+		camera_count(&camera_counters.skipped);
+	}
+	else
+	{
+		camera_motion.skipped_frames = 0;
+	}
+	xSemaphoreGive(camera_motion.mutx);
+
+	return wanted;
+#else
+	return pdTRUE;
+#endif
+}
+
+#if CONFIG_CAMERA_MOTION_DETECT
+//maps are allocated for CAMERA_FRAME_SIZE_MAX, camera_motion_resize() switches between smaller frame sizes
+static esp_err_t camera_motion_init (uint32_t frame_width, uint32_t frame_height)
+{
+	uint32_t map_size_max = JPEG_LUMA_MAP_SIZE(resolution[CAMERA_FRAME_SIZE_MAX][0], resolution[CAMERA_FRAME_SIZE_MAX][1]);
+
+	camera_motion.mutx = xSemaphoreCreateMutexStatic(&camera_motion.mutx_buf);
+	camera_motion.map_size = JPEG_LUMA_MAP_SIZE(frame_width, frame_height);
+	camera_motion.map_prev = malloc(map_size_max);
+	camera_motion.map_prev_valid = pdFALSE;
+	camera_motion.changed_blocks = 0;
+	camera_motion.still_frames = 0;
+	camera_motion.skipped_frames = 0;
+
+	if (camera_motion.mutx == NULL || camera_motion.map_prev == NULL)
+	{
+		return ESP_ERR_NO_MEM;
+	}
+
+	for (uint32_t i = 0; i < JPEG_FRAME_ENCODE_TASKS; i ++)
+	{
+		jpeg_encode_tasks[i].output.luma_map = malloc(map_size_max);
+		jpeg_encode_tasks[i].output.luma_map_size = map_size_max;
+		if (jpeg_encode_tasks[i].output.luma_map == NULL)
+		{
+			return ESP_ERR_NO_MEM;
+		}
+	}
+
+	return ESP_OK;
+}
+
+//the next frame's map is compared with nothing, frames of the new size count as motion until one has been seen
+static void camera_motion_resize (uint32_t frame_width, uint32_t frame_height)
+{
+	xSemaphoreTake(camera_motion.mutx, portMAX_DELAY);
+	camera_motion.map_size = JPEG_LUMA_MAP_SIZE(frame_width, frame_height);
+	camera_motion.map_prev_valid = pdFALSE;
+	camera_motion.still_frames = 0;
+	xSemaphoreGive(camera_motion.mutx);
+}
+
+//counts the blocks of the frame's luma map that changed by more than CONFIG_CAMERA_MOTION_THRESHOLD since the last frame,
+//there is motion if at least CONFIG_CAMERA_MOTION_BLOCKS did
+static void camera_motion_update (camera_fb_t * fb, jpeg_t * frame, esp_err_t status)
+{
+	if (status != ESP_OK || JPEG_LUMA_MAP_SIZE(fb->width, fb->height) != camera_motion.map_size)
+	{
+		return; //no map
+	}
+
+	xSemaphoreTake(camera_motion.mutx, portMAX_DELAY);
+
+	uint32_t changed = 0;
+	for (uint32_t i = 0; i < camera_motion.map_size; i ++)
+	{
+		if (abs(frame->luma_map[i] - camera_motion.map_prev[i]) > CONFIG_CAMERA_MOTION_THRESHOLD)
+		{
+			changed ++;
+		}
+	}
+
+	if (camera_motion.map_prev_valid == pdFALSE)
+	{
+		changed = camera_motion.map_size; //first frame
+	}
+
+	memcpy(camera_motion.map_prev, frame->luma_map, camera_motion.map_size);
+	camera_motion.map_prev_valid = pdTRUE;
+	camera_motion.changed_blocks = changed;
+	camera_motion.still_frames = (changed >= CONFIG_CAMERA_MOTION_BLOCKS) ? 0 : camera_motion.still_frames + 1;
+
+	xSemaphoreGive(camera_motion.mutx);
+}
+
+//a frame without a luma map counts as motion, so the frame rate doesn't drop while nothing is measured. The next map is
+//compared with nothing
+static void camera_motion_unknown (void)
+{
+	xSemaphoreTake(camera_motion.mutx, portMAX_DELAY);
+	camera_motion.map_prev_valid = pdFALSE;
+	camera_motion.changed_blocks = camera_motion.map_size;
+	camera_motion.still_frames = 0;
+	xSemaphoreGive(camera_motion.mutx);
+}
+#endif
+
+BaseType_t camera_motion_detected (uint32_t * changed_blocks)
+{
+#if CONFIG_CAMERA_MOTION_DETECT
+	xSemaphoreTake(camera_motion.mutx, portMAX_DELAY);
+	BaseType_t motion = (camera_motion.still_frames < CONFIG_CAMERA_MOTION_HOLD_FRAMES) ? pdTRUE : pdFALSE;
+	if (changed_blocks != NULL)
+	{
+		*changed_blocks = camera_motion.changed_blocks;
+	}
+	xSemaphoreGive(camera_motion.mutx);
+	return motion;
+#else
+	if (changed_blocks != NULL)
+	{
+		*changed_blocks = 0;
+	}
+	return pdFALSE;
+#endif
+}
+
+#if CONFIG_CAMERA_STATS
+//adds the frame the task just encoded
+static void camera_stats_update (jpeg_encode_task_ctrl_t * self)
+{
+	const jpeg_stats_t * frame = &self->stats;
+	camera_stats_t * stats = &camera_stats.stats;
+	uint32_t ticks = 0;
+
+	xSemaphoreTake(camera_stats.mutx, portMAX_DELAY);
+
+	stats->frames ++;
+	stats->frames_failed += (frame->size == 0) ? 1 : 0;
+	stats->keyframes += (frame->size != 0 && frame->keyframe) ? 1 : 0;
+	stats->overflows += frame->overflows;
+	for (uint32_t stage = 0; stage < JPEG_STAGE_COUNT; stage ++)
+	{
+		stats->ticks[stage] += frame->ticks[stage];
+		ticks += frame->ticks[stage];
+	}
+	for (uint32_t i = 0; i < 3; i ++)
+	{
+		stats->bits[i] += frame->component[i].bits;
+		stats->nonzero[i] += frame->component[i].nonzero;
+		stats->eob += frame->component[i].eob;
+		stats->zrl += frame->component[i].zrl;
+	}
+	stats->last = *frame;
+
+	//the oldest frame leaves the window
+	uint32_t slot = camera_stats.next;
+	if (stats->window == CONFIG_CAMERA_STATS_WINDOW)
+	{
+		stats->encode_time_hist[camera_stats.time_bins[slot]] --;
+		if (camera_stats.size_bins[slot] != CAMERA_STATS_NO_BIN)
+		{
+			stats->size_hist[camera_stats.size_bins[slot]] --;
+		}
+	}
+	else
+	{
+		stats->window ++;
+	}
+
+	camera_stats.time_bins[slot] = camera_stats_bin(ticks / CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ, CONFIG_CAMERA_STATS_TIME_BIN_US);
+	camera_stats.size_bins[slot] = (frame->size != 0) ? camera_stats_bin(frame->size, CONFIG_CAMERA_STATS_SIZE_BIN) : CAMERA_STATS_NO_BIN;
+	stats->encode_time_hist[camera_stats.time_bins[slot]] ++;
+	if (camera_stats.size_bins[slot] != CAMERA_STATS_NO_BIN)
+	{
+		stats->size_hist[camera_stats.size_bins[slot]] ++;
+	}
+	camera_stats.next = (slot + 1) % CONFIG_CAMERA_STATS_WINDOW;
+
+	xSemaphoreGive(camera_stats.mutx);
+}
+
+//the last bin takes everything above the others
+static uint8_t camera_stats_bin (uint32_t value, uint32_t bin_width)
+{
+	uint32_t bin = value / bin_width;
+	return (bin < CAMERA_STATS_BINS) ? bin : CAMERA_STATS_BINS - 1;
+}
+#endif
+
+void camera_report_send(uint32_t send_time_ms, esp_err_t status)
+{
+#if CONFIG_CAMERA_ADAPTIVE
+	camera_adapt.frames ++;
+	camera_adapt.send_ms += send_time_ms;
+	if (status != ESP_OK)
+	{
+		camera_adapt.send_failures ++;
+	}
+	if (camera_adapt.frames < CONFIG_CAMERA_ADAPT_WINDOW)
+	{
+		return;
+	}
+
+	camera_frame_counters_t counters;
+	camera_get_frame_counters(&counters);
+	uint32_t lost = counters.stolen + counters.dropped; //the sender didn't keep up with the encoders
+	uint32_t send_ms = camera_adapt.send_ms / camera_adapt.frames;
+	uint32_t free_heap = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+
+	//limits are halved (heap: raised by half) to step up again, so the stream doesn't oscillate between two rungs
+	BaseType_t congested = (camera_adapt.send_failures != 0 || send_ms > CONFIG_CAMERA_ADAPT_SEND_MS || lost != camera_adapt.lost
+			|| free_heap < CONFIG_CAMERA_ADAPT_HEAP_MIN) ? pdTRUE : pdFALSE;
+	BaseType_t clear = (!congested && send_ms <= CONFIG_CAMERA_ADAPT_SEND_MS / 2 && counters.queued < camera_queue_depth
+			&& free_heap >= CONFIG_CAMERA_ADAPT_HEAP_MIN + CONFIG_CAMERA_ADAPT_HEAP_MIN / 2) ? pdTRUE : pdFALSE;
+
+	uint32_t rung = camera_adapt.rung;
+	if (congested && rung + 1 < CAMERA_ADAPT_RUNGS)
+	{
+		rung ++;
+	}
+	if (clear && ++ camera_adapt.clear_windows >= CONFIG_CAMERA_ADAPT_UP_WINDOWS && rung > 0)
+	{
+		rung --;
+	}
+	if (!clear || rung != camera_adapt.rung)
+	{
+		camera_adapt.clear_windows = 0;
+	}
+
+	if (rung != camera_adapt.rung)
+	{
+		ESP_LOGI(TAG, "adapt rung %u: send %u ms, %u failed, %u lost, heap %u", rung, send_ms, camera_adapt.send_failures,
+				lost - camera_adapt.lost, free_heap);
+		camera_adapt.rung = rung; //encode tasks pick it up with their next frame
+	}
+
+	camera_adapt.frames = 0;
+	camera_adapt.send_ms = 0;
+	camera_adapt.send_failures = 0;
+	camera_adapt.lost = lost;
+#else
+	(void) send_time_ms;
+	(void) status;
+#endif
+}
+
+#if CONFIG_CAMERA_ADAPTIVE
+//quality of the controller's rung for the task's encoder, only changed between frames. Changing it makes the next frame a
+//keyframe with conditional replenishment
+static void camera_adapt_apply (jpeg_encode_task_ctrl_t * self)
+{
+	uint32_t rung = camera_adapt.rung;
+
+	if (rung != self->adapt_rung)
+	{
+		int quality = camera_adapt_ladder[rung].quality;
+		jpeg_set_quality(&self->encoder, (quality != 0 && quality < CONFIG_JPEG_QUALITY) ? quality : CONFIG_JPEG_QUALITY);
+		self->adapt_rung = rung;
+	}
+}
+#endif
+
+#if CONFIG_CAMERA_RECONFIGURE
+//reconfigures the camera once the encode tasks have returned their frames, and what depends on the frame size with it. If
+//the camera driver fails the configuration it ran with is restored. Called with camera_geometry.mutx held
+static esp_err_t camera_geometry_apply (framesize_t frame_size, pixformat_t pixel_format, uint32_t fb_count)
+{
+	int64_t start_us = esp_timer_get_time();
+
+	//let the encode tasks finish the frames they have, none gets a new one until the camera is reconfigured
+	for (uint32_t i = 0; i < JPEG_FRAME_ENCODE_TASKS; i ++)
+	{
+		xSemaphoreTake(camera_geometry.tokens, portMAX_DELAY);
+	}
+
+	esp_err_t ret_val = esp_camera_reconfigure(frame_size, pixel_format, fb_count);
+	if (ret_val != ESP_OK)
+	{
+		ESP_LOGE(TAG, "camera reconfiguration failed, restoring");
+		if (esp_camera_reconfigure(camera_geometry.frame_size_current, camera_geometry.pixel_format, camera_fb_count) != ESP_OK)
+		{
+			ESP_LOGE(TAG, "camera restore failed");
+		}
+	}
+	else
+	{
+		camera_geometry.frame_size_current = frame_size;
+		camera_geometry.pixel_format = pixel_format;
+		camera_fb_count = fb_count;
+#if CONFIG_JPEG_STRIP_STREAMING
+		xQueueReset(jpeg_strip_queue); //strips of the frame capture stopped in
+#endif
+#if CONFIG_CAMERA_MOTION_DETECT
+		camera_motion_resize(resolution[frame_size][0], resolution[frame_size][1]);
+#endif
+#if CONFIG_JPEG_REPLENISH
+		jpeg_replenish.keyframe_pending = true; //the stripes the receiver has are of the old size
+#endif
+		ESP_LOGI(TAG, "camera %dx%d, %u frame buffers, frames stopped for %u ms", resolution[frame_size][0], resolution[frame_size][1],
+				fb_count, (uint32_t) ((esp_timer_get_time() - start_us) / 1000));
+	}
+
+	for (uint32_t i = 0; i < JPEG_FRAME_ENCODE_TASKS; i ++)
+	{
+		xSemaphoreGive(camera_geometry.tokens);
+	}
+	return ret_val;
+}
+
+//frame size to capture for the one asked for, with CONFIG_CAMERA_ADAPTIVE the controller's rung may step it down
+static framesize_t camera_geometry_frame_size (framesize_t frame_size)
+{
+#if CONFIG_CAMERA_ADAPTIVE
+	int32_t index = camera_frame_size_index(frame_size) - camera_adapt_ladder[camera_adapt.rung].size_steps;
+	return camera_frame_sizes[(index > 0) ? index : 0];
+#else
+	return frame_size;
+#endif
+}
+
+//follows the frame size of the back-pressure controller, called by the first encode task with its capture turn and without
+//a token. Skipped while a client's reconfiguration is running, it applies the rung itself
+static void camera_geometry_follow (void)
+{
+#if CONFIG_CAMERA_ADAPTIVE
+	if (camera_adapt.rung == camera_geometry.adapt_rung || xSemaphoreTake(camera_geometry.mutx, 0) != pdTRUE)
+	{
+		return;
+	}
+
+	camera_geometry.adapt_rung = camera_adapt.rung; //not retried if it fails
+	framesize_t frame_size = camera_geometry_frame_size(camera_geometry.frame_size);
+	if (frame_size != camera_geometry.frame_size_current)
+	{
+		camera_geometry_apply(frame_size, camera_geometry.pixel_format, camera_fb_count);
+	}
+	xSemaphoreGive(camera_geometry.mutx);
+#endif
+}
+
+//takes the encode task's capture token once it has its capture turn. Waits for a reconfiguration that is running, so a
+//task that has just given its token back can't take it again before the reconfiguration has them all. A token is always
+//free here: the task holds none and only a reconfiguration, which holds mutx, takes more than one
+static void camera_geometry_enter (void)
+{
+	xSemaphoreTake(camera_geometry.mutx, portMAX_DELAY);
+	xSemaphoreTake(camera_geometry.tokens, portMAX_DELAY);
+	xSemaphoreGive(camera_geometry.mutx);
+}
+#endif
+
+//position of the frame size in camera_frame_sizes, -1 if the camera can't capture it as YUYV
+static int32_t camera_frame_size_index (framesize_t frame_size)
+{
+	for (uint32_t i = 0; i < CAMERA_FRAME_SIZES; i ++)
+	{
+		if (camera_frame_sizes[i] == frame_size)
+		{
+			return i;
+		}
+	}
+	return -1;
+}
+
+esp_err_t camera_get_stats (camera_stats_t * stats)
+{
+	if (stats == NULL)
+	{
+		return ESP_ERR_INVALID_ARG;
+	}
+
+#if CONFIG_CAMERA_STATS
+	xSemaphoreTake(camera_stats.mutx, portMAX_DELAY);
+	*stats = camera_stats.stats;
+	xSemaphoreGive(camera_stats.mutx);
+
+	stats->stack_free_min = UINT32_MAX;
+	for (uint32_t i = 0; i < CONFIG_NUM_JPEG_ENCODE_TASKS; i ++)
+	{
+		uint32_t stack_free = uxTaskGetStackHighWaterMark(jpeg_encode_tasks[i].task);
+		stats->stack_free_min = (stack_free < stats->stack_free_min) ? stack_free : stats->stack_free_min;
+	}
+	return ESP_OK;
+#else
+	memset(stats, 0, sizeof(camera_stats_t));
+	return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+//false while there is nowhere to write frames to, i.e. the network module hasn't set the sink yet
+static BaseType_t jpeg_output_ready (jpeg_encode_task_ctrl_t * self)
+{
+#if CONFIG_JPEG_PACKET_SINK
+	return (self->encoder.sink != NULL) ? pdTRUE : pdFALSE;
+#else
+	return pdTRUE;
+#endif
+}
+
+#if CONFIG_JPEG_STRIP_STREAMING
+//called by the camera driver's DMA filter task, must not block
+static void jpeg_strip_consumer (const camera_strip_t * strip, void * arg)
+{
+	if (strip->event != CAMERA_STRIP_DATA || uxQueueSpacesAvailable(jpeg_strip_queue) > JPEG_STRIP_QUEUE_RESERVE)
+	{
+		xQueueSend(jpeg_strip_queue, (void *) strip, 0);
+	}
+}
+
+//encodes the next frame strip by strip while it is being captured. Returns the frame once the driver hands it out, NULL
+//if there is none. status is that of the encode, ESP_FAIL if the frame wasn't encoded
+static camera_fb_t * jpeg_stream_frame (jpeg_encode_task_ctrl_t * self, jpeg_encode_task_ctrl_t * next, esp_err_t * status)
+{
+	jpeg_stream_t stream;
+	camera_fb_t * streaming = NULL; //frame being encoded
+	camera_fb_t * skipped = NULL; //frame left out while nothing moves
+	camera_fb_t * fb = NULL;
+	camera_strip_t strip;
+	BaseType_t acquired = pdFALSE;
+
+	*status = ESP_FAIL;
+
+	while (xQueueReceive(jpeg_strip_queue, (void *) &strip, JPEG_STRIP_WAIT) == pdTRUE)
+	{
+		if (strip.fb != streaming)
+		{
+			//a new frame, or the done event of the last one was lost and the driver has moved on. Frames are only
+			//picked up from their data strips
+			if (strip.event != CAMERA_STRIP_DATA || !jpeg_output_ready(self) || strip.fb == skipped)
+			{
+				continue;
+			}
+
+			if (!camera_frame_wanted())
+			{
+				skipped = strip.fb;
+				continue;
+			}
+
+			if (streaming != NULL)
+			{
+				jpeg_encode_stream_abort(&self->encoder, &stream);
+				streaming = NULL;
+			}
+
+			if (acquired == pdFALSE)
+			{
+				acquired = jpeg_frame_acquire(self);
+			}
+			if (acquired == pdFALSE)
+			{
+				break;
+			}
+
+			streaming = strip.fb;
+			skipped = NULL;
+			jpeg_frame_info_begin(&self->output, streaming);
+			jpeg_encode_stream_begin(&self->encoder, &stream, streaming->buf, strip.bytes_per_line * streaming->height, streaming->width, streaming->height, &self->output);
+		}
+
+		if (strip.event == CAMERA_STRIP_DATA)
+		{
+			jpeg_encode_stream_rows(&self->encoder, &stream, strip.lines);
+			continue;
+		}
+		else if (strip.event == CAMERA_STRIP_FRAME_DROPPED)
+		{
+			jpeg_encode_stream_abort(&self->encoder, &stream);
+			streaming = NULL;
+			continue;
+		}
+
+		//frame is captured, frames still queued in the driver ahead of it are older and weren't streamed, drop them
+		for (uint32_t i = 0; i < camera_fb_count; i ++)
+		{
+			fb = esp_camera_fb_get();
+			if (fb == NULL || fb == streaming)
+			{
+				break;
+			}
+			esp_camera_fb_return(fb);
+			fb = NULL;
+		}
+
+		xSemaphoreGive(next->capture_turn);
+
+		if (fb == NULL)
+		{
+			jpeg_encode_stream_abort(&self->encoder, &stream);
+			return NULL; //the frame is freed unpublished
+		}
+
+		*status = jpeg_encode_stream_end(&self->encoder, &stream);
+		self->output.info.encode_end_us = esp_timer_get_time();
+		camera_count_encode(*status);
+#if CONFIG_CAMERA_STATS
+		camera_stats_update(self);
+#endif
+#if CONFIG_CAMERA_MOTION_DETECT
+		camera_motion_update(fb, &self->output, *status);
+#endif
+		return fb;
+	}
+
+	//no strips are coming because capture isn't running, esp_camera_fb_get() starts it. The frame it returns (or the one
+	//that is in progress when no JPEG buffer was free) is encoded in one go
+	if (streaming != NULL)
+	{
+		jpeg_encode_stream_abort(&self->encoder, &stream);
+	}
+
+	fb = esp_camera_fb_get();
+	xQueueReset(jpeg_strip_queue); //strips of the frame just taken
+	xSemaphoreGive(next->capture_turn);
+
+	if (fb != NULL && acquired == pdFALSE)
+	{
+		acquired = jpeg_frame_acquire(self);
+	}
+
+	if (fb != NULL && acquired == pdTRUE && jpeg_output_ready(self))
+	{
+		*status = jpeg_encode_frame(self, fb, &self->output);
+	}
+	return fb;
+}
+#endif
+
+#if CONFIG_JPEG_STRIPE_PARALLEL
+static void jpeg_stripe_worker_task (void *parameters)
+{
+	uint32_t part = (uint32_t) parameters;
+
+	while (1)
+	{
+		ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+		jpeg_encode_part(&jpeg_encode_tasks[part].encoder, &jpeg_stripe_job, part);
+		xTaskNotifyGive(jpeg_encode_tasks[0].task);
+	}
+}
+#endif
+
 //static uint32_t find_jpeg_buf_index()
 
 //static void camera_module_task(void *pv_parameter)
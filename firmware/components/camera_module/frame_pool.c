@@ -0,0 +1,167 @@
+#include "frame_pool.h"
+
+#include "esp_heap_caps.h"
+
+static void frame_pool_free_oldest (frame_pool_t * pool);
+
+esp_err_t frame_pool_init(frame_pool_t * pool, uint32_t arena_size)
+{
+	//the heap only guarantees 4 byte alignment, the arena starts at the first multiple of FRAME_POOL_ALIGN
+	pool->arena_size = arena_size & ~(FRAME_POOL_ALIGN - 1);
+	pool->arena = heap_caps_malloc(pool->arena_size + FRAME_POOL_ALIGN, MALLOC_CAP_SPIRAM); //PSRAM if the board has it
+	if (pool->arena == NULL)
+	{
+		pool->arena = heap_caps_malloc(pool->arena_size + FRAME_POOL_ALIGN, MALLOC_CAP_8BIT);
+	}
+	if (pool->arena != NULL)
+	{
+		pool->arena = (uint8_t *) (((uintptr_t) pool->arena + FRAME_POOL_ALIGN - 1) & ~(uintptr_t) (FRAME_POOL_ALIGN - 1));
+	}
+	pool->head = 0;
+	pool->tail = 0;
+	pool->newest = 0;
+	pool->frames = 0;
+	pool->mutx = xSemaphoreCreateMutexStatic(&pool->mutx_buf);
+
+	if (pool->arena == NULL || pool->mutx == NULL)
+	{
+		return ESP_ERR_NO_MEM;
+	}
+	return ESP_OK;
+}
+
+frame_t * frame_pool_alloc(frame_pool_t * pool, uint32_t capacity)
+{
+	uint32_t span = FRAME_POOL_SPAN(capacity);
+	frame_t * frame = NULL;
+
+	xSemaphoreTake(pool->mutx, portMAX_DELAY);
+
+	if (pool->frames == 0)
+	{
+		pool->head = 0;
+		pool->tail = 0;
+	}
+
+	uint32_t offset = pool->arena_size; //none
+	if (pool->frames == 0 || pool->head > pool->tail)
+	{
+		//free space is from the head to the end of the arena and from its start to the tail
+		if (pool->arena_size - pool->head >= span)
+		{
+			offset = pool->head;
+		}
+		else if (pool->tail >= span)
+		{
+			((frame_t *) (pool->arena + pool->newest))->span += pool->arena_size - pool->head; //the end is skipped
+			offset = 0;
+		}
+	}
+	else if (pool->tail - pool->head >= span)
+	{
+		offset = pool->head;
+	}
+
+	if (offset != pool->arena_size)
+	{
+		frame = (frame_t *) (pool->arena + offset);
+		frame->refs = 1;
+		frame->span = span;
+		frame->size = 0;
+		frame->capacity = capacity;
+		pool->newest = offset;
+		pool->head = offset + span;
+		pool->frames ++;
+	}
+
+	xSemaphoreGive(pool->mutx);
+	return frame;
+}
+
+void frame_pool_trim(frame_pool_t * pool, frame_t * frame, uint32_t size)
+{
+	xSemaphoreTake(pool->mutx, portMAX_DELAY);
+
+	uint32_t offset = (uint8_t *) frame - pool->arena;
+
+	frame->size = (size < frame->capacity) ? size : frame->capacity;
+	if (offset == pool->newest && offset + frame->span == pool->head)
+	{
+		frame->capacity = frame->size;
+		frame->span = FRAME_POOL_SPAN(frame->size);
+		pool->head = offset + frame->span;
+	}
+
+	xSemaphoreGive(pool->mutx);
+}
+
+bool frame_pool_is_oldest(frame_pool_t * pool, const frame_t * frame)
+{
+	xSemaphoreTake(pool->mutx, portMAX_DELAY);
+	bool oldest = pool->frames != 0 && (const uint8_t *) frame == pool->arena + pool->tail;
+	xSemaphoreGive(pool->mutx);
+	return oldest;
+}
+
+frame_t * frame_pool_find(frame_pool_t * pool, const void * data)
+{
+	const uint8_t * header = (const uint8_t *) data - sizeof(frame_t);
+
+	if (data == NULL || header < pool->arena || header >= pool->arena + pool->arena_size || ((header - pool->arena) & (FRAME_POOL_ALIGN - 1)) != 0)
+	{
+		return NULL;
+	}
+	return (frame_t *) header;
+}
+
+void frame_ref(frame_t * frame)
+{
+	__atomic_add_fetch(&frame->refs, 1, __ATOMIC_RELAXED);
+}
+
+esp_err_t frame_release(frame_pool_t * pool, frame_t * frame)
+{
+	uint32_t refs = __atomic_load_n(&frame->refs, __ATOMIC_RELAXED);
+
+	do
+	{
+		if (refs == 0)
+		{
+			return ESP_ERR_INVALID_STATE;
+		}
+	} while (!__atomic_compare_exchange_n(&frame->refs, &refs, refs - 1, pdTRUE, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+	if (refs == 1)
+	{
+		xSemaphoreTake(pool->mutx, portMAX_DELAY);
+		frame_pool_free_oldest(pool);
+		xSemaphoreGive(pool->mutx);
+	}
+	return ESP_OK;
+}
+
+//moves the tail past the oldest frames that are released, called with the mutex held
+static void frame_pool_free_oldest (frame_pool_t * pool)
+{
+	while (pool->frames != 0)
+	{
+		frame_t * oldest = (frame_t *) (pool->arena + pool->tail);
+		if (__atomic_load_n(&oldest->refs, __ATOMIC_ACQUIRE) != 0)
+		{
+			break;
+		}
+
+		pool->tail += oldest->span;
+		if (pool->tail >= pool->arena_size)
+		{
+			pool->tail = 0;
+		}
+		pool->frames --;
+	}
+
+	if (pool->frames == 0)
+	{
+		pool->head = 0;
+		pool->tail = 0;
+	}
+}
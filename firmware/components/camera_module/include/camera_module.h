@@ -10,10 +10,68 @@
 #include "freertos/task.h"
 #include "esp_err.h"
 
+#include "sensor.h"
+#include "jpeg.h"
+#include "frame_pool.h"
+
 #define CAMERA_MODULE_BASE		40
 
 #define CAMERA_TASK_PRIO		7
 
+#define CAMERA_STATS_BINS		16
+
+//encoder backends, CAMERA_ENCODER_JPGE (the camera driver's jpge) needs CONFIG_CAMERA_ENCODER_JPGE. jpge produces neither a
+//luma map nor encoder stats: its frames count as motion and are left out of camera_get_stats()
+typedef enum
+{
+	CAMERA_ENCODER_JPEGENC,
+	CAMERA_ENCODER_JPGE,
+	CAMERA_ENCODER_COUNT
+} camera_encoder_t;
+
+//what happens to encoded frames when CONFIG_JPEG_QUEUE_DEPTH (or the depth set at runtime) frames already wait to be sent,
+//or when the frame pool has no room for the next frame
+typedef enum
+{
+	CAMERA_DROP_OLDEST, //latest frame wins, the sender always gets the freshest frames
+	CAMERA_DROP_NEWEST, //queued frames are kept, new frames are dropped until the sender catches up
+	CAMERA_DROP_POLICY_COUNT
+} camera_drop_policy_t;
+
+//where frames go between the camera and the sender, counted from start. Every captured frame ends up skipped, dropped,
+//failed or encoded, every encoded frame is sent, stolen, dropped (CAMERA_DROP_NEWEST) or still queued
+typedef struct
+{
+	uint32_t captured; //taken from the camera driver by the encode tasks
+	uint32_t skipped;  //left out while nothing moves (CONFIG_CAMERA_MOTION_DETECT) or by CONFIG_CAMERA_ADAPTIVE
+	uint32_t encoded;
+	uint32_t failed;   //encode failed, e.g. the frame overflowed its buffer
+	uint32_t stolen;   //queued frames dropped unsent to make room for a newer one (CAMERA_DROP_OLDEST)
+	uint32_t dropped;  //frames dropped for lack of a buffer or a queue slot
+	uint32_t sent;     //handed to a consumer, or with CONFIG_JPEG_PACKET_SINK written into the sink
+	uint32_t queued;   //waiting to be sent now
+} camera_frame_counters_t;
+
+//encoder statistics gathered with CONFIG_CAMERA_STATS. Totals count from start, the histograms cover the last
+//CONFIG_CAMERA_STATS_WINDOW frames. In stripe-parallel mode times are the CPU time of all parts of a frame
+typedef struct
+{
+	uint32_t frames;        //encoded, failed ones included
+	uint32_t frames_failed;
+	uint32_t keyframes;     //complete frames, the others are partial (conditional replenishment)
+	uint32_t overflows;     //encode attempts that ran out of output buffer
+	uint64_t ticks[JPEG_STAGE_COUNT]; //CPU cycles
+	uint64_t bits[3];       //Y, Cb, Cr
+	uint64_t nonzero[3];    //coefficients
+	uint64_t eob;
+	uint64_t zrl;
+	uint32_t window;        //frames in the histograms
+	uint32_t encode_time_hist[CAMERA_STATS_BINS]; //bins of CONFIG_CAMERA_STATS_TIME_BIN_US, the last one open-ended
+	uint32_t size_hist[CAMERA_STATS_BINS];        //bins of CONFIG_CAMERA_STATS_SIZE_BIN bytes, failed frames left out
+	jpeg_stats_t last;      //of the last frame
+	uint32_t stack_free_min; //least stack any encode task has had left (its high water mark), bytes
+} camera_stats_t;
+
 extern TaskHandle_t camera_task;
 
 esp_err_t camera_module_init();
@@ -22,4 +80,55 @@ esp_err_t camera_get_jpeg(void** buf_adr, uint32_t* size, TickType_t xTicksToWai
 
 esp_err_t camera_return_jpeg(void *buf_adr);
 
+//next encoded frame, in capture order. The caller gets one reference to it: it can share the frame with more consumers
+//(e.g. a recorder besides the sender) with camera_frame_ref() and each of them releases it with camera_frame_release(),
+//the frame isn't copied. camera_get_jpeg() and camera_return_jpeg() do the same with the frame's data
+esp_err_t camera_get_frame(frame_t ** frame, TickType_t xTicksToWait);
+
+void camera_frame_ref(frame_t * frame);
+
+esp_err_t camera_frame_release(frame_t * frame);
+
+//with CONFIG_JPEG_PACKET_SINK frames aren't handed out by camera_get_jpeg(), every encode task (0 to
+//CONFIG_NUM_JPEG_ENCODE_TASKS - 1) writes them into its output sink. Frames are skipped until the sink is set
+esp_err_t camera_set_jpeg_sink(uint32_t encoder, huffman_sink_t sink, void * arg);
+
+//with CONFIG_JPEG_PACKET_SINK, where the frame the encode task is writing into its sink comes from. For the sink, which runs
+//in that task: it is set before the frame's first sink call, encode_end_us is 0 until the encode returns
+esp_err_t camera_get_frame_info(uint32_t encoder, jpeg_frame_info_t * info);
+
+//encoder backend for the frames captured from now on. ESP_ERR_NOT_SUPPORTED for jpge without CONFIG_CAMERA_ENCODER_JPGE
+esp_err_t camera_set_encoder(camera_encoder_t encoder);
+
+camera_encoder_t camera_get_encoder(void);
+
+//freshness policy of the frames waiting to be sent, depth 1 to CONFIG_NUM_JPEG_BUFFERS. Depth 1 with CAMERA_DROP_OLDEST gives
+//the least queueing latency. ESP_ERR_NOT_SUPPORTED with CONFIG_JPEG_PACKET_SINK, frames aren't queued
+esp_err_t camera_set_drop_policy(camera_drop_policy_t policy, uint32_t depth);
+
+void camera_get_frame_counters(camera_frame_counters_t * counters);
+
+//region of interest quality map used by every encode task, see jpeg_set_roi_map(). mcu_cols by mcu_rows covers the camera
+//frame in MCUs of the configured subsampling, the map stays owned by the caller and its levels can be changed between
+//frames. NULL encodes whole frames at the configured quality
+esp_err_t camera_set_jpeg_roi(const uint8_t * map, uint32_t mcu_cols, uint32_t mcu_rows);
+
+//with CONFIG_CAMERA_RECONFIGURE, changes the camera's frame size (QQVGA, QCIF, HQVGA or QVGA, up to CAMERA_FRAME_SIZE_MAX)
+//and number of frame buffers (at least one per frame encode task, 0 - unchanged) without a reboot. Blocks until the encode
+//tasks have finished their frames, capture stops for a frame or two. Only PIXFORMAT_YUV422 is encoded, ESP_ERR_NOT_SUPPORTED
+//for other formats and without CONFIG_CAMERA_RECONFIGURE
+esp_err_t camera_reconfigure(framesize_t frame_size, pixformat_t pixel_format, uint32_t fb_count);
+
+//with CONFIG_CAMERA_MOTION_DETECT, pdTRUE while the scene is changing (frames are encoded at the full rate). changed_blocks,
+//if not NULL, gets the number of 8x8 blocks that changed in the last encoded frame. pdFALSE without motion detection
+BaseType_t camera_motion_detected(uint32_t * changed_blocks);
+
+//called by the sender for every frame with the time it took to send and whether sending failed. With CONFIG_CAMERA_ADAPTIVE
+//this drives the back-pressure controller, which steps quality and frame rate down while the link falls behind (frames
+//stolen or dropped, slow or failed sends, low heap) and back up once it has kept up for a while
+void camera_report_send(uint32_t send_time_ms, esp_err_t status);
+
+//copies the encoder statistics, ESP_ERR_NOT_SUPPORTED without CONFIG_CAMERA_STATS
+esp_err_t camera_get_stats(camera_stats_t * stats);
+
 #endif
@@ -0,0 +1,65 @@
+#ifndef FRAME_POOL_H
+#define FRAME_POOL_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_err.h"
+
+#include "jpeg.h"
+
+//encoded frames of any size in one arena, each with a reference count so several consumers (sender, recorder, snapshot)
+//can hold the same frame without copying it. Frames are laid out in ring order: a new one is reserved at the head with room
+//for the largest frame and trimmed to its size once encoded, space comes back as the oldest frames are released. A frame
+//released before older ones keeps its space until they are released too
+typedef struct
+{
+	uint32_t refs;     //atomic
+	uint32_t span;     //arena bytes up to the next frame, header included
+	uint32_t size;     //bytes of data
+	uint32_t capacity; //bytes data can take
+	jpeg_frame_info_t info;
+	uint8_t data[];
+} frame_t;
+
+typedef struct
+{
+	uint8_t * arena;
+	uint32_t arena_size;
+	uint32_t head;     //offset the next frame goes to
+	uint32_t tail;     //offset of the oldest frame
+	uint32_t newest;   //offset of the newest frame, the one that can be trimmed back into the free space
+	uint32_t frames;   //in the arena, released ones that aren't the oldest included
+	SemaphoreHandle_t mutx;
+	StaticSemaphore_t mutx_buf;
+} frame_pool_t;
+
+//frames start at multiples of this in the arena, the frame info has 64-bit members
+#define FRAME_POOL_ALIGN	__alignof__(frame_t)
+
+//bytes of arena a frame of capacity bytes takes at most
+#define FRAME_POOL_SPAN(capacity)	(sizeof(frame_t) + (((capacity) + FRAME_POOL_ALIGN - 1) & ~(FRAME_POOL_ALIGN - 1)))
+
+esp_err_t frame_pool_init(frame_pool_t * pool, uint32_t arena_size);
+
+//new frame with room for capacity bytes and one reference, NULL if there isn't enough contiguous space
+frame_t * frame_pool_alloc(frame_pool_t * pool, uint32_t capacity);
+
+//sets the size of the frame's data and gives the rest of its room back, if it is still the newest frame
+void frame_pool_trim(frame_pool_t * pool, frame_t * frame, uint32_t size);
+
+//true if frame is the oldest one of the pool, the only one whose release gives space back
+bool frame_pool_is_oldest(frame_pool_t * pool, const frame_t * frame);
+
+//frame whose data starts at data, NULL if it isn't one of the pool
+frame_t * frame_pool_find(frame_pool_t * pool, const void * data);
+
+void frame_ref(frame_t * frame);
+
+//drops a reference, the frame is freed with the last one. ESP_ERR_INVALID_STATE if it has none left
+esp_err_t frame_release(frame_pool_t * pool, frame_t * frame);
+
+#endif
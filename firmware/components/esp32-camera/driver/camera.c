@@ -84,6 +84,8 @@ typedef struct camera_fb_s {
     size_t width;
     size_t height;
     pixformat_t format;
+    int64_t timestamp;
+    uint32_t seq;
     size_t size;
     uint8_t ref;
     uint8_t bad;
@@ -129,6 +131,13 @@ typedef struct {
 
     SemaphoreHandle_t frame_ready;
     TaskHandle_t dma_filter_task;
+
+    camera_strip_cb_t strip_cb;
+    void * strip_arg;
+    size_t strip_lines;
+
+    int64_t vsync_time;
+    uint32_t vsync_count;
 } camera_state_t;
 
 camera_state_t* s_state = NULL;
@@ -146,6 +155,8 @@ static void dma_filter_yuyv(const dma_elem_t* src, lldesc_t* dma_desc, uint8_t*
 static void dma_filter_yuyv_highspeed(const dma_elem_t* src, lldesc_t* dma_desc, uint8_t* dst);
 static void dma_filter_jpeg(const dma_elem_t* src, lldesc_t* dma_desc, uint8_t* dst);
 static void i2s_stop(bool* need_yield);
+static void camera_strip_signal(camera_strip_event_t event, camera_fb_int_t * fb);
+static esp_err_t camera_set_format(framesize_t frame_size, pixformat_t pix_format);
 
 #ifdef EVAL
 volatile TickType_t ticks = 0;
@@ -243,7 +254,13 @@ static esp_err_t camera_fb_init(size_t count)
 
     camera_fb_deinit();
 
-    ESP_LOGI(TAG, "Allocating %u frame buffers (%d KB total)", count, (s_state->fb_size * count) / 1024);
+    //buffers are sized for the largest frame esp_camera_reconfigure() may switch to
+    size_t fb_size = s_state->fb_size;
+    if (s_state->config.fb_size_max > fb_size) {
+        fb_size = s_state->config.fb_size_max;
+    }
+
+    ESP_LOGI(TAG, "Allocating %u frame buffers (%d KB total)", count, (fb_size * count) / 1024);
 
     camera_fb_int_t * _fb = NULL, * _fb1 = NULL, * _fb2 = NULL;
     for(size_t i = 0; i < count; i++) {
@@ -252,17 +269,17 @@ static esp_err_t camera_fb_init(size_t count)
             goto fail;
         }
         memset(_fb2, 0, sizeof(camera_fb_int_t));
-        _fb2->size = s_state->fb_size;
+        _fb2->size = fb_size;
         _fb2->buf = (uint8_t*) calloc(_fb2->size, 1);
         if(!_fb2->buf) {
-            ESP_LOGI(TAG, "Allocating %d KB frame buffer in PSRAM", s_state->fb_size/1024);
+            ESP_LOGI(TAG, "Allocating %d KB frame buffer in PSRAM", fb_size/1024);
             _fb2->buf = (uint8_t*) heap_caps_calloc(_fb2->size, 1, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
         } else {
-            ESP_LOGI(TAG, "Allocating %d KB frame buffer in OnBoard RAM", s_state->fb_size/1024);
+            ESP_LOGI(TAG, "Allocating %d KB frame buffer in OnBoard RAM", fb_size/1024);
         }
         if(!_fb2->buf) {
             free(_fb2);
-            ESP_LOGE(TAG, "Allocating %d KB frame buffer Failed", s_state->fb_size/1024);
+            ESP_LOGE(TAG, "Allocating %d KB frame buffer Failed", fb_size/1024);
             goto fail;
         }
         memset(_fb2->buf, 0, _fb2->size);
@@ -310,7 +327,7 @@ static esp_err_t dma_desc_init()
     ESP_LOGI(TAG, "DMA buffer count: %d", dma_desc_count);
     ESP_LOGI(TAG, "DMA buffer total: %d bytes", buf_size * dma_desc_count);
 
-    s_state->dma_buf = (dma_elem_t**) malloc(sizeof(dma_elem_t*) * dma_desc_count);
+    s_state->dma_buf = (dma_elem_t**) calloc(dma_desc_count, sizeof(dma_elem_t*)); //zeroed so dma_desc_deinit() can free a partial set
     if (s_state->dma_buf == NULL) {
         return ESP_ERR_NO_MEM;
     }
@@ -357,6 +374,8 @@ static void dma_desc_deinit()
     }
     free(s_state->dma_buf);
     free(s_state->dma_desc);
+    s_state->dma_buf = NULL;
+    s_state->dma_desc = NULL;
 }
 
 static inline void IRAM_ATTR i2s_conf_reset()
@@ -586,6 +605,9 @@ static void IRAM_ATTR vsync_isr(void* arg)
     GPIO.status1_w1tc.val = GPIO.status1.val;
     GPIO.status_w1tc = GPIO.status;
     bool need_yield = false;
+    //readout of the next frame starts, it is stamped with this once its first DMA buffer is filtered
+    s_state->vsync_time = esp_timer_get_time();
+    s_state->vsync_count++;
     //if vsync is low and we have received some data, frame is done
     if (_gpio_get_level(s_state->config.pin_vsync) == 0) {
         if(s_state->dma_received_count > 0) {
@@ -682,6 +704,9 @@ static void IRAM_ATTR dma_finish_frame()
     if(!s_state->fb->ref) {
         // is the frame bad?
         if(s_state->fb->bad){
+            if(s_state->dma_filtered_count) {
+                camera_strip_signal(CAMERA_STRIP_FRAME_DROPPED, s_state->fb);
+            }
             s_state->fb->bad = 0;
             s_state->fb->len = 0;
             *((uint32_t *)s_state->fb->buf) = 0;
@@ -710,7 +735,9 @@ static void IRAM_ATTR dma_finish_frame()
                     }
                 }
                 //send out the frame
+                camera_fb_int_t * fb = s_state->fb;
                 camera_fb_done();
+                camera_strip_signal(CAMERA_STRIP_FRAME_DONE, fb);
             } else if(s_state->config.fb_count == 1){
                 //frame was empty?
                 i2s_start_bus();
@@ -756,8 +783,30 @@ static void IRAM_ATTR dma_filter_buffer(size_t buf_idx)
         s_state->fb->width = resolution[s_state->sensor.status.framesize][0];
         s_state->fb->height = resolution[s_state->sensor.status.framesize][1];
         s_state->fb->format = s_state->sensor.pixformat;
+        s_state->fb->timestamp = s_state->vsync_time;
+        s_state->fb->seq = s_state->vsync_count;
     }
     s_state->dma_filtered_count++;
+
+    //another strip of lines is complete
+    if(s_state->strip_cb && (s_state->dma_filtered_count % (s_state->strip_lines * s_state->dma_per_line)) == 0) {
+        camera_strip_signal(CAMERA_STRIP_DATA, s_state->fb);
+    }
+}
+
+static void IRAM_ATTR camera_strip_signal(camera_strip_event_t event, camera_fb_int_t * fb)
+{
+    if(!s_state->strip_cb || fb->format == PIXFORMAT_JPEG) {
+        return;
+    }
+
+    camera_strip_t strip = {
+        .event = event,
+        .fb = (camera_fb_t *)fb,
+        .lines = (event == CAMERA_STRIP_FRAME_DONE) ? fb->height : s_state->dma_filtered_count / s_state->dma_per_line,
+        .bytes_per_line = s_state->width * s_state->fb_bytes_per_pixel,
+    };
+    s_state->strip_cb(&strip, s_state->strip_arg);
 }
 
 static void IRAM_ATTR dma_filter_task(void *pvParameters)
@@ -1175,18 +1224,10 @@ esp_err_t camera_probe(const camera_config_t* config, camera_model_t* out_camera
     return ESP_OK;
 }
 
-esp_err_t camera_init(const camera_config_t* config)
+//frame geometry, DMA sampling mode and filter of the frame size and pixel format, used by camera_init() and
+//esp_camera_reconfigure(). The sensor is not touched
+static esp_err_t camera_set_format(framesize_t frame_size, pixformat_t pix_format)
 {
-    if (!s_state) {
-        return ESP_ERR_INVALID_STATE;
-    }
-    if (s_state->sensor.id.PID == 0) {
-        return ESP_ERR_CAMERA_NOT_SUPPORTED;
-    }
-    memcpy(&s_state->config, config, sizeof(*config));
-    esp_err_t err = ESP_OK;
-    framesize_t frame_size = (framesize_t) config->frame_size;
-    pixformat_t pix_format = (pixformat_t) config->pixel_format;
     s_state->width = resolution[frame_size][0];
     s_state->height = resolution[frame_size][1];
 
@@ -1269,10 +1310,9 @@ esp_err_t camera_init(const camera_config_t* config)
     } else if (pix_format == PIXFORMAT_JPEG) {
         if (s_state->sensor.id.PID != OV2640_PID && s_state->sensor.id.PID != OV3660_PID) {
             ESP_LOGE(TAG, "JPEG format is only supported for ov2640 and ov3660");
-            err = ESP_ERR_NOT_SUPPORTED;
-            goto fail;
+            return ESP_ERR_NOT_SUPPORTED;
         }
-        int qp = config->jpeg_quality;
+        int qp = s_state->config.jpeg_quality;
         int compression_ratio_bound = 1;
         if (qp > 10) {
             compression_ratio_bound = 16;
@@ -1289,14 +1329,32 @@ esp_err_t camera_init(const camera_config_t* config)
         s_state->sampling_mode = SM_0A00_0B00;
     } else {
         ESP_LOGE(TAG, "Requested format is not supported");
-        err = ESP_ERR_NOT_SUPPORTED;
-        goto fail;
+        return ESP_ERR_NOT_SUPPORTED;
     }
 
     ESP_LOGD(TAG, "in_bpp: %d, fb_bpp: %d, fb_size: %d, mode: %d, width: %d height: %d",
              s_state->in_bytes_per_pixel, s_state->fb_bytes_per_pixel,
              s_state->fb_size, s_state->sampling_mode,
              s_state->width, s_state->height);
+    return ESP_OK;
+}
+
+esp_err_t camera_init(const camera_config_t* config)
+{
+    if (!s_state) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (s_state->sensor.id.PID == 0) {
+        return ESP_ERR_CAMERA_NOT_SUPPORTED;
+    }
+    memcpy(&s_state->config, config, sizeof(*config));
+    esp_err_t err = ESP_OK;
+    framesize_t frame_size = (framesize_t) config->frame_size;
+    pixformat_t pix_format = (pixformat_t) config->pixel_format;
+    err = camera_set_format(frame_size, pix_format);
+    if (err != ESP_OK) {
+        goto fail;
+    }
 
     i2s_init();
 
@@ -1496,6 +1554,11 @@ camera_fb_t* esp_camera_fb_get()
     if (s_state == NULL) {
         return NULL;
     }
+    if (s_state->dma_desc == NULL || s_state->fb == NULL) {
+        //a reconfiguration failed, there is no frame to wait for
+        vTaskDelay(FB_GET_TIMEOUT);
+        return NULL;
+    }
     if(!I2S0.conf.rx_start) {
         if(s_state->config.fb_count > 1) {
             ESP_LOGD(TAG, "i2s_run");
@@ -1532,6 +1595,138 @@ void esp_camera_fb_return(camera_fb_t * fb)
     xQueueSend(s_state->fb_in, &fb, portMAX_DELAY);
 }
 
+esp_err_t esp_camera_set_strip_consumer(size_t strip_lines, camera_strip_cb_t cb, void * arg)
+{
+    if (s_state == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (cb != NULL && strip_lines == 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    //the filter task only reads strip_cb once it is set, so set it last
+    s_state->strip_cb = NULL;
+    s_state->strip_arg = arg;
+    s_state->strip_lines = strip_lines ? strip_lines : 1;
+    s_state->strip_cb = cb;
+    return ESP_OK;
+}
+
+esp_err_t esp_camera_reconfigure(framesize_t frame_size, pixformat_t pixel_format, size_t fb_count)
+{
+    if (s_state == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (frame_size >= FRAMESIZE_INVALID || fb_count == 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    int64_t start_time = esp_timer_get_time();
+    framesize_t old_frame_size = s_state->config.frame_size;
+    pixformat_t old_pixel_format = s_state->config.pixel_format;
+
+    //stop capture and let the filter task finish the DMA buffers it was given. The frame being captured is lost
+    i2s_stop_bus();
+    while (uxQueueMessagesWaiting(s_state->data_ready) != 0) {
+        vTaskDelay(1);
+    }
+    vTaskDelay(1);
+    s_state->dma_filtered_count = 0;
+
+    esp_err_t err = camera_set_format(frame_size, pixel_format);
+    if (err != ESP_OK) {
+        camera_set_format(old_frame_size, old_pixel_format);
+        return err;
+    }
+
+    s_state->sensor.status.framesize = frame_size;
+    s_state->sensor.pixformat = pixel_format;
+    if (s_state->sensor.set_pixformat(&s_state->sensor, pixel_format) != 0) {
+        ESP_LOGE(TAG, "Failed to set pixel format");
+        err = ESP_ERR_CAMERA_FAILED_TO_SET_OUT_FORMAT;
+        goto fail;
+    }
+    if (s_state->sensor.set_framesize(&s_state->sensor, frame_size) != 0) {
+        ESP_LOGE(TAG, "Failed to set frame size");
+        err = ESP_ERR_CAMERA_FAILED_TO_SET_FRAME_SIZE;
+        goto fail;
+    }
+    if (pixel_format == PIXFORMAT_JPEG) {
+        (*s_state->sensor.set_quality)(&s_state->sensor, s_state->config.jpeg_quality);
+    }
+
+    I2S0.fifo_conf.rx_fifo_mod = s_state->sampling_mode;
+    dma_desc_deinit();
+    err = dma_desc_init();
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to initialize DMA");
+        goto fail;
+    }
+
+    //the frame buffers are only reallocated if there are more or fewer of them or the new frames don't fit
+    if (fb_count != s_state->config.fb_count || s_state->fb == NULL || s_state->fb->size < s_state->fb_size) {
+        err = camera_fb_init(fb_count);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to allocate frame buffer");
+            goto fail;
+        }
+    } else {
+        camera_fb_int_t * fb = s_state->fb;
+        do {
+            fb->ref = 0;
+            fb->len = 0;
+            fb->bad = 0;
+            fb = fb->next;
+        } while (fb != s_state->fb);
+    }
+
+    if (fb_count == 1) {
+        if (s_state->frame_ready == NULL) {
+            s_state->frame_ready = xSemaphoreCreateBinary();
+        }
+        if (s_state->frame_ready == NULL) {
+            err = ESP_ERR_NO_MEM;
+            goto fail;
+        }
+        xSemaphoreTake(s_state->frame_ready, 0);
+    } else {
+        if (s_state->fb_in != NULL && fb_count != s_state->config.fb_count) {
+            vQueueDelete(s_state->fb_in);
+            s_state->fb_in = NULL;
+        }
+        if (s_state->fb_in == NULL) {
+            s_state->fb_in = xQueueCreate(fb_count, sizeof(camera_fb_t *));
+        }
+        if (s_state->fb_out == NULL) {
+            s_state->fb_out = xQueueCreate(1, sizeof(camera_fb_t *));
+        }
+        if (s_state->fb_in == NULL || s_state->fb_out == NULL) {
+            err = ESP_ERR_NO_MEM;
+            goto fail;
+        }
+        xQueueReset(s_state->fb_in);
+        xQueueReset(s_state->fb_out);
+    }
+
+    s_state->config.frame_size = frame_size;
+    s_state->config.pixel_format = pixel_format;
+    s_state->config.fb_count = fb_count;
+
+    //let the sensor settle, capture restarts with the next esp_camera_fb_get()
+    if (skip_frame()) {
+        err = ESP_ERR_CAMERA_FAILED_TO_SET_OUT_FORMAT;
+        goto fail;
+    }
+
+    ESP_LOGI(TAG, "Reconfigured to %dx%d, %u frame buffers in %d ms", s_state->width, s_state->height, fb_count,
+             (int)((esp_timer_get_time() - start_time) / 1000));
+    return ESP_OK;
+
+fail:
+    dma_desc_deinit(); //no capture until a reconfiguration succeeds
+    ESP_LOGE(TAG, "Reconfiguration failed (%x), the camera is stopped", err);
+    return err;
+}
+
 sensor_t * esp_camera_sensor_get()
 {
     if (s_state == NULL) {
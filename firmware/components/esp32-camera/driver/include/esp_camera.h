@@ -107,6 +107,7 @@ typedef struct {
 
     int jpeg_quality;               /*!< Quality of JPEG output. 0-63 lower means higher quality  */
     size_t fb_count;                /*!< Number of frame buffers to be allocated. If more than one, then each frame will be acquired (double speed)  */
+    size_t fb_size_max;             /*!< Size of the frame buffers in bytes if larger than frame_size needs, so esp_camera_reconfigure() can switch to larger frames without reallocating them. 0 - frame_size  */
 } camera_config_t;
 
 /**
@@ -118,8 +119,32 @@ typedef struct {
     size_t width;               /*!< Width of the buffer in pixels */
     size_t height;              /*!< Height of the buffer in pixels */
     pixformat_t format;         /*!< Format of the pixel data */
+    int64_t timestamp;          /*!< esp_timer time (us) of the VSYNC the frame's readout started with */
+    uint32_t seq;               /*!< Frame sequence number, counts VSYNCs so gaps are frames that were dropped */
 } camera_fb_t;
 
+/**
+ * @brief Progress of the frame being captured, reported to the strip consumer
+ */
+typedef enum {
+    CAMERA_STRIP_DATA,              /*!< Another strip of lines is in the frame buffer */
+    CAMERA_STRIP_FRAME_DONE,        /*!< Frame is complete and handed out by esp_camera_fb_get() */
+    CAMERA_STRIP_FRAME_DROPPED,     /*!< Frame is bad and is discarded, its buffer will be refilled */
+} camera_strip_event_t;
+
+typedef struct {
+    camera_strip_event_t event;
+    camera_fb_t * fb;               /*!< Frame being captured. len is only valid once the frame is done */
+    size_t lines;                   /*!< Lines from the top of the frame that are in fb->buf */
+    size_t bytes_per_line;          /*!< Line stride of fb->buf */
+} camera_strip_t;
+
+/**
+ * @brief Strip consumer, called from the DMA filter task. Must not block, the
+ *        next DMA buffers are not processed until it returns.
+ */
+typedef void (*camera_strip_cb_t)(const camera_strip_t * strip, void * arg);
+
 #define ESP_ERR_CAMERA_BASE 0x20000
 #define ESP_ERR_CAMERA_NOT_DETECTED             (ESP_ERR_CAMERA_BASE + 1)
 #define ESP_ERR_CAMERA_FAILED_TO_SET_FRAME_SIZE (ESP_ERR_CAMERA_BASE + 2)
@@ -169,6 +194,49 @@ camera_fb_t* esp_camera_fb_get();
  */
 void esp_camera_fb_return(camera_fb_t * fb);
 
+/**
+ * @brief Change the frame size, pixel format and number of frame buffers without a reboot.
+ *
+ * Capture is stopped, the frame being captured is lost. The DMA descriptors are
+ * rebuilt for the new line size, the frame buffers are only reallocated if their
+ * number changes or the new frames don't fit in them (see fb_size_max). Capture
+ * restarts with the next esp_camera_fb_get().
+ *
+ * @note Every frame buffer must have been returned and no task may be in
+ *       esp_camera_fb_get() while this runs. If it fails the camera stays stopped
+ *       until a reconfiguration succeeds.
+ *
+ * @param frame_size    New frame size
+ * @param pixel_format  New pixel format
+ * @param fb_count      New number of frame buffers, more than one runs i2s in continuous mode
+ *
+ * @return
+ *      - ESP_OK on success
+ *      - ESP_ERR_INVALID_STATE if the driver hasn't been initialized yet
+ *      - ESP_ERR_INVALID_ARG if the frame size or count are invalid
+ *      - ESP_ERR_NOT_SUPPORTED if the sensor can't output the pixel format, the configuration is unchanged
+ */
+esp_err_t esp_camera_reconfigure(framesize_t frame_size, pixformat_t pixel_format, size_t fb_count);
+
+/**
+ * @brief Register a consumer of frames while they are being captured.
+ *
+ * cb is called every time strip_lines more lines of the current frame have been
+ * written to its frame buffer, and once more when the frame is done or dropped,
+ * so lines can be processed while the rest of the frame is still arriving.
+ * Not called for JPEG frames.
+ *
+ * @param strip_lines  Lines per strip
+ * @param cb           Consumer, NULL to unregister
+ * @param arg          Passed to cb
+ *
+ * @return
+ *      - ESP_OK on success
+ *      - ESP_ERR_INVALID_STATE if the driver hasn't been initialized yet
+ *      - ESP_ERR_INVALID_ARG if strip_lines is 0
+ */
+esp_err_t esp_camera_set_strip_consumer(size_t strip_lines, camera_strip_cb_t cb, void * arg);
+
 /**
  * @brief Get a pointer to the image sensor control structure
  *
@@ -21,98 +21,210 @@
 #include "dct.h"
 
 
+// zig-zag table, natural index of each zig-zag position
+const unsigned char dct_zig[64] =
+{
+	 0,
+	 1, 8,
+	16, 9, 2, 
+	 3,10,17,24,
+	32,25,18,11, 4,
+	 5,12,19,26,33,40,
+	48,41,34,27,20,13, 6,
+	 7,14,21,28,35,42,49,56,
+	57,50,43,36,29,22,15,
+	23,30,37,44,51,58,
+	59,52,45,38,31,
+	39,46,53,60,
+	61,54,47,
+	55,62,
+	63
+};
+
+#define AAN_BITS	14
+
+// AAN output scale factors: 1 for k = 0, cos(k*PI/16)*sqrt(2) otherwise, (1 << AAN_BITS)
+static const unsigned short aan_scale[8] =
+{
+	16384, 22725, 21407, 19266, 16384, 12873, 8867, 4520
+};
+
+#define FIX_0_382683433	6270
+#define FIX_0_541196100	8867
+#define FIX_0_707106781	11585
+#define FIX_1_306562965	21407
+
+#define MULTIPLY(v, c)	(((v)*(c) + (1 << (AAN_BITS-1))) >> AAN_BITS)
+
 /******************************************************************************
-**  dct
+**  dct_qtable_init
 **  --------------------------------------------------------------------------
-**  Fast DCT - Discrete Cosine Transform.
-**  This function converts 8x8 pixel block into frequencies.
-**  Lowest frequencies are at the upper-left corner.
-**  The input and output could point at the same array, in this case the data
-**  will be overwritten.
+**  Builds reciprocals for dct_quantize from a quantization table.
+**  Each divisor is the quantization value multiplied by the AAN output scale
+**  of its row and column and by 8, the gain of the two 1-D passes. Reciprocals
+**  are normalized to 16 bits with a per-coefficient shift, so precision is the
+**  same for fine and coarse tables.
+**  Tables are stored in zig-zag order, as coefficients are produced.
 **  
 **  ARGUMENTS:
-**      pixels  - 8x8 pixel array;
-**      data    - 8x8 freq block;
+**      qt      - reciprocal table to build;
+**      qtable  - quantization table (natural order);
 **
 **  RETURN: -
 ******************************************************************************/
-void dct(short pixels[8][8], short data[8][8])
+void dct_qtable_init(dct_qtable_t *const qt, const unsigned char qtable[64])
 {
-	CACHE_ALIGN short rows[8][8];
-	unsigned          i;
+	unsigned i;
+
+	for (i = 0; i < 64; i++)
+	{
+		const unsigned zi = dct_zig[i];
+		// divisor, scaled by 2^(2*AAN_BITS - 3)
+		const uint64_t d = (uint64_t)qtable[zi] * aan_scale[zi >> 3] * aan_scale[zi & 7];
+		uint64_t r;
+		unsigned shift = 2*AAN_BITS - 3;
+
+		while (((uint64_t)1 << shift) / d < 0x8000)
+			shift++;
 
-	static const short // Ci = cos(i*PI/16)*(1 << 14);
-		C1 = 16070,
-		C2 = 15137,
-		C3 = 13623,
-		C4 = 11586,
-		C5 = 9103,
-		C6 = 6270,
-		C7 = 3197;
+		r = (((uint64_t)1 << shift) + d/2) / d;
+		if (r > 0xFFFF) { r = (r + 1) >> 1; shift--; }
 
-	// simple but fast DCT - 22*16 multiplication 28*16 additions and 8*16 shifts.
+		qt->recip[i] = r;
+		qt->shift[i] = shift - (2*AAN_BITS - 3);
+	}
+}
+
+/******************************************************************************
+**  dct_quantize
+**  --------------------------------------------------------------------------
+**  Fast DCT - Discrete Cosine Transform fused with quantization.
+**  Integer version of the AAN (Arai, Agui, Nakajima) algorithm: 5
+**  multiplications per 1-D pass, its output scaling is folded into the
+**  quantization reciprocals (see dct_qtable_init).
+**  Lowest frequencies are at the upper-left corner. Quantized coefficients
+**  are written in zig-zag order, ready for Huffman coding.
+**  
+**  ARGUMENTS:
+**      pixels  - 8x8 pixel array, centered about 0;
+**      data    - 64 quantized coefficients, zig-zag order;
+**      qt      - reciprocals of the component quantization table;
+**
+**  RETURN: zig-zag index of the last non-zero AC coefficient, 0 if none.
+******************************************************************************/
+unsigned dct_quantize(const short pixels[8][8], short data[64], const dct_qtable_t *const qt)
+{
+	CACHE_ALIGN int ws[8][8];
+	unsigned        i, last = 0;
 
 	/* transform rows */
 	for (i = 0; i < 8; i++)
 	{
-		short s07,s16,s25,s34,s0734,s1625;
-		short d07,d16,d25,d34,d0734,d1625;
-
-		s07 = pixels[i][0] + pixels[i][7];
-		d07 = pixels[i][0] - pixels[i][7];
-		s16 = pixels[i][1] + pixels[i][6];
-		d16 = pixels[i][1] - pixels[i][6];
-		s25 = pixels[i][2] + pixels[i][5];
-		d25 = pixels[i][2] - pixels[i][5];
-		s34 = pixels[i][3] + pixels[i][4];
-		d34 = pixels[i][3] - pixels[i][4];
-
-		rows[i][1] = (C1*d07 + C3*d16 + C5*d25 + C7*d34) >> 14;
-		rows[i][3] = (C3*d07 - C7*d16 - C1*d25 - C5*d34) >> 14;
-		rows[i][5] = (C5*d07 - C1*d16 + C7*d25 + C3*d34) >> 14;
-		rows[i][7] = (C7*d07 - C5*d16 + C3*d25 - C1*d34) >> 14;
-
-		s0734 = s07 + s34;
-		d0734 = s07 - s34;
-		s1625 = s16 + s25;
-		d1625 = s16 - s25;
-
-		rows[i][0] = (C4*(s0734 + s1625)) >> 14;
-		rows[i][4] = (C4*(s0734 - s1625)) >> 14;
-
-		rows[i][2] = (C2*d0734 + C6*d1625) >> 14;
-		rows[i][6] = (C6*d0734 - C2*d1625) >> 14;
+		const short *const p = pixels[i];
+		int *const o = ws[i];
+		int tmp0, tmp1, tmp2, tmp3, tmp4, tmp5, tmp6, tmp7;
+		int tmp10, tmp11, tmp12, tmp13;
+		int z1, z2, z3, z4, z5, z11, z13;
+
+		tmp0 = p[0] + p[7];
+		tmp7 = p[0] - p[7];
+		tmp1 = p[1] + p[6];
+		tmp6 = p[1] - p[6];
+		tmp2 = p[2] + p[5];
+		tmp5 = p[2] - p[5];
+		tmp3 = p[3] + p[4];
+		tmp4 = p[3] - p[4];
+
+		// even part
+		tmp10 = tmp0 + tmp3;
+		tmp13 = tmp0 - tmp3;
+		tmp11 = tmp1 + tmp2;
+		tmp12 = tmp1 - tmp2;
+
+		o[0] = tmp10 + tmp11;
+		o[4] = tmp10 - tmp11;
+
+		z1 = MULTIPLY(tmp12 + tmp13, FIX_0_707106781);
+		o[2] = tmp13 + z1;
+		o[6] = tmp13 - z1;
+
+		// odd part
+		tmp10 = tmp4 + tmp5;
+		tmp11 = tmp5 + tmp6;
+		tmp12 = tmp6 + tmp7;
+
+		z5 = MULTIPLY(tmp10 - tmp12, FIX_0_382683433);
+		z2 = MULTIPLY(tmp10, FIX_0_541196100) + z5;
+		z4 = MULTIPLY(tmp12, FIX_1_306562965) + z5;
+		z3 = MULTIPLY(tmp11, FIX_0_707106781);
+
+		z11 = tmp7 + z3;
+		z13 = tmp7 - z3;
+
+		o[5] = z13 + z2;
+		o[3] = z13 - z2;
+		o[1] = z11 + z4;
+		o[7] = z11 - z4;
 	}
 
 	/* transform columns */
 	for (i = 0; i < 8; i++)
 	{
-		short s07,s16,s25,s34,s0734,s1625;
-		short d07,d16,d25,d34,d0734,d1625;
-
-		s07 = rows[0][i] + rows[7][i];
-		d07 = rows[0][i] - rows[7][i];
-		s16 = rows[1][i] + rows[6][i];
-		d16 = rows[1][i] - rows[6][i];
-		s25 = rows[2][i] + rows[5][i];
-		d25 = rows[2][i] - rows[5][i];
-		s34 = rows[3][i] + rows[4][i];
-		d34 = rows[3][i] - rows[4][i];
-
-		data[1][i] = (C1*d07 + C3*d16 + C5*d25 + C7*d34) >> 16;
-		data[3][i] = (C3*d07 - C7*d16 - C1*d25 - C5*d34) >> 16;
-		data[5][i] = (C5*d07 - C1*d16 + C7*d25 + C3*d34) >> 16;
-		data[7][i] = (C7*d07 - C5*d16 + C3*d25 - C1*d34) >> 16;
-
-		s0734 = s07 + s34;
-		d0734 = s07 - s34;
-		s1625 = s16 + s25;
-		d1625 = s16 - s25;
-
-		data[0][i] = (C4*(s0734 + s1625)) >> 16;
-		data[4][i] = (C4*(s0734 - s1625)) >> 16;
-
-		data[2][i] = (C2*d0734 + C6*d1625) >> 16;
-		data[6][i] = (C6*d0734 - C2*d1625) >> 16;
+		int tmp0, tmp1, tmp2, tmp3, tmp4, tmp5, tmp6, tmp7;
+		int tmp10, tmp11, tmp12, tmp13;
+		int z1, z2, z3, z4, z5, z11, z13;
+
+		tmp0 = ws[0][i] + ws[7][i];
+		tmp7 = ws[0][i] - ws[7][i];
+		tmp1 = ws[1][i] + ws[6][i];
+		tmp6 = ws[1][i] - ws[6][i];
+		tmp2 = ws[2][i] + ws[5][i];
+		tmp5 = ws[2][i] - ws[5][i];
+		tmp3 = ws[3][i] + ws[4][i];
+		tmp4 = ws[3][i] - ws[4][i];
+
+		// even part
+		tmp10 = tmp0 + tmp3;
+		tmp13 = tmp0 - tmp3;
+		tmp11 = tmp1 + tmp2;
+		tmp12 = tmp1 - tmp2;
+
+		ws[0][i] = tmp10 + tmp11;
+		ws[4][i] = tmp10 - tmp11;
+
+		z1 = MULTIPLY(tmp12 + tmp13, FIX_0_707106781);
+		ws[2][i] = tmp13 + z1;
+		ws[6][i] = tmp13 - z1;
+
+		// odd part
+		tmp10 = tmp4 + tmp5;
+		tmp11 = tmp5 + tmp6;
+		tmp12 = tmp6 + tmp7;
+
+		z5 = MULTIPLY(tmp10 - tmp12, FIX_0_382683433);
+		z2 = MULTIPLY(tmp10, FIX_0_541196100) + z5;
+		z4 = MULTIPLY(tmp12, FIX_1_306562965) + z5;
+		z3 = MULTIPLY(tmp11, FIX_0_707106781);
+
+		z11 = tmp7 + z3;
+		z13 = tmp7 - z3;
+
+		ws[5][i] = z13 + z2;
+		ws[3][i] = z13 - z2;
+		ws[1][i] = z11 + z4;
+		ws[7][i] = z11 - z4;
 	}
+
+	/* quantize, round to nearest */
+	for (i = 0; i < 64; i++)
+	{
+		const int v = ((int *)ws)[dct_zig[i]];
+		const unsigned shift = qt->shift[i];
+		const int q = ((unsigned)(v < 0 ? -v : v) * qt->recip[i] + (1u << (shift-1))) >> shift;
+
+		data[i] = (v < 0)? -q: q;
+		last = q ? i: last;
+	}
+
+	return last;
 }
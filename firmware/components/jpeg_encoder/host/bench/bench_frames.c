@@ -0,0 +1,115 @@
+#include "bench_frames.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+double bench_now_sec(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+//smooth gradients, a few hard edges and some noise, roughly what a camera sees. Deterministic, so runs are comparable
+static uint8_t * synthetic_frame(uint32_t width, uint32_t height)
+{
+	uint8_t * yuyv = malloc(width * height * 2);
+	uint32_t seed = 12345;
+
+	if (yuyv == NULL)
+	{
+		return NULL;
+	}
+
+	for (uint32_t row = 0; row < height; row ++)
+	{
+		for (uint32_t col = 0; col < width; col += 2)
+		{
+			uint8_t * px = yuyv + (row * width + col) * 2; //Y0_U0_Y1_V0
+			int luma = 40 + 160 * col / width + 40 * row / height;
+
+			if (((col * 8 / width) ^ (row * 6 / height)) & 1)
+			{
+				luma = 255 - luma; //checkerboard of edges
+			}
+
+			for (uint32_t i = 0; i < 2; i ++)
+			{
+				seed = seed * 1103515245 + 12345;
+				int y = luma + (int)((seed >> 16) % 17) - 8;
+				px[2 * i] = (y < 0) ? 0 : (y > 255) ? 255 : y;
+			}
+
+			px[1] = 128 + 60 * row / height - 30;
+			px[3] = 128 - 60 * col / width + 30;
+		}
+	}
+
+	return yuyv;
+}
+
+static uint8_t * load_frame(const char * path, uint32_t width, uint32_t height)
+{
+	size_t size = width * height * 2;
+	uint8_t * yuyv = malloc(size);
+	FILE * f = fopen(path, "rb");
+
+	if (yuyv == NULL || f == NULL || fread(yuyv, 1, size, f) != size)
+	{
+		fprintf(stderr, "can't read %ux%u YUYV frame from %s\n", width, height, path);
+		free(yuyv);
+		yuyv = NULL;
+	}
+
+	if (f != NULL)
+	{
+		fclose(f);
+	}
+
+	return yuyv;
+}
+
+uint32_t bench_frames_synthetic(bench_frame_t * frames, uint32_t num_frames)
+{
+	static const uint32_t synthetic_sizes[][2] = {{160, 120}, {320, 240}, {640, 480}}; //QQVGA, QVGA, VGA
+
+	for (uint32_t i = 0; i < sizeof(synthetic_sizes) / sizeof(synthetic_sizes[0]) && num_frames < BENCH_FRAMES_MAX; i ++)
+	{
+		frames[num_frames].name = "synthetic";
+		frames[num_frames].width = synthetic_sizes[i][0];
+		frames[num_frames].height = synthetic_sizes[i][1];
+		frames[num_frames].yuyv = synthetic_frame(synthetic_sizes[i][0], synthetic_sizes[i][1]);
+		num_frames ++;
+	}
+
+	return num_frames;
+}
+
+uint32_t bench_frames_load(bench_frame_t * frames, uint32_t num_frames, const char * arg)
+{
+	unsigned width, height, path_offset = 0;
+
+	if (num_frames == BENCH_FRAMES_MAX || sscanf(arg, "%ux%u:%n", &width, &height, &path_offset) != 2 || path_offset == 0)
+	{
+		fprintf(stderr, "bad frame %s, expected WxH:file.yuyv\n", arg);
+		return 0;
+	}
+
+	frames[num_frames].name = "recorded";
+	frames[num_frames].width = width;
+	frames[num_frames].height = height;
+	frames[num_frames].yuyv = load_frame(arg + path_offset, width, height);
+
+	return (frames[num_frames].yuyv != NULL) ? num_frames + 1 : 0;
+}
+
+void bench_frames_free(bench_frame_t * frames, uint32_t num_frames)
+{
+	for (uint32_t i = 0; i < num_frames; i ++)
+	{
+		free(frames[i].yuyv);
+		frames[i].yuyv = NULL;
+	}
+}
@@ -0,0 +1,28 @@
+//YUYV frames the host tools encode: synthetic ones at QQVGA, QVGA and VGA plus recorded ones given on the command line
+#ifndef BENCH_FRAMES_H
+#define BENCH_FRAMES_H
+
+#include <stdint.h>
+
+#define BENCH_FRAMES_MAX	16
+
+typedef struct
+{
+	const char * name;
+	uint32_t width;
+	uint32_t height;
+	uint8_t * yuyv;
+} bench_frame_t;
+
+//monotonic time in seconds
+double bench_now_sec(void);
+
+//adds the synthetic frames, returns the new number of frames
+uint32_t bench_frames_synthetic(bench_frame_t * frames, uint32_t num_frames);
+
+//adds a recorded frame given as WxH:frame.yuyv, returns the new number of frames or 0 if it can't be read
+uint32_t bench_frames_load(bench_frame_t * frames, uint32_t num_frames, const char * arg);
+
+void bench_frames_free(bench_frame_t * frames, uint32_t num_frames);
+
+#endif
@@ -0,0 +1,220 @@
+//Host benchmark of the JPEG encoder. Encodes synthetic YUYV frames at QQVGA, QVGA and VGA, plus any recorded frames given
+//with -f, and reports throughput, frame size, time spent in each encoder stage and coefficient statistics. -R encodes all
+//but the centre of the frame at that ROI level.
+//
+//usage: jpeg_bench [-n iterations] [-q quality] [-r restart_rows] [-H huffman_period] [-s 420|422|400] [-R roi_level] [-o out_dir] [-f WxH:frame.yuyv]...
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "jpeg.h"
+#include "bench_frames.h"
+
+typedef struct
+{
+	uint32_t iterations;
+	int quality;
+	uint32_t restart_rows;
+	uint32_t huffman_period;
+	colorspace_t colorspace;
+	uint32_t roi_level; //0 - no ROI map
+	const char * out_dir;
+} bench_config_t;
+
+static const char * stage_names[JPEG_STAGE_COUNT] = {"load", "dct+quant", "huffman", "output"};
+static const char * component_names[3] = {"Y", "Cb", "Cr"};
+
+static int bench_frame(const bench_frame_t * frame, const bench_config_t * config)
+{
+	static jpeg_encoder_ctx_t ctx;
+	uint32_t input_size = frame->width * frame->height * 2;
+	jpeg_t output = {.buf = malloc(input_size), .buf_max_size = input_size};
+	jpeg_stats_t stats;
+	uint64_t ticks[JPEG_STAGE_COUNT] = {0};
+	uint64_t mcus_timed = 0;
+	uint64_t bytes = 0;
+	uint32_t mcu_width = JPEG_MCU_WIDTH(config->colorspace);
+	uint32_t mcu_height = JPEG_MCU_HEIGHT(config->colorspace);
+	uint32_t mcu_cols = (frame->width + mcu_width - 1) / mcu_width;
+	uint32_t mcu_rows = (frame->height + mcu_height - 1) / mcu_height;
+	uint8_t * roi_map = malloc(mcu_cols * mcu_rows);
+
+	if (output.buf == NULL || roi_map == NULL)
+	{
+		free(output.buf);
+		free(roi_map);
+		return -1;
+	}
+
+	//centre quarter of the frame at full quality
+	for (uint32_t row = 0; row < mcu_rows; row ++)
+	{
+		for (uint32_t col = 0; col < mcu_cols; col ++)
+		{
+			int centre = col >= mcu_cols / 4 && col < mcu_cols * 3 / 4 && row >= mcu_rows / 4 && row < mcu_rows * 3 / 4;
+			roi_map[row * mcu_cols + col] = centre ? 0 : config->roi_level;
+		}
+	}
+
+	jpeg_encoder_ctx_init(&ctx);
+	jpeg_set_restart_interval(&ctx, config->restart_rows);
+	jpeg_set_quality(&ctx, config->quality);
+	jpeg_set_huffman_optimize(&ctx, config->huffman_period);
+	jpeg_set_colorspace(&ctx, config->colorspace);
+	jpeg_set_roi_map(&ctx, (config->roi_level != 0) ? roi_map : NULL, mcu_cols, mcu_rows);
+
+	//warm up caches and let optimized tables settle
+	if (jpeg_encode(&ctx, frame->yuyv, input_size, frame->width, frame->height, &output) == ESP_ERR_NOT_SUPPORTED)
+	{
+		printf("%-12s %4ux%-4u skipped, the encoder is built for another frame\n", frame->name, frame->width, frame->height);
+		free(output.buf);
+		free(roi_map);
+		return 0;
+	}
+
+	//throughput, without statistics
+	double start = bench_now_sec();
+	for (uint32_t i = 0; i < config->iterations; i ++)
+	{
+		if (jpeg_encode(&ctx, frame->yuyv, input_size, frame->width, frame->height, &output) != ESP_OK)
+		{
+			fprintf(stderr, "%s: encode failed\n", frame->name);
+			free(output.buf);
+			free(roi_map);
+			return -1;
+		}
+		bytes += output.buf_written_size;
+	}
+	double elapsed = bench_now_sec() - start;
+
+	//time per stage, statistics are per frame
+	jpeg_set_stats(&ctx, &stats);
+	for (uint32_t i = 0; i < config->iterations; i ++)
+	{
+		jpeg_encode(&ctx, frame->yuyv, input_size, frame->width, frame->height, &output);
+		for (uint32_t stage = 0; stage < JPEG_STAGE_COUNT; stage ++)
+		{
+			ticks[stage] += stats.ticks[stage];
+		}
+		mcus_timed += stats.mcus;
+	}
+	jpeg_set_stats(&ctx, NULL);
+
+	uint64_t ticks_total = 0;
+	for (uint32_t stage = 0; stage < JPEG_STAGE_COUNT; stage ++)
+	{
+		ticks_total += ticks[stage];
+	}
+
+	uint32_t mcus = mcu_cols * mcu_rows;
+	printf("%-12s %4ux%-4u %8.3f ms/frame %8.0f fps %10.0f MCUs/s %8llu bytes/frame\n", frame->name, frame->width, frame->height,
+			elapsed * 1e3 / config->iterations, config->iterations / elapsed, (double) mcus * config->iterations / elapsed,
+			(unsigned long long) (bytes / config->iterations));
+
+	printf("%-12s", "");
+	for (uint32_t stage = 0; stage < JPEG_STAGE_COUNT; stage ++)
+	{
+		printf(" %s %.1f ns/MCU (%.1f%%)", stage_names[stage], mcus_timed ? (double) ticks[stage] / mcus_timed : 0.0,
+				ticks_total ? 100.0 * ticks[stage] / ticks_total : 0.0);
+	}
+	printf("\n");
+
+	//of the last frame
+	printf("%-12s", "");
+	for (uint32_t i = 0; i < 3; i ++)
+	{
+		if (stats.component[i].bits != 0)
+		{
+			printf(" %s %u bits %u nonzero %u EOB %u ZRL", component_names[i], stats.component[i].bits, stats.component[i].nonzero,
+					stats.component[i].eob, stats.component[i].zrl);
+		}
+	}
+	printf(" quality %d\n", stats.quality);
+
+	if (config->out_dir != NULL)
+	{
+		char path[512];
+		snprintf(path, sizeof(path), "%s/%s_%ux%u.jpg", config->out_dir, frame->name, frame->width, frame->height);
+		FILE * f = fopen(path, "wb");
+		if (f != NULL)
+		{
+			fwrite(output.buf, 1, output.buf_written_size, f);
+			fclose(f);
+		}
+	}
+
+	free(output.buf);
+	free(roi_map);
+	return 0;
+}
+
+int main(int argc, char ** argv)
+{
+	bench_config_t config = {100, JPEG_QUALITY_DEFAULT, 0, 0, YUV420, 0, NULL};
+	bench_frame_t frames[BENCH_FRAMES_MAX];
+	uint32_t num_frames = bench_frames_synthetic(frames, 0);
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:q:r:H:s:R:o:f:")) != -1)
+	{
+		switch (opt)
+		{
+			case 'n':
+				config.iterations = atoi(optarg);
+				break;
+			case 'q':
+				config.quality = atoi(optarg);
+				break;
+			case 'r':
+				config.restart_rows = atoi(optarg);
+				break;
+			case 'H':
+				config.huffman_period = atoi(optarg);
+				break;
+			case 's':
+				config.colorspace = (strcmp(optarg, "422") == 0) ? YUV422 : (strcmp(optarg, "400") == 0) ? YUV400 : YUV420;
+				break;
+			case 'R':
+				config.roi_level = atoi(optarg);
+				break;
+			case 'o':
+				config.out_dir = optarg;
+				break;
+			case 'f':
+				num_frames = bench_frames_load(frames, num_frames, optarg);
+				if (num_frames == 0)
+				{
+					return 1;
+				}
+				break;
+			default:
+				fprintf(stderr, "usage: %s [-n iterations] [-q quality] [-r restart_rows] [-H huffman_period] [-s 420|422|400] [-R roi_level] [-o out_dir] [-f WxH:frame.yuyv]...\n", argv[0]);
+				return 1;
+		}
+	}
+
+	if (config.iterations == 0 || config.quality < JPEG_QUALITY_MIN || config.quality > JPEG_QUALITY_MAX || config.roi_level >= JPEG_ROI_LEVELS)
+	{
+		fprintf(stderr, "iterations must be > 0, quality %d..%d and ROI level < %d\n", JPEG_QUALITY_MIN, JPEG_QUALITY_MAX, JPEG_ROI_LEVELS);
+		return 1;
+	}
+
+	static const char * colorspace_names[] = {"4:4:4", "4:2:2", "4:2:0", "grayscale"};
+	printf("quality %d, %s, restart rows %u, huffman optimize period %u, ROI level %u, %u iterations\n", config.quality,
+			colorspace_names[config.colorspace], config.restart_rows, config.huffman_period, config.roi_level, config.iterations);
+
+	int ret = 0;
+	for (uint32_t i = 0; i < num_frames; i ++)
+	{
+		if (frames[i].yuyv == NULL || bench_frame(&frames[i], &config) != 0)
+		{
+			ret = 1;
+		}
+	}
+	bench_frames_free(frames, num_frames);
+
+	return ret;
+}
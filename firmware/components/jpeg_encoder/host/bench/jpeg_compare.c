@@ -0,0 +1,225 @@
+//Host comparison of the encoder backends camera_module can run: jpegenc (this component) and jpge (camera driver
+//conversions). Both encode the same YUYV frames, synthetic ones plus any recorded ones given with -f, at each quality
+//given with -q, and time, frame size and, when built with libjpeg, PSNR are reported. jpge always encodes 4:2:0 from RGB,
+//as it does on target, its PSNR is against the full-range YCbCr of that RGB rather than the limited-range source.
+//
+//usage: jpeg_compare [-n iterations] [-q quality[,quality]...] [-s 420|422|400] [-o out_dir] [-f WxH:frame.yuyv]...
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "jpeg.h"
+#include "bench_frames.h"
+#include "jpge_backend.h"
+
+#include "jpeg_psnr.h"
+
+#define COMPARE_QUALITIES_MAX	16
+
+typedef struct
+{
+	uint32_t iterations;
+	int qualities[COMPARE_QUALITIES_MAX];
+	uint32_t num_qualities;
+	colorspace_t colorspace;
+	const char * out_dir;
+} compare_config_t;
+
+//encodes frame into out, returns the JPEG size, 0 if it failed
+typedef uint32_t (*compare_encode_t)(const bench_frame_t * frame, int quality, colorspace_t colorspace, uint8_t * out, uint32_t out_size);
+
+//writes the YUYV the backend's output is compared with into ref
+typedef void (*compare_reference_t)(const bench_frame_t * frame, uint8_t * ref);
+
+typedef struct
+{
+	const char * name;
+	compare_encode_t encode;
+	compare_reference_t reference; //NULL - the frame itself
+} compare_backend_t;
+
+static uint32_t encode_jpegenc(const bench_frame_t * frame, int quality, colorspace_t colorspace, uint8_t * out, uint32_t out_size)
+{
+	static jpeg_encoder_ctx_t ctx;
+	jpeg_t output = {.buf = out, .buf_max_size = out_size};
+
+	jpeg_encoder_ctx_init(&ctx);
+	jpeg_set_colorspace(&ctx, colorspace);
+	jpeg_set_quality(&ctx, quality);
+
+	if (jpeg_encode(&ctx, frame->yuyv, frame->width * frame->height * 2, frame->width, frame->height, &output) != ESP_OK)
+	{
+		return 0;
+	}
+	return output.buf_written_size;
+}
+
+static uint32_t encode_jpge(const bench_frame_t * frame, int quality, colorspace_t colorspace, uint8_t * out, uint32_t out_size)
+{
+	(void) colorspace;
+	return jpge_encode_yuyv(frame->yuyv, frame->width, frame->height, quality, out, out_size);
+}
+
+static void reference_jpge(const bench_frame_t * frame, uint8_t * ref)
+{
+	jpge_reference_yuyv(frame->yuyv, frame->width, frame->height, ref);
+}
+
+static const compare_backend_t backends[] = {{"jpegenc", encode_jpegenc, NULL}, {"jpge", encode_jpge, reference_jpge}};
+
+
+static int compare_frame(const bench_frame_t * frame, const compare_config_t * config)
+{
+	uint32_t out_size = frame->width * frame->height * 2 + 1024;
+	uint8_t * out = malloc(out_size);
+	bench_frame_t reference = *frame;
+	uint8_t * ref = malloc(frame->width * frame->height * 2);
+
+	if (out == NULL || ref == NULL)
+	{
+		free(out);
+		free(ref);
+		return -1;
+	}
+
+	for (uint32_t q = 0; q < config->num_qualities; q ++)
+	{
+		for (uint32_t b = 0; b < sizeof(backends) / sizeof(backends[0]); b ++)
+		{
+			int quality = config->qualities[q];
+			uint32_t size = backends[b].encode(frame, quality, config->colorspace, out, out_size); //warm up
+
+			double start = bench_now_sec();
+			for (uint32_t i = 0; i < config->iterations && size != 0; i ++)
+			{
+				size = backends[b].encode(frame, quality, config->colorspace, out, out_size);
+			}
+			double elapsed = bench_now_sec() - start;
+
+			if (size == 0)
+			{
+				fprintf(stderr, "%s: %s failed at quality %d\n", frame->name, backends[b].name, quality);
+				free(out);
+				free(ref);
+				return -1;
+			}
+
+			printf("%-10s %4ux%-4u %-8s q%-3d %8.3f ms/frame %8u bytes %6.3f bpp", frame->name, frame->width, frame->height,
+					backends[b].name, quality, elapsed * 1e3 / config->iterations, size, 8.0 * size / (frame->width * frame->height));
+
+#ifdef BENCH_LIBJPEG
+			double psnr_y, psnr_c;
+			reference.yuyv = frame->yuyv;
+			if (backends[b].reference != NULL)
+			{
+				backends[b].reference(frame, ref);
+				reference.yuyv = ref;
+			}
+			if (bench_jpeg_psnr(&reference, out, size, &psnr_y, &psnr_c) == 0)
+			{
+				printf("  PSNR Y %5.2f dB C %5.2f dB", psnr_y, psnr_c);
+			}
+			else
+			{
+				printf("  doesn't decode");
+			}
+#endif
+			printf("\n");
+
+			if (config->out_dir != NULL)
+			{
+				char path[512];
+				snprintf(path, sizeof(path), "%s/%s_%ux%u_%s_q%d.jpg", config->out_dir, frame->name, frame->width, frame->height,
+						backends[b].name, quality);
+				FILE * f = fopen(path, "wb");
+				if (f != NULL)
+				{
+					fwrite(out, 1, size, f);
+					fclose(f);
+				}
+			}
+		}
+	}
+
+	free(out);
+	free(ref);
+	return 0;
+}
+
+int main(int argc, char ** argv)
+{
+	compare_config_t config = {20, {50, 75, 90}, 3, YUV420, NULL};
+	bench_frame_t frames[BENCH_FRAMES_MAX];
+	uint32_t num_frames = bench_frames_synthetic(frames, 0);
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:q:s:o:f:")) != -1)
+	{
+		switch (opt)
+		{
+			case 'n':
+				config.iterations = atoi(optarg);
+				break;
+			case 'q':
+			{
+				char * next = optarg;
+				config.num_qualities = 0;
+				while (*next != '\0' && config.num_qualities < COMPARE_QUALITIES_MAX)
+				{
+					config.qualities[config.num_qualities ++] = strtol(next, &next, 10);
+					next += (*next == ',') ? 1 : 0;
+				}
+				break;
+			}
+			case 's':
+				config.colorspace = (strcmp(optarg, "422") == 0) ? YUV422 : (strcmp(optarg, "400") == 0) ? YUV400 : YUV420;
+				break;
+			case 'o':
+				config.out_dir = optarg;
+				break;
+			case 'f':
+				num_frames = bench_frames_load(frames, num_frames, optarg);
+				if (num_frames == 0)
+				{
+					return 1;
+				}
+				break;
+			default:
+				fprintf(stderr, "usage: %s [-n iterations] [-q quality[,quality]...] [-s 420|422|400] [-o out_dir] [-f WxH:frame.yuyv]...\n", argv[0]);
+				return 1;
+		}
+	}
+
+	for (uint32_t q = 0; q < config.num_qualities; q ++)
+	{
+		if (config.qualities[q] < JPEG_QUALITY_MIN || config.qualities[q] > JPEG_QUALITY_MAX)
+		{
+			fprintf(stderr, "quality must be %d..%d\n", JPEG_QUALITY_MIN, JPEG_QUALITY_MAX);
+			return 1;
+		}
+	}
+
+	if (config.iterations == 0 || config.num_qualities == 0)
+	{
+		fprintf(stderr, "iterations and qualities must be given\n");
+		return 1;
+	}
+
+	static const char * colorspace_names[] = {"4:4:4", "4:2:2", "4:2:0", "grayscale"};
+	printf("jpegenc %s, jpge 4:2:0, %u iterations\n", colorspace_names[config.colorspace], config.iterations);
+
+	int ret = 0;
+	for (uint32_t i = 0; i < num_frames; i ++)
+	{
+		if (frames[i].yuyv == NULL || compare_frame(&frames[i], &config) != 0)
+		{
+			ret = 1;
+		}
+	}
+	bench_frames_free(frames, num_frames);
+
+	return ret;
+}
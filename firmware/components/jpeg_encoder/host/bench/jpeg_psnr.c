@@ -0,0 +1,67 @@
+//Kept apart from the encoder headers, libjpeg uses the same function names (jpeg_set_quality, jpeg_set_colorspace).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include <jpeglib.h>
+
+#include "jpeg_psnr.h"
+
+static double psnr(double sq_err, uint64_t samples)
+{
+	return (sq_err == 0) ? 99.99 : 10 * log10(255.0 * 255.0 * samples / sq_err);
+}
+
+int bench_jpeg_psnr(const bench_frame_t * frame, const uint8_t * jpeg, uint32_t size, double * psnr_y, double * psnr_c)
+{
+	struct jpeg_decompress_struct dinfo;
+	struct jpeg_error_mgr jerr;
+	double err_y = 0, err_c = 0;
+
+	dinfo.err = jpeg_std_error(&jerr);
+	jpeg_create_decompress(&dinfo);
+	jpeg_mem_src(&dinfo, (unsigned char *) jpeg, size);
+
+	if (jpeg_read_header(&dinfo, TRUE) != JPEG_HEADER_OK || dinfo.image_width != frame->width || dinfo.image_height != frame->height)
+	{
+		jpeg_destroy_decompress(&dinfo);
+		return -1;
+	}
+
+	int grayscale = (dinfo.jpeg_color_space == JCS_GRAYSCALE);
+	dinfo.out_color_space = grayscale ? JCS_GRAYSCALE : JCS_YCbCr;
+	jpeg_start_decompress(&dinfo);
+
+	uint32_t channels = dinfo.output_components;
+	uint8_t * line = malloc(frame->width * channels);
+
+	while (dinfo.output_scanline < dinfo.output_height)
+	{
+		uint32_t row = dinfo.output_scanline;
+		JSAMPROW rows[1] = {line};
+		jpeg_read_scanlines(&dinfo, rows, 1);
+
+		const uint8_t * src = frame->yuyv + row * frame->width * 2;
+		for (uint32_t col = 0; col < frame->width; col ++)
+		{
+			int d = line[col * channels] - src[col * 2];
+			err_y += d * d;
+
+			if (!grayscale && (col & 1) == 0 && col + 1 < frame->width)
+			{
+				int cb = (line[col * 3 + 1] + line[col * 3 + 4] + 1) / 2 - src[col * 2 + 1];
+				int cr = (line[col * 3 + 2] + line[col * 3 + 5] + 1) / 2 - src[col * 2 + 3];
+				err_c += cb * cb + cr * cr;
+			}
+		}
+	}
+
+	jpeg_finish_decompress(&dinfo);
+	jpeg_destroy_decompress(&dinfo);
+	free(line);
+
+	*psnr_y = psnr(err_y, (uint64_t) frame->width * frame->height);
+	*psnr_c = grayscale ? 0 : psnr(err_c, (uint64_t) (frame->width / 2) * frame->height * 2);
+	return 0;
+}
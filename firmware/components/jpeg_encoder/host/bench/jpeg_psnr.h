@@ -0,0 +1,13 @@
+//PSNR of encoded frames against their YUYV source, needs libjpeg
+#ifndef JPEG_PSNR_H
+#define JPEG_PSNR_H
+
+#include <stdint.h>
+
+#include "bench_frames.h"
+
+//decodes the JPEG to YCbCr and compares it with the source, luma per pixel and chroma per pixel pair (YUYV resolution).
+//psnr_c is 0 for grayscale. Returns -1 if it doesn't decode
+int bench_jpeg_psnr(const bench_frame_t * frame, const uint8_t * jpeg, uint32_t size, double * psnr_y, double * psnr_c);
+
+#endif
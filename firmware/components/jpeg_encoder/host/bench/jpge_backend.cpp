@@ -0,0 +1,106 @@
+#include "jpge_backend.h"
+
+#include <string.h>
+#include <stdlib.h>
+
+#include "jpge.h"
+#include "yuv.h"
+
+//fixed output buffer, the part that doesn't fit is dropped and the stream marked as failed
+class buffer_stream : public jpge::output_stream {
+public:
+    buffer_stream(uint8_t *buf, uint32_t size) : m_buf(buf), m_size(size), m_index(0), m_overflow(false) { }
+    virtual ~buffer_stream() { }
+    virtual bool put_buf(const void *data, int len)
+    {
+        if (data == NULL) {
+            return true; //end of image
+        }
+        if ((uint32_t) len > m_size - m_index) {
+            m_overflow = true;
+            return false;
+        }
+        memcpy(m_buf + m_index, data, len);
+        m_index += len;
+        return true;
+    }
+    virtual uint get_size() const
+    {
+        return m_index;
+    }
+    uint32_t size() const
+    {
+        return m_overflow ? 0 : m_index;
+    }
+
+private:
+    uint8_t *m_buf;
+    uint32_t m_size;
+    uint32_t m_index;
+    bool m_overflow;
+};
+
+//same conversion as convert_line_format() for PIXFORMAT_YUV422
+static void yuyv_line_to_rgb(const uint8_t *src, uint8_t *dst, uint32_t width)
+{
+    for (uint32_t i = 0; i < width * 2; i += 4) {
+        yuv2rgb(src[i], src[i + 1], src[i + 3], &dst[0], &dst[1], &dst[2]);
+        yuv2rgb(src[i + 2], src[i + 1], src[i + 3], &dst[3], &dst[4], &dst[5]);
+        dst += 6;
+    }
+}
+
+//jpge's RGB_to_YCC()
+static void rgb_to_ycc(const uint8_t *rgb, int *y, int *cb, int *cr)
+{
+    const int r = rgb[0], g = rgb[1], b = rgb[2];
+    *y = (r * 19595 + g * 38470 + b * 7471 + 32768) >> 16;
+    *cb = 128 + ((r * -11059 + g * -21709 + b * 32768 + 32768) >> 16);
+    *cr = 128 + ((r * 32768 + g * -27439 + b * -5329 + 32768) >> 16);
+}
+
+static uint8_t clamp_u8(int i)
+{
+    return (i < 0) ? 0 : (i > 255) ? 255 : (uint8_t) i;
+}
+
+void jpge_reference_yuyv(const uint8_t *yuyv, uint32_t width, uint32_t height, uint8_t *ref)
+{
+    uint8_t rgb[6];
+
+    for (uint32_t i = 0; i < width * height * 2; i += 4) {
+        int y0, cb0, cr0, y1, cb1, cr1;
+        yuv2rgb(yuyv[i], yuyv[i + 1], yuyv[i + 3], &rgb[0], &rgb[1], &rgb[2]);
+        yuv2rgb(yuyv[i + 2], yuyv[i + 1], yuyv[i + 3], &rgb[3], &rgb[4], &rgb[5]);
+        rgb_to_ycc(&rgb[0], &y0, &cb0, &cr0);
+        rgb_to_ycc(&rgb[3], &y1, &cb1, &cr1);
+
+        ref[i] = clamp_u8(y0);
+        ref[i + 1] = clamp_u8((clamp_u8(cb0) + clamp_u8(cb1) + 1) / 2);
+        ref[i + 2] = clamp_u8(y1);
+        ref[i + 3] = clamp_u8((clamp_u8(cr0) + clamp_u8(cr1) + 1) / 2);
+    }
+}
+
+uint32_t jpge_encode_yuyv(const uint8_t *yuyv, uint32_t width, uint32_t height, int quality, uint8_t *out, uint32_t out_size)
+{
+    jpge::params comp_params = jpge::params();
+    comp_params.m_subsampling = jpge::H2V2;
+    comp_params.m_quality = quality;
+
+    buffer_stream stream(out, out_size);
+    jpge::jpeg_encoder encoder;
+    uint8_t *line = (uint8_t *) malloc(width * 3);
+    bool ok = (line != NULL) && encoder.init(&stream, width, height, 3, comp_params);
+
+    for (uint32_t row = 0; row < height && ok; row++) {
+        yuyv_line_to_rgb(yuyv + row * width * 2, line, width);
+        ok = encoder.process_scanline(line);
+    }
+
+    ok = ok && encoder.process_scanline(NULL);
+    encoder.deinit();
+    free(line);
+
+    return ok ? stream.size() : 0;
+}
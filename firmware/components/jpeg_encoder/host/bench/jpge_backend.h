@@ -0,0 +1,23 @@
+//jpge, the encoder of the camera driver's conversions, the way camera_module runs it (fmt2jpg_cb() of to_jpg.cpp): YUYV
+//lines are converted to RGB and encoded 4:2:0
+#ifndef JPGE_BACKEND_H
+#define JPGE_BACKEND_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//returns the size of the JPEG written into out, 0 if it failed or didn't fit
+uint32_t jpge_encode_yuyv(const uint8_t * yuyv, uint32_t width, uint32_t height, int quality, uint8_t * out, uint32_t out_size);
+
+//what jpge actually encodes, as YUYV: the full-range YCbCr of the RGB the camera's limited-range YUYV converts to, chroma
+//averaged over pixel pairs. Its output is compared with this rather than with the source
+void jpge_reference_yuyv(const uint8_t * yuyv, uint32_t width, uint32_t height, uint8_t * ref);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,8 @@
+//host shim of ESP-IDF esp_attr.h, code and data placement doesn't matter on the host
+#ifndef ESP_ATTR_H
+#define ESP_ATTR_H
+
+#define IRAM_ATTR
+#define DRAM_ATTR
+
+#endif
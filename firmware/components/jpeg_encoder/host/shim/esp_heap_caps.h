@@ -0,0 +1,16 @@
+//host shim of ESP-IDF esp_heap_caps.h, there is one heap
+#ifndef ESP_HEAP_CAPS_H
+#define ESP_HEAP_CAPS_H
+
+#include <stdlib.h>
+
+#define MALLOC_CAP_8BIT		(1 << 2)
+#define MALLOC_CAP_SPIRAM	(1 << 10)
+
+static inline void * heap_caps_malloc(size_t size, int caps)
+{
+	(void) caps;
+	return malloc(size);
+}
+
+#endif
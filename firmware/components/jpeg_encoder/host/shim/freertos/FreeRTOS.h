@@ -0,0 +1,16 @@
+//host shim of the FreeRTOS types used by the encoder
+#ifndef FREERTOS_H
+#define FREERTOS_H
+
+#include <stdint.h>
+
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t TickType_t;
+
+#define pdFALSE			0
+#define pdTRUE			1
+#define pdPASS			pdTRUE
+#define portMAX_DELAY	((TickType_t) 0xffffffffUL)
+
+#endif
@@ -0,0 +1,58 @@
+//host shim of FreeRTOS binary semaphores on top of pthreads, timeouts other than 0 and portMAX_DELAY wait forever
+#ifndef SEMPHR_H
+#define SEMPHR_H
+
+#include <pthread.h>
+
+#include "freertos/FreeRTOS.h"
+
+typedef struct
+{
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int count;
+} StaticSemaphore_t;
+
+typedef StaticSemaphore_t * SemaphoreHandle_t;
+
+static inline SemaphoreHandle_t xSemaphoreCreateBinaryStatic(StaticSemaphore_t * buf)
+{
+	pthread_mutex_init(&buf->mutex, NULL);
+	pthread_cond_init(&buf->cond, NULL);
+	buf->count = 0;
+	return buf;
+}
+
+static inline BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticks_to_wait)
+{
+	BaseType_t taken = pdFALSE;
+
+	pthread_mutex_lock(&sem->mutex);
+	while (sem->count == 0 && ticks_to_wait != 0)
+	{
+		pthread_cond_wait(&sem->cond, &sem->mutex);
+	}
+	if (sem->count != 0)
+	{
+		sem->count = 0;
+		taken = pdTRUE;
+	}
+	pthread_mutex_unlock(&sem->mutex);
+
+	return taken;
+}
+
+static inline BaseType_t xSemaphoreGive(SemaphoreHandle_t sem)
+{
+	BaseType_t given;
+
+	pthread_mutex_lock(&sem->mutex);
+	given = (sem->count == 0) ? pdTRUE : pdFALSE;
+	sem->count = 1;
+	pthread_cond_signal(&sem->cond);
+	pthread_mutex_unlock(&sem->mutex);
+
+	return given;
+}
+
+#endif
@@ -0,0 +1,5 @@
+//host shim of the ESP-IDF generated configuration, the encoder's options are set in CMakeLists.txt
+#ifndef SDKCONFIG_H
+#define SDKCONFIG_H
+
+#endif
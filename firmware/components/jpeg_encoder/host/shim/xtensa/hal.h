@@ -0,0 +1,16 @@
+//host shim of the Xtensa cycle counter used for encoder profiling, counts nanoseconds instead of CPU cycles
+#ifndef XTENSA_HAL_H
+#define XTENSA_HAL_H
+
+#include <stdint.h>
+#include <time.h>
+
+static inline uint32_t xthal_get_ccount(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint32_t) now.tv_sec * 1000000000u + (uint32_t) now.tv_nsec;
+}
+
+#endif
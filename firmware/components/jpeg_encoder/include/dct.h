@@ -24,8 +24,22 @@
 extern "C" {
 #endif
 
+#include <stdint.h>
+
+// reciprocals of a quantization table with the AAN output scaling folded in,
+// zig-zag order
+typedef struct dct_qtable_s
+{
+	unsigned short recip[64];
+	unsigned char  shift[64];
+}
+dct_qtable_t;
+
+extern const unsigned char dct_zig[64];
+
 // integer DCTs
-void dct(short pixel[8][8], short data[8][8]);
+void dct_qtable_init(dct_qtable_t *const qt, const unsigned char qtable[64]);
+unsigned dct_quantize(const short pixels[8][8], short data[64], const dct_qtable_t *const qt);
 
 #ifdef __cplusplus
 }
@@ -3,21 +3,210 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdbool.h>
 
 #include "dct.h"
 #include "jpegenc.h"
 
 #include "esp_err.h"
+#include "sdkconfig.h"
+
+//with CONFIG_JPEG_FIXED_FRAME the encoder is built for the camera's frame size and the configured subsampling only, frame
+//geometry is a compile-time constant. Other frames are rejected with ESP_ERR_NOT_SUPPORTED, as is any other colorspace
+#if CONFIG_JPEG_FIXED_FRAME
+#define JPEG_FIXED_WIDTH	CONFIG_CAMERA_FRAME_WIDTH
+#define JPEG_FIXED_HEIGHT	CONFIG_CAMERA_FRAME_HEIGHT
+#if CONFIG_JPEG_GRAYSCALE
+#define JPEG_FIXED_COLORSPACE	YUV400
+#elif CONFIG_JPEG_SUBSAMPLING_422
+#define JPEG_FIXED_COLORSPACE	YUV422
+#else
+#define JPEG_FIXED_COLORSPACE	YUV420
+#endif
+#endif
+
+//where a frame comes from and when it was encoded, carried along with it to the receiver. Filled in by the application,
+//the encoder only sets quality to the one the frame was coded with
+typedef struct
+{
+	int64_t capture_us;      //camera frame's VSYNC, esp_timer time
+	int64_t encode_start_us;
+	int64_t encode_end_us;
+	uint32_t seq;            //camera frame sequence number
+	uint16_t width;
+	uint16_t height;
+	uint8_t quality;
+} jpeg_frame_info_t;
 
 typedef struct
 {
 	uint8_t * buf;
 	uint32_t buf_written_size;
 	uint32_t buf_max_size;
+	uint8_t * luma_map;      //optional 1/8 scale luminance of the frame, NULL - not produced
+	uint32_t luma_map_size;  //bytes, at least JPEG_LUMA_MAP_SIZE() of the frame or no map is produced
+	jpeg_frame_info_t info;
 } jpeg_t;
 
+//luma map of a frame: one byte per 8x8 block, rows of (width + 7) / 8. Taken from the DC coefficients of the Y blocks while
+//they are encoded, so it comes at no extra pass over the frame and is only valid if the encode succeeded. Its resolution
+//is that of the luma DC quantizer, 1 level at the default quality
+#define JPEG_LUMA_MAP_SIZE(width, height)	((((width) + 7) / 8) * (((height) + 7) / 8))
+
+//encoder stages timed while statistics are attached. DCT and quantization are one fused pass
+typedef enum
+{
+	JPEG_STAGE_LOAD, //YUYV to centered 8x8 blocks
+	JPEG_STAGE_DCT_QUANT,
+	JPEG_STAGE_HUFFMAN,
+	JPEG_STAGE_OUTPUT, //headers, reserving and handing over output buffers, finishing the code-stream
+	JPEG_STAGE_COUNT
+} jpeg_stage_t;
+
+//statistics of the last frame encoded with a context, cleared when the next one starts. Ticks (CPU cycles on target,
+//nanoseconds in the host build) and overflows add up every attempt at the frame, including re-encodes after an overflow,
+//the block counts are those of the code-stream that was produced. Parts of a stripe-parallel frame are added to the owner's
+//statistics by jpeg_encode_parallel_end()
+typedef struct
+{
+	uint32_t mcus;
+	uint32_t ticks[JPEG_STAGE_COUNT];
+	huffman_counts_t component[3]; //Y, Cb, Cr
+	uint32_t overflows; //attempts that ran out of output buffer
+	uint32_t size;      //bytes, 0 - the frame failed
+	int quality;        //of the tables the frame was encoded with
+	bool keyframe;      //false for partial frames (conditional replenishment)
+} jpeg_stats_t;
+
+#define JPEG_STRIPE_PARTS_MAX	2 //one per core
+
+//stripe-parallel encode of one frame. The frame is cut into stripes of restart_rows MCU rows, separated by RSTn markers.
+//Contiguous runs of stripes (parts) are encoded by different workers, each with its own encoder context, into separate
+//regions of the output buffer and then joined by jpeg_encode_parallel_end()
+typedef struct
+{
+	jpeg_encoder_ctx_t * owner; //context that wrote the headers, workers copy its tables
+	uint8_t * input_buf;
+	uint32_t input_buf_size;
+	uint32_t frame_width;
+	uint32_t frame_height;
+	jpeg_t * output;
+	uint32_t num_stripes;
+	uint32_t num_parts;
+	jpeg_t part_out[JPEG_STRIPE_PARTS_MAX];
+	volatile esp_err_t part_status[JPEG_STRIPE_PARTS_MAX];
+	jpeg_stats_t * part_stats[JPEG_STRIPE_PARTS_MAX]; //of the contexts other than the owner's, added to the owner's at the end
+} jpeg_stripe_job_t;
+
+//encode of a frame that is still being captured. MCU rows are encoded as soon as the lines they cover are in input_buf,
+//jpeg_encode_stream_end() finishes the frame once all of it is
+typedef struct
+{
+	uint8_t * input_buf;
+	uint32_t input_buf_size; //of the whole frame
+	uint32_t frame_width;
+	uint32_t frame_height;
+	jpeg_t * output;
+	uint32_t mcu_rows_done;
+	esp_err_t status;
+} jpeg_stream_t;
+
+//conditional replenishment: after a keyframe (a complete JPEG) frames are partial, they only carry the stripes (restart
+//intervals) in which some 8x8 luma block changed its mean or gradients by more than threshold levels since the stripe was last
+//sent, each started by JPEG_MARKER_STRIPE, see huffman_stripe_begin(). The receiver patches them into its last image. A
+//keyframe is encoded every keyframe_period frames, after tables, frame size or restart interval changed and after a frame
+//failed, so a receiver that lost a partial frame is back in sync by the next one
+typedef struct
+{
+	uint32_t * sig;           //signature of every luma block as last sent, given by the application
+	uint32_t sig_count;       //entries of sig, at least JPEG_REPLENISH_SIG_COUNT() of the frame or frames are all keyframes
+	uint32_t keyframe_period; //frames, 1 makes every frame a keyframe
+	uint32_t threshold;       //luma levels
+	//state, cleared by jpeg_set_replenish()
+	uint32_t frames;          //since the last keyframe
+	uint32_t frame_width;     //of the last keyframe
+	uint32_t frame_height;
+	uint32_t restart_rows;
+	bool keyframe;            //the last frame was one
+	bool keyframe_pending;    //the next frame must be one
+	uint32_t stripes;         //of the last frame
+	uint32_t stripes_sent;    //of them encoded, all for keyframes
+} jpeg_replenish_t;
+
+//signatures needed for a frame, one per 8x8 luma block of any colorspace
+#define JPEG_REPLENISH_SIG_COUNT(width, height)	((((width) + 15) / 16 * 2) * (((height) + 15) / 16 * 2))
+
+#define JPEG_ROI_LEVELS	4
+
+//restart interval in MCU rows, 0 disables restart markers. Required for stripe-parallel encoding
+esp_err_t jpeg_set_restart_interval(jpeg_encoder_ctx_t * ctx, uint32_t mcu_rows);
+
+//quality factor [JPEG_QUALITY_MIN, JPEG_QUALITY_MAX] of the quantization tables, IJG scale. With rate control on it is the
+//highest quality the controller may use
+esp_err_t jpeg_set_quality(jpeg_encoder_ctx_t * ctx, int quality);
+
+//sampling of the encoded frames: YUV420 (default), YUV422 keeps the full vertical chroma resolution of the YUYV input, YUV400
+//encodes luminance only. ESP_ERR_NOT_SUPPORTED for YUV444
+esp_err_t jpeg_set_colorspace(jpeg_encoder_ctx_t * ctx, colorspace_t colorspace);
+
+//quality the next frame will be encoded with
+int jpeg_get_quality(jpeg_encoder_ctx_t * ctx);
+
+//region of interest map: a quality level per MCU, mcu_cols by mcu_rows row by row, 0 keeps the frame's quality and each
+//level up to JPEG_ROI_LEVELS - 1 spends fewer bits. Baseline JPEG has one quantization table per component for the whole
+//scan, so levels requantize AC coefficients of their MCUs with 2, 4 or 8 times the table's step and drop high frequencies,
+//which any decoder reads with the frame's table. The map is read while frames are encoded and only applies to frames of
+//that many MCUs (JPEG_MCU_WIDTH/HEIGHT of the colorspace), NULL encodes the whole frame at its quality
+esp_err_t jpeg_set_roi_map(jpeg_encoder_ctx_t * ctx, const uint8_t * map, uint32_t mcu_cols, uint32_t mcu_rows);
+
+//rate control: quality is adjusted from frame to frame to keep encoded frames around target_size bytes, and frames that
+//don't fit into the output buffer are re-encoded at lower quality instead of being dropped. 0 disables it
+esp_err_t jpeg_set_target_size(jpeg_encoder_ctx_t * ctx, uint32_t target_size);
+
+//attaches statistics to ctx, every encode fills them in, NULL detaches. Blocks are timed and counted only while attached
+esp_err_t jpeg_set_stats(jpeg_encoder_ctx_t * ctx, jpeg_stats_t * stats);
+
+//optimized Huffman tables: symbol statistics are gathered while encoding and every period_frames frames the tables are
+//rebuilt from them and used (with a matching DHT) for the following frames, so encoding stays single-pass. In stripe-parallel
+//mode statistics come from the owner's part of the frame. 0 selects the standard tables
+esp_err_t jpeg_set_huffman_optimize(jpeg_encoder_ctx_t * ctx, uint32_t period_frames);
+
+//output sink: the code-stream is written into buffers handed out by sink and each one is passed back to it as soon as it is
+//full, see huffman_sink_t, instead of into output->buf (output only gets the size). Frames can't be re-encoded then, one
+//the sink has no buffers for fails with ESP_ERR_INVALID_STATE if nothing of it was written, ESP_ERR_NO_MEM otherwise.
+//Not for stripe-parallel encode. NULL removes the sink
+esp_err_t jpeg_set_output_sink(jpeg_encoder_ctx_t * ctx, huffman_sink_t sink, void * arg);
+
+//attaches conditional replenishment state to ctx, the next frame is a keyframe. NULL detaches it, every frame is complete.
+//Needs restart markers and frames encoded in order by jpeg_encode() on one ctx, stream and stripe-parallel encodes fail with
+//ESP_ERR_NOT_SUPPORTED while it is attached
+esp_err_t jpeg_set_replenish(jpeg_encoder_ctx_t * ctx, jpeg_replenish_t * replenish);
+
 //uint32_t jpeg_encode(uint8_t * input_buf, uint32_t input_buf_size, uint8_t * jpeg_buf, uint32_t jpeg_buf_size, uint32_t frame_width, uint32_t frame_height);
 
-esp_err_t jpeg_encode(uint8_t * input_buf, uint32_t input_buf_size, uint32_t frame_width, uint32_t frame_height, jpeg_t * output);
+//ctx must be initialized with jpeg_encoder_ctx_init(), each concurrently running encode needs its own ctx
+esp_err_t jpeg_encode(jpeg_encoder_ctx_t * ctx, uint8_t * input_buf, uint32_t input_buf_size, uint32_t frame_width, uint32_t frame_height, jpeg_t * output);
+
+//writes headers and prepares the job, the frame is encoded by calling jpeg_encode_part() once for each part [0, job->num_parts)
+//from any task. num_parts may be reduced if the frame has fewer stripes
+esp_err_t jpeg_encode_parallel_begin(jpeg_encoder_ctx_t * ctx, jpeg_stripe_job_t * job, uint8_t * input_buf, uint32_t input_buf_size, uint32_t frame_width, uint32_t frame_height, jpeg_t * output, uint32_t num_parts);
+
+esp_err_t jpeg_encode_part(jpeg_encoder_ctx_t * ctx, jpeg_stripe_job_t * job, uint32_t part);
+
+//called by the owner once all parts are done, joins parts into output
+esp_err_t jpeg_encode_parallel_end(jpeg_encoder_ctx_t * ctx, jpeg_stripe_job_t * job);
+
+//writes headers, input_buf may still be empty. ctx stays busy with the stream until jpeg_encode_stream_end()
+esp_err_t jpeg_encode_stream_begin(jpeg_encoder_ctx_t * ctx, jpeg_stream_t * stream, uint8_t * input_buf, uint32_t input_buf_size, uint32_t frame_width, uint32_t frame_height, jpeg_t * output);
+
+//encodes the MCU rows that lie within the top lines_ready lines of the frame and weren't encoded yet
+esp_err_t jpeg_encode_stream_rows(jpeg_encoder_ctx_t * ctx, jpeg_stream_t * stream, uint32_t lines_ready);
+
+//called once the whole frame is in input_buf, encodes the remaining rows and finishes output. A frame that overflowed
+//is re-encoded by jpeg_encode(), unless it went to an output sink
+esp_err_t jpeg_encode_stream_end(jpeg_encoder_ctx_t * ctx, jpeg_stream_t * stream);
+
+//gives up a stream that won't be finished, e.g. its frame was dropped. The output sink gets its buffer back
+esp_err_t jpeg_encode_stream_abort(jpeg_encoder_ctx_t * ctx, jpeg_stream_t * stream);
 
 #endif
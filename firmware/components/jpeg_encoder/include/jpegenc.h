@@ -20,6 +20,8 @@
 #ifndef __JPEG_H__
 #define __JPEG_H__
 
+#include "dct.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -45,38 +47,146 @@ RGB to YCbCr Conversion:
 
 //---------------- J P E G ---------------
 
-// Application should provide this function for JPEG stream flushing
-void write_jpeg(const unsigned char buff[], const unsigned size);
-
 typedef enum
 {
 	YUV444,
-	YUV422,
-	YUV420
+	YUV422, // H2V1
+	YUV420, // H2V2
+	YUV400  // Y only, grayscale
 } colorspace_t;
 
+// MCU size of a colorspace: 4:2:0 - 16x16, 4:2:2 - 16x8, Y only - 8x8
+#define JPEG_MCU_WIDTH(cs)	((cs) == YUV400 ? 8 : 16)
+#define JPEG_MCU_HEIGHT(cs)	((cs) == YUV420 ? 16 : 8)
+
+// Statistics of the blocks of one component, counted by huffman_encode.
+typedef struct huffman_counts_s
+{
+	unsigned bits;    // written, byte stuffing included
+	unsigned nonzero; // non-zero coefficients, DC included
+	unsigned eob;     // blocks ended by EOB
+	unsigned zrl;     // ZRL codes (runs of 16 zeros)
+}
+huffman_counts_t;
+
 typedef struct huffman_s
 {
-	const unsigned char  (*haclen)[11];
-	const unsigned short (*hacbit)[11];
-	const unsigned char  *hdclen;
-	const unsigned short *hdcbit;
-	const unsigned char  *qtable;
+	const unsigned       *aclut;  // (length << 16) | code, indexed by (run << 4) | size
+	const unsigned       *dclut;  // (length << 16) | code, indexed by size
+	unsigned             *acfreq; // symbol statistics for optimized tables, 0 - not gathered
+	unsigned             *dcfreq;
+	huffman_counts_t     *counts; // 0 - not counted
+	const dct_qtable_t   *qtable;
 	short                dc;
 }
 huffman_t;
 
-extern huffman_t huffman_ctx[3];
+typedef struct bitbuffer_s
+{
+	unsigned long buf; // buffer
+	unsigned      n;   // number of bits in it
+	unsigned char *out; // next byte of output code-stream
+}
+bitbuffer_t;
+
+// Output sink, gets every output buffer once it is full and returns the
+// next one, so the code-stream can be written straight into packets.
+// buf is 0 on the first call of a frame. last is 1 for the final, partly
+// filled buffer of the frame and -1 if the frame is abandoned (buf, if not
+// 0, is given back unsent), the return value is ignored then. Returns 0 if
+// there is no buffer to give, the frame overflows.
+typedef unsigned char *(*huffman_sink_t)(void *arg, unsigned char *buf, unsigned size, int last, unsigned *next_size);
 
-#define	HUFFMAN_CTX_Y	&huffman_ctx[0]
-#define	HUFFMAN_CTX_Cb	&huffman_ctx[1]
-#define	HUFFMAN_CTX_Cr	&huffman_ctx[2]
+// Worst case size of one encoded 8x8 block: 11+11 bits of DC,
+// 63*(16+10) bits of AC and every byte followed by a stuffed 0x00.
+#define HUFFMAN_BLOCK_BYTES_MAX	416
+#define HUFFMAN_MCU_BLOCKS_MAX	6
+
+// SOI, APP0, DQT, SOF0, DHT, DRI and SOS
+#define JPEG_HEADER_SIZE_MAX	613
+
+// Starts a stripe of a partial frame (conditional replenishment), followed
+// by the 16-bit index of the restart interval the stripe replaces. JPG0,
+// reserved for JPEG extensions, so no decoder mistakes it for its own.
+#define JPEG_MARKER_STRIPE		0xFFF0
+
+// Quality factor range of quantization tables, IJG scale.
+#define JPEG_QUALITY_MIN		1
+#define JPEG_QUALITY_MAX		100
+#define JPEG_QUALITY_DEFAULT	75
+
+// Encoder context, holds all state of one code-stream being encoded.
+// Every encoding task should own its context, so several frames
+// can be encoded at the same time (e.g. one per core).
+typedef struct jpeg_encoder_ctx_s
+{
+	huffman_t     huffman[3]; // Y, Cb, Cr
+	unsigned      huff_dc[2][16];  // packed Huffman codes (lum, chrom), see huffman_t
+	unsigned      huff_ac[2][256];
+	unsigned char dht_bits[4][16];  // DHT specification: DC lum, AC lum, DC chrom, AC chrom
+	unsigned char dht_vals[4][162];
+	unsigned      huff_freq[4][257]; // symbol statistics, same order, [256] is scratch
+	unsigned char huff_codesize[257]; // scratch for huffman_tables_optimize
+	short         huff_others[257];
+	unsigned      huff_opt_period; // optimized tables: frames per table update, 0 - standard tables
+	unsigned      huff_opt_frames; // frames encoded since the last update
+	void          *stats;          // jpeg_stats_t of jpeg.c, 0 - no statistics
+	void          *replenish;      // jpeg_replenish_t of jpeg.c, 0 - every frame is complete
+	bitbuffer_t   bitbuf;     // bit-buffer, writes straight into the output buffer
+	unsigned char *out_start; // output code-stream buffer, given by the application
+	unsigned char *out_end;   // end of output buffer
+	unsigned char *spill_dst; // where spill[] goes when an MCU is encoded into it, 0 - not spilled
+	huffman_sink_t sink;      // takes full output buffers, 0 - the output buffer is all there is
+	void          *sink_arg;
+	unsigned      out_flushed; // bytes of this frame handed to the sink
+	int           overflow;   // code-stream did not fit into output buffer
+	colorspace_t  colorspace;    // output sampling, YUV420, YUV422 or YUV400
+	unsigned      restart_rows;  // MCU rows per restart interval, 0 - no restart markers
+	unsigned      restart_count; // restart markers written, RSTn index is its 3 lower bits
+	const unsigned char *roi_map; // quality level of every MCU, used by jpeg.c, 0 - whole frame at quality
+	unsigned      roi_map_cols;   // MCUs per row of roi_map
+	unsigned      roi_map_rows;
+	int           quality;       // quality factor the tables below were built for
+	unsigned char qtable_0[2][64]; // quantization tables (lum, chrom), written into DQT
+	dct_qtable_t  qtable[2];       // reciprocals of qtable_0[] for dct_quantize
+	unsigned short header_size;     // cached headers, 0 - must be rebuilt
+	unsigned short header_sof;      // offset of image height and width in header[]
+	unsigned      header_interval;  // restart interval (MCUs) written into cached DRI
+	unsigned char header[JPEG_HEADER_SIZE_MAX]; // SOI..SOS template, copied into every frame
+	int           rc_quality_max; // rate control: quality set by the application
+	unsigned      rc_target_size; // rate control: code-stream size to aim for, 0 - fixed quality
+	unsigned char spill[HUFFMAN_MCU_BLOCKS_MAX * HUFFMAN_BLOCK_BYTES_MAX + 2]; // MCU buffer for the end of output
+}
+jpeg_encoder_ctx_t;
+
+#define	HUFFMAN_CTX_Y(ctx)	(&(ctx)->huffman[0])
+#define	HUFFMAN_CTX_Cb(ctx)	(&(ctx)->huffman[1])
+#define	HUFFMAN_CTX_Cr(ctx)	(&(ctx)->huffman[2])
 
 #define JPEG_PIX_BLOCK_SIZE		16
 
-void huffman_start(short height, short width);
-void huffman_stop(void);
-void huffman_encode(huffman_t *const ctx, const short data[64]);
+void jpeg_encoder_ctx_init(jpeg_encoder_ctx_t *const ctx);
+void jpeg_encoder_ctx_share_tables(jpeg_encoder_ctx_t *const ctx, const jpeg_encoder_ctx_t *const src);
+void jpeg_encoder_set_quality(jpeg_encoder_ctx_t *const ctx, int quality);
+void jpeg_encoder_set_colorspace(jpeg_encoder_ctx_t *const ctx, const colorspace_t colorspace);
+
+void huffman_set_output(jpeg_encoder_ctx_t *const ctx, unsigned char *const buf, const unsigned size);
+unsigned huffman_output_size(const jpeg_encoder_ctx_t *const ctx);
+void huffman_set_sink(jpeg_encoder_ctx_t *const ctx, const huffman_sink_t sink, void *const arg);
+void huffman_output_flush(jpeg_encoder_ctx_t *const ctx);
+void huffman_start(jpeg_encoder_ctx_t *const ctx, short height, short width);
+void huffman_tables_default(jpeg_encoder_ctx_t *const ctx);
+void huffman_stats_enable(jpeg_encoder_ctx_t *const ctx, const int enable);
+void huffman_tables_optimize(jpeg_encoder_ctx_t *const ctx);
+const unsigned char *huffman_header(const jpeg_encoder_ctx_t *const ctx, unsigned *const size);
+void huffman_stop(jpeg_encoder_ctx_t *const ctx);
+void huffman_restart(jpeg_encoder_ctx_t *const ctx);
+void huffman_segment_begin(jpeg_encoder_ctx_t *const ctx, unsigned restart_count);
+void huffman_segment_end(jpeg_encoder_ctx_t *const ctx);
+void huffman_stripe_begin(jpeg_encoder_ctx_t *const ctx, const unsigned stripe);
+void huffman_mcu_begin(jpeg_encoder_ctx_t *const ctx, const unsigned blocks);
+void huffman_mcu_end(jpeg_encoder_ctx_t *const ctx);
+void huffman_encode(jpeg_encoder_ctx_t *const ctx, huffman_t *const hctx, const short data[64], const unsigned last);
 
 #ifdef __cplusplus
 }
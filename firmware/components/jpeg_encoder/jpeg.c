@@ -1,5 +1,8 @@
 #include "jpeg.h"
 
+#include <string.h>
+#include <stdbool.h>
+
 #include "esp_err.h"
 #include "esp_log.h"
 
@@ -8,218 +11,1436 @@
 
 static const char * TAG = "JPEG";
 
+//rate control: quality is stepped down by 1 + JPEG_RC_GAIN per unit of relative overshoot over the target size,
+//and stepped up by one only once frames are JPEG_RC_HEADROOM_DIV-th below it, so it doesn't oscillate frame to frame
+#define JPEG_RC_GAIN			20
+#define JPEG_RC_STEP_MAX		10
+#define JPEG_RC_HEADROOM_DIV	8
+#define JPEG_RC_QUALITY_MIN		10
+#define JPEG_RC_RETRIES_MAX		3 //re-encodes of a frame that didn't fit into the output buffer
+
+//per-stage timing, active while statistics are attached to the context (jpeg_set_stats)
+#include "xtensa/hal.h"
+#define JPEG_STATS(ctx)	((jpeg_stats_t *)(ctx)->stats)
+//adds ticks since mark to stage and moves mark to now
+#define JPEG_STATS_STAGE(ctx, stage, mark) do { if ((ctx)->stats != NULL) { uint32_t now = xthal_get_ccount(); JPEG_STATS(ctx)->ticks[stage] += now - (mark); (mark) = now; } } while (0)
+#define JPEG_STATS_MARK(ctx, mark) do { if ((ctx)->stats != NULL) { (mark) = xthal_get_ccount(); } } while (0)
+#define JPEG_STATS_MCU(ctx, mark) do { if ((ctx)->stats != NULL) { (mark) = xthal_get_ccount(); JPEG_STATS(ctx)->mcus ++; } } while (0)
+
 static void bitstream_2d_convert(uint32_t total_len, uint32_t height, uint8_t * bitstream, uint8_t ** bitstream_2d);
-static void yuv422_get_Y_pix_block(uint32_t pix_origin_row, uint32_t pix_origin_col, uint8_t block_len_row, uint8_t block_len_col, uint8_t ** bitstream_2d_in, short * output_buf);
-void YUV422_get_Cr_pix_block(uint32_t pix_origin_row, uint32_t pix_origin_col, uint8_t pix_block_len_row, uint8_t pix_block_len_col, uint8_t ** bitstream_2d_in, short * output_buf);
-void YUV422_get_Cb_pix_block(uint32_t pix_origin_row, uint32_t pix_origin_col, uint8_t pix_block_len_row, uint8_t pix_block_len_col, uint8_t ** bitstream_2d_in, short * output_buf);
 
+//MCUs of mcu_size pixels needed to cover pix pixels, the last one is padded by replicating edge pixels
+#define JPEG_MCU_COUNT(pix, mcu_size)	(((pix) + (mcu_size) - 1) / (mcu_size))
+
+//frame geometry of an encode (m_jpeg_ctrl) and colorspace of a context. Built for one frame they are constants, so loop
+//bounds and strides are known at compile time, the MCU loader is picked statically and the edge paths of frames that are
+//a whole number of MCUs drop out
+#if CONFIG_JPEG_FIXED_FRAME
+#define JPEG_FRAME_WIDTH(jpeg)			JPEG_FIXED_WIDTH
+#define JPEG_FRAME_HEIGHT(jpeg)			JPEG_FIXED_HEIGHT
+#define JPEG_FRAME_BYTE_PER_PIX(jpeg)	2
+#define JPEG_FRAME_MCU_WIDTH(jpeg)		JPEG_MCU_WIDTH(JPEG_FIXED_COLORSPACE)
+#define JPEG_FRAME_MCU_HEIGHT(jpeg)		JPEG_MCU_HEIGHT(JPEG_FIXED_COLORSPACE)
+#define JPEG_FRAME_COLORSPACE(ctx)		JPEG_FIXED_COLORSPACE
+#else
+#define JPEG_FRAME_WIDTH(jpeg)			((jpeg)->frame_pix_width)
+#define JPEG_FRAME_HEIGHT(jpeg)			((jpeg)->frame_pix_height)
+#define JPEG_FRAME_BYTE_PER_PIX(jpeg)	((jpeg)->frame_byte_per_pix)
+#define JPEG_FRAME_MCU_WIDTH(jpeg)		((jpeg)->mcu_width)
+#define JPEG_FRAME_MCU_HEIGHT(jpeg)		((jpeg)->mcu_height)
+#define JPEG_FRAME_COLORSPACE(ctx)		((ctx)->colorspace)
+#endif
+
+//ROI levels: AC coefficients (quantized, zig-zag order) past last_ac are dropped and the others requantized with 1 << shift
+//times the step of the table, so they stay on the grid the decoder dequantizes with. DC is kept as it is, MCUs of different
+//levels don't differ in brightness
+typedef struct
+{
+	uint8_t shift;
+	uint8_t last_ac;
+} jpeg_roi_level_t;
+
+static const jpeg_roi_level_t jpeg_roi_levels[JPEG_ROI_LEVELS] = {{0, 63}, {1, 27}, {2, 14}, {3, 5}};
+
+//loads an MCU lying entirely inside the frame into the Y, Cb and Cr blocks used by the colorspace
+typedef void (*jpeg_load_mcu_t)(uint8_t ** input_buf_2d, uint32_t pix_row, uint32_t byte_col, short Y_8x8[2][2][8][8], short Cb_8x8[8][8], short Cr_8x8[8][8]);
+
+//per-encode control data, lives on the stack of the encoding task
 typedef struct
 {
 	jpeg_t * jpeg_out;
 	uint32_t frame_pix_width;
 	uint32_t frame_pix_height;
 	uint32_t frame_byte_per_pix;
+	uint32_t mcu_width;
+	uint32_t mcu_height;
+	uint8_t * luma_map; //NULL - not produced
+	uint32_t luma_map_width;
+	const uint8_t * roi_map; //NULL - whole frame at quality
+	uint32_t roi_map_cols;
 	volatile esp_err_t status;
 } m_jpeg_ctrl;
 
-static m_jpeg_ctrl jpeg;
+static esp_err_t jpeg_check_args(jpeg_encoder_ctx_t * ctx, uint8_t * input_buf, uint32_t input_buf_size, uint32_t frame_width, uint32_t frame_height, jpeg_t * output);
+static void jpeg_ctrl_init(jpeg_encoder_ctx_t * ctx, m_jpeg_ctrl * jpeg, uint32_t input_buf_size, uint32_t frame_width, uint32_t frame_height, jpeg_t * output);
+static void jpeg_luma_map_attach(m_jpeg_ctrl * jpeg, jpeg_t * output);
+static inline void jpeg_luma_map_set(jpeg_encoder_ctx_t * ctx, m_jpeg_ctrl * jpeg, uint32_t pix_row, uint32_t pix_col, short dc);
+static esp_err_t jpeg_output_begin(jpeg_encoder_ctx_t * ctx, m_jpeg_ctrl * jpeg, jpeg_t * output, bool keyframe);
+static esp_err_t jpeg_output_overflow(jpeg_encoder_ctx_t * ctx, m_jpeg_ctrl * jpeg);
+static uint32_t jpeg_stripe_count(jpeg_encoder_ctx_t * ctx, uint32_t frame_height);
+static esp_err_t jpeg_encode_frame(jpeg_encoder_ctx_t * ctx, uint8_t * input_buf, uint32_t input_buf_size, uint32_t frame_width, uint32_t frame_height, jpeg_t * output);
+static esp_err_t jpeg_encode_fit(jpeg_encoder_ctx_t * ctx, uint8_t * input_buf, uint32_t input_buf_size, uint32_t frame_width, uint32_t frame_height, jpeg_t * output);
+static void jpeg_rate_control_update(jpeg_encoder_ctx_t * ctx, uint32_t frame_size);
+static bool jpeg_rate_control_overflow(jpeg_encoder_ctx_t * ctx);
+static void jpeg_huffman_update(jpeg_encoder_ctx_t * ctx);
+static bool jpeg_replenish_keyframe(jpeg_encoder_ctx_t * ctx, m_jpeg_ctrl * jpeg);
+static bool jpeg_replenish_stripe(jpeg_replenish_t * replenish, m_jpeg_ctrl * jpeg, uint8_t ** input_buf_2d, uint32_t mcu_row_start, uint32_t mcu_row_end, bool keyframe);
+static void jpeg_replenish_luma_map(jpeg_replenish_t * replenish, m_jpeg_ctrl * jpeg, uint32_t mcu_row_start, uint32_t mcu_row_end);
+static uint32_t jpeg_block_signature(m_jpeg_ctrl * jpeg, uint8_t ** input_buf_2d, uint32_t pix_row, uint32_t pix_col);
+static bool jpeg_signature_changed(uint32_t sig_1, uint32_t sig_2, uint32_t threshold);
+static esp_err_t jpeg_encode_mcu_rows(jpeg_encoder_ctx_t * ctx, m_jpeg_ctrl * jpeg, uint8_t ** input_buf_2d, uint32_t mcu_row_start, uint32_t mcu_row_end);
+static void yuv422_load_mcu(uint8_t ** input_buf_2d, uint32_t pix_row, uint32_t byte_col, short Y_8x8[2][2][8][8], short Cb_8x8[8][8], short Cr_8x8[8][8]);
+static void yuv422_load_mcu_h2v1(uint8_t ** input_buf_2d, uint32_t pix_row, uint32_t byte_col, short Y_8x8[2][2][8][8], short Cb_8x8[8][8], short Cr_8x8[8][8]);
+static void yuv422_load_mcu_y(uint8_t ** input_buf_2d, uint32_t pix_row, uint32_t byte_col, short Y_8x8[2][2][8][8], short Cb_8x8[8][8], short Cr_8x8[8][8]);
+static void yuv422_load_mcu_edge(m_jpeg_ctrl * jpeg, uint8_t ** input_buf_2d, uint32_t pix_row, uint32_t pix_col, short Y_8x8[2][2][8][8], short Cb_8x8[8][8], short Cr_8x8[8][8]);
+static inline short jpeg_encode_block(jpeg_encoder_ctx_t * ctx, huffman_t * hctx, short pixels[8][8], const jpeg_roi_level_t * roi, uint32_t * stats_mark);
+static void jpeg_stats_begin(jpeg_encoder_ctx_t * ctx);
+static void jpeg_stats_attempt(jpeg_encoder_ctx_t * ctx);
+static void jpeg_stats_end(jpeg_encoder_ctx_t * ctx, esp_err_t status, uint32_t size);
+static void jpeg_stats_merge(jpeg_encoder_ctx_t * ctx, jpeg_stripe_job_t * job);
+static unsigned jpeg_roi_requantize(short coefs[64], unsigned last, const jpeg_roi_level_t * roi);
 
-//uint32_t jpeg_encode(uint8_t * input_buf, uint32_t input_buf_size, uint8_t * jpeg_buf, uint32_t jpeg_buf_size, uint32_t frame_width, uint32_t frame_height)
-esp_err_t jpeg_encode(uint8_t * input_buf, uint32_t input_buf_size, uint32_t frame_width, uint32_t frame_height, jpeg_t * output)
+esp_err_t jpeg_set_restart_interval(jpeg_encoder_ctx_t * ctx, uint32_t mcu_rows)
 {
-	if (input_buf == NULL || output == NULL)
+	if (ctx == NULL)
 	{
-		ESP_LOGE(TAG, "Null frame buffers for JPEG encode.");
 		return ESP_ERR_INVALID_ARG;
 	}
 
-	if (output->buf_max_size == 0 || input_buf_size == 0 || frame_width == 0 || frame_height == 0)
+	ctx->restart_rows = mcu_rows;
+	return ESP_OK;
+}
+
+esp_err_t jpeg_set_quality(jpeg_encoder_ctx_t * ctx, int quality)
+{
+	if (ctx == NULL || quality < JPEG_QUALITY_MIN || quality > JPEG_QUALITY_MAX)
 	{
-		ESP_LOGE(TAG, "Implausible image buffer size of frame dimensions.");
 		return ESP_ERR_INVALID_ARG;
 	}
 
-	jpeg.frame_pix_height = frame_height;
-	jpeg.frame_pix_width = frame_width;
-	jpeg.jpeg_out = output;
-	jpeg.jpeg_out->buf_written_size = 0;
-	jpeg.frame_byte_per_pix = input_buf_size/frame_height/frame_width;
-	jpeg.status = ESP_OK;
+	ctx->rc_quality_max = quality;
+	jpeg_encoder_set_quality(ctx, quality);
+	return ESP_OK;
+}
 
-	short Y_8x8 [2][2][8][8];
+esp_err_t jpeg_set_colorspace(jpeg_encoder_ctx_t * ctx, colorspace_t colorspace)
+{
+	if (ctx == NULL)
+	{
+		return ESP_ERR_INVALID_ARG;
+	}
 
-	uint8_t * input_buf_2d[frame_height];
+	if (colorspace != YUV420 && colorspace != YUV422 && colorspace != YUV400)
+	{
+		return ESP_ERR_NOT_SUPPORTED; //4:4:4 would need chroma the YUYV input doesn't have
+	}
 
-	bitstream_2d_convert(input_buf_size, jpeg.frame_pix_height, input_buf, input_buf_2d);
+#if CONFIG_JPEG_FIXED_FRAME
+	if (colorspace != JPEG_FIXED_COLORSPACE)
+	{
+		return ESP_ERR_NOT_SUPPORTED;
+	}
+#endif
 
-	huffman_start(jpeg.frame_pix_height & -JPEG_PIX_BLOCK_SIZE, jpeg.frame_pix_width & -JPEG_PIX_BLOCK_SIZE);
+	jpeg_encoder_set_colorspace(ctx, colorspace);
+	return ESP_OK;
+}
 
-	for (uint32_t pix_position_row = 0; pix_position_row < jpeg.frame_pix_height - (JPEG_PIX_BLOCK_SIZE - 1); pix_position_row += JPEG_PIX_BLOCK_SIZE)
-	for (uint32_t pix_position_col = 0; pix_position_col < jpeg.frame_pix_width - (JPEG_PIX_BLOCK_SIZE - 1); pix_position_col += JPEG_PIX_BLOCK_SIZE)
+esp_err_t jpeg_set_roi_map(jpeg_encoder_ctx_t * ctx, const uint8_t * map, uint32_t mcu_cols, uint32_t mcu_rows)
+{
+	if (ctx == NULL || (map != NULL && (mcu_cols == 0 || mcu_rows == 0)))
 	{
-		for (uint32_t block_row = 0; block_row < 2; block_row ++)
-			for (uint32_t block_col = 0; block_col < 2; block_col ++)
-			{
-				yuv422_get_Y_pix_block(pix_position_row + block_row*8, pix_position_col + block_col*8, 8, 8, input_buf_2d, (short *) Y_8x8[block_row][block_col]);
-			}
+		return ESP_ERR_INVALID_ARG;
+	}
 
-			short Cr_8x8 [8][8];
-			YUV422_get_Cr_pix_block(pix_position_row, pix_position_col, 8, 8, input_buf_2d, (short*) Cr_8x8);
-
-			short Cb_8x8 [8][8];
-			YUV422_get_Cb_pix_block(pix_position_row, pix_position_col, 8, 8, input_buf_2d, (short*) Cb_8x8);
-
-			// 1 Y-compression
-			dct(Y_8x8[0][0], Y_8x8[0][0]);
-			huffman_encode(HUFFMAN_CTX_Y, (short*)Y_8x8[0][0]);
-			// 2 Y-compression
-			dct(Y_8x8[0][1], Y_8x8[0][1]);
-			huffman_encode(HUFFMAN_CTX_Y, (short*)Y_8x8[0][1]);
-			// 3 Y-compression
-			dct(Y_8x8[1][0], Y_8x8[1][0]);
-			huffman_encode(HUFFMAN_CTX_Y, (short*)Y_8x8[1][0]);
-			// 4 Y-compression
-			dct(Y_8x8[1][1], Y_8x8[1][1]);
-			huffman_encode(HUFFMAN_CTX_Y, (short*)Y_8x8[1][1]);
-			// Cb-compression
-			dct(Cb_8x8, Cb_8x8);
-			huffman_encode(HUFFMAN_CTX_Cb, (short*)Cb_8x8);
-			// Cr-compression
-			dct(Cr_8x8, Cr_8x8);
-			huffman_encode(HUFFMAN_CTX_Cr, (short*)Cr_8x8);
-
-			if (jpeg.status != ESP_OK)
-			{
-				ESP_LOGE (TAG, "JPEG frame buffer too small, unable to fit entire JPEG frame.");
-				jpeg.jpeg_out->buf_written_size = 0;
-				return jpeg.status;
-			}
+	ctx->roi_map = map;
+	ctx->roi_map_cols = (map != NULL) ? mcu_cols : 0;
+	ctx->roi_map_rows = (map != NULL) ? mcu_rows : 0;
+	return ESP_OK;
+}
+
+int jpeg_get_quality(jpeg_encoder_ctx_t * ctx)
+{
+	return (ctx != NULL) ? ctx->quality : 0;
+}
+
+esp_err_t jpeg_set_target_size(jpeg_encoder_ctx_t * ctx, uint32_t target_size)
+{
+	if (ctx == NULL)
+	{
+		return ESP_ERR_INVALID_ARG;
 	}
 
-	huffman_stop();
+	ctx->rc_target_size = target_size;
+	if (target_size == 0)
+	{
+		jpeg_encoder_set_quality(ctx, ctx->rc_quality_max); //back to fixed quality
+	}
+	return ESP_OK;
+}
 
-	if (jpeg.status != ESP_OK)
+esp_err_t jpeg_set_stats(jpeg_encoder_ctx_t * ctx, jpeg_stats_t * stats)
+{
+	if (ctx == NULL)
 	{
-		ESP_LOGE (TAG, "JPEG frame buffer too small, unable to fit entire JPEG frame.");
-		jpeg.jpeg_out->buf_written_size = 0;
+		return ESP_ERR_INVALID_ARG;
 	}
 
-	return jpeg.status;
+	ctx->stats = stats;
+	for (uint32_t i = 0; i < 3; i ++)
+	{
+		ctx->huffman[i].counts = (stats != NULL) ? &stats->component[i] : NULL;
+	}
+	return ESP_OK;
 }
 
-void write_jpeg(const unsigned char buff[], const unsigned size)
+esp_err_t jpeg_set_huffman_optimize(jpeg_encoder_ctx_t * ctx, uint32_t period_frames)
 {
-	if (jpeg.jpeg_out->buf_written_size + size > jpeg.jpeg_out->buf_max_size)
+	if (ctx == NULL)
 	{
-		jpeg.status = ESP_ERR_NO_MEM;
-		return;
+		return ESP_ERR_INVALID_ARG;
+	}
+
+	ctx->huff_opt_period = period_frames;
+	ctx->huff_opt_frames = 0;
+	huffman_stats_enable(ctx, period_frames != 0);
+	if (period_frames == 0)
+	{
+		huffman_tables_default(ctx);
+	}
+	return ESP_OK;
+}
+
+esp_err_t jpeg_set_replenish(jpeg_encoder_ctx_t * ctx, jpeg_replenish_t * replenish)
+{
+	if (ctx == NULL || (replenish != NULL && (replenish->sig == NULL || replenish->keyframe_period == 0)))
+	{
+		return ESP_ERR_INVALID_ARG;
 	}
 
-	uint8_t *write_buf = jpeg.jpeg_out->buf + jpeg.jpeg_out->buf_written_size; //&jpeg.jpeg_buf[jpeg.jpeg_bytes_written];
-	for (uint32_t i = 0; i < size; i ++)
+	if (replenish != NULL)
 	{
-		write_buf[i] = buff[i];
+		replenish->frames = 0;
+		replenish->frame_width = 0;
+		replenish->frame_height = 0;
+		replenish->restart_rows = 0;
+		replenish->keyframe = true;
+		replenish->keyframe_pending = true;
+		replenish->stripes = 0;
+		replenish->stripes_sent = 0;
 	}
 
-	jpeg.jpeg_out->buf_written_size += size;
+	ctx->replenish = replenish;
+	return ESP_OK;
 }
 
-/* private functions */
-static void bitstream_2d_convert(uint32_t total_len, uint32_t height, uint8_t * bitstream, uint8_t ** bitstream_2d)
+esp_err_t jpeg_set_output_sink(jpeg_encoder_ctx_t * ctx, huffman_sink_t sink, void * arg)
 {
-	//converts to 2d_bitstream[row][col]
-	uint32_t width = total_len/height;
+	if (ctx == NULL)
+	{
+		return ESP_ERR_INVALID_ARG;
+	}
 
-	for (uint32_t row = 0; row < height; row ++)
-		bitstream_2d[row] = &bitstream[row*width];
+	huffman_set_sink(ctx, sink, arg);
+	return ESP_OK;
+}
+
+//uint32_t jpeg_encode(uint8_t * input_buf, uint32_t input_buf_size, uint8_t * jpeg_buf, uint32_t jpeg_buf_size, uint32_t frame_width, uint32_t frame_height)
+esp_err_t jpeg_encode(jpeg_encoder_ctx_t * ctx, uint8_t * input_buf, uint32_t input_buf_size, uint32_t frame_width, uint32_t frame_height, jpeg_t * output)
+{
+	esp_err_t ret_val = jpeg_check_args(ctx, input_buf, input_buf_size, frame_width, frame_height, output);
+	if (ret_val != ESP_OK)
+	{
+		return ret_val;
+	}
+
+	jpeg_stats_begin(ctx);
+	return jpeg_encode_fit(ctx, input_buf, input_buf_size, frame_width, frame_height, output);
 }
 
-static void yuv422_get_Y_pix_block(uint32_t pix_origin_row, uint32_t pix_origin_col, uint8_t block_len_row, uint8_t block_len_col, uint8_t ** bitstream_2d_in, short * output_buf)
+//encodes a whole frame, args are already checked. Also finishes frames that overflowed in stream or stripe-parallel encode
+static esp_err_t jpeg_encode_fit(jpeg_encoder_ctx_t * ctx, uint8_t * input_buf, uint32_t input_buf_size, uint32_t frame_width, uint32_t frame_height, jpeg_t * output)
 {
+	esp_err_t ret_val = jpeg_encode_frame(ctx, input_buf, input_buf_size, frame_width, frame_height, output);
 
-	if(output_buf == NULL || bitstream_2d_in == NULL)
+	//rather than dropping a frame that doesn't fit, encode it again with coarser tables. What a sink was given is gone already
+	for (uint32_t retry = 0; ret_val == ESP_ERR_NO_MEM && ctx->sink == NULL && retry < JPEG_RC_RETRIES_MAX; retry ++)
 	{
-		ESP_LOGE(TAG, "Null input");
-		return;
+		if (!jpeg_rate_control_overflow(ctx))
+		{
+			break;
+		}
+
+		ESP_LOGW(TAG, "JPEG frame overflowed, re-encoding at quality %d.", ctx->quality);
+		ret_val = jpeg_encode_frame(ctx, input_buf, input_buf_size, frame_width, frame_height, output);
 	}
 
-	if (pix_origin_col + block_len_col > jpeg.frame_pix_width || pix_origin_row + block_len_row > jpeg.frame_pix_height)
+	if (ret_val == ESP_ERR_NO_MEM && ctx->sink != NULL)
 	{
-		ESP_LOGE(TAG, "YUV422 get y pix block exceeded frame bounds, col: %d row: %d\n", pix_origin_col, pix_origin_row);
-		return;
+		ESP_LOGE (TAG, "JPEG output sink ran out of buffers, frame is incomplete.");
+	}
+	else if (ret_val == ESP_ERR_NO_MEM)
+	{
+		ESP_LOGE (TAG, "JPEG frame buffer too small, unable to fit entire JPEG frame.");
+	}
+
+	jpeg_stats_end(ctx, ret_val, output->buf_written_size);
+
+	if (ret_val == ESP_OK && (ctx->replenish == NULL || ((jpeg_replenish_t *) ctx->replenish)->keyframe))
+	{
+		//partial frames are coded with the tables of their keyframe, quality and tables only change with keyframes
+		jpeg_rate_control_update(ctx, output->buf_written_size);
+		jpeg_huffman_update(ctx);
+	}
+
+	return ret_val;
+}
+
+esp_err_t jpeg_encode_parallel_begin(jpeg_encoder_ctx_t * ctx, jpeg_stripe_job_t * job, uint8_t * input_buf, uint32_t input_buf_size, uint32_t frame_width, uint32_t frame_height, jpeg_t * output, uint32_t num_parts)
+{
+	esp_err_t ret_val = jpeg_check_args(ctx, input_buf, input_buf_size, frame_width, frame_height, output);
+	if (ret_val != ESP_OK)
+	{
+		return ret_val;
+	}
+
+	if (job == NULL || num_parts == 0 || num_parts > JPEG_STRIPE_PARTS_MAX)
+	{
+		return ESP_ERR_INVALID_ARG;
+	}
+
+	if (ctx->sink != NULL || ctx->replenish != NULL)
+	{
+		return ESP_ERR_NOT_SUPPORTED; //parts are joined in the output buffer, and are always complete frames
+	}
+
+	job->owner = ctx;
+	job->input_buf = input_buf;
+	job->input_buf_size = input_buf_size;
+	job->frame_width = frame_width;
+	job->frame_height = frame_height;
+	job->output = output;
+	job->num_stripes = jpeg_stripe_count(ctx, frame_height);
+	job->num_parts = (num_parts < job->num_stripes) ? num_parts : job->num_stripes; //without restart markers the frame can't be split
+
+	jpeg_stats_begin(ctx);
+
+	//write headers, they are shared by all parts
+	uint32_t stats_mark = 0;
+	m_jpeg_ctrl jpeg;
+	jpeg_ctrl_init(ctx, &jpeg, input_buf_size, frame_width, frame_height, output);
+	huffman_set_output(ctx, output->buf, output->buf_max_size);
+	output->info.quality = ctx->quality;
+
+	JPEG_STATS_MARK(ctx, stats_mark);
+	huffman_start(ctx, JPEG_FRAME_HEIGHT(&jpeg), JPEG_FRAME_WIDTH(&jpeg));
+	huffman_segment_end(ctx);
+	JPEG_STATS_STAGE(ctx, JPEG_STAGE_OUTPUT, stats_mark);
+
+	output->buf_written_size = huffman_output_size(ctx);
+	if (ctx->overflow)
+	{
+		output->buf_written_size = 0;
+		jpeg_stats_end(ctx, ESP_ERR_NO_MEM, 0);
+		return ESP_ERR_NO_MEM;
+	}
+
+	//split the rest of the output buffer evenly, each part writes into its own region
+	uint32_t region_size = (output->buf_max_size - output->buf_written_size) / job->num_parts;
+
+	for (uint32_t part = 0; part < job->num_parts; part ++)
+	{
+		job->part_out[part].buf = output->buf + output->buf_written_size + part * region_size;
+		job->part_out[part].buf_max_size = region_size;
+		job->part_out[part].buf_written_size = 0;
+		job->part_out[part].luma_map = NULL;
+		job->part_out[part].luma_map_size = 0;
+		job->part_status[part] = ESP_ERR_INVALID_STATE; //not encoded yet
+		job->part_stats[part] = NULL;
+	}
+
+	return ESP_OK;
+}
+
+esp_err_t jpeg_encode_part(jpeg_encoder_ctx_t * ctx, jpeg_stripe_job_t * job, uint32_t part)
+{
+	if (ctx == NULL || job == NULL || part >= job->num_parts)
+	{
+		return ESP_ERR_INVALID_ARG;
+	}
+
+	jpeg_encoder_ctx_share_tables(ctx, job->owner);
+
+	if (ctx != job->owner)
+	{
+		jpeg_stats_begin(ctx); //the owner's cover the headers too
 	}
+	job->part_stats[part] = (ctx != job->owner) ? ctx->stats : NULL;
 
-	for (uint32_t row = 0; row < block_len_row; row++)
+	m_jpeg_ctrl jpeg;
+	jpeg_ctrl_init(ctx, &jpeg, job->input_buf_size, job->frame_width, job->frame_height, &job->part_out[part]);
+	jpeg_luma_map_attach(&jpeg, job->output); //parts fill their stripes of the frame's map
+	huffman_set_output(ctx, job->part_out[part].buf, job->part_out[part].buf_max_size);
+
+	uint8_t * input_buf_2d[JPEG_FRAME_HEIGHT(&jpeg)];
+
+	bitstream_2d_convert(job->input_buf_size, JPEG_FRAME_HEIGHT(&jpeg), job->input_buf, input_buf_2d);
+
+	uint32_t mcu_rows = JPEG_MCU_COUNT(JPEG_FRAME_HEIGHT(&jpeg), JPEG_FRAME_MCU_HEIGHT(&jpeg));
+	uint32_t stripe_rows = (ctx->restart_rows != 0) ? ctx->restart_rows : mcu_rows;
+	uint32_t stripe_start = part * job->num_stripes / job->num_parts;
+	uint32_t stripe_end = (part + 1) * job->num_stripes / job->num_parts;
+
+	huffman_segment_begin(ctx, stripe_start);
+
+	for (uint32_t stripe = stripe_start; stripe < stripe_end; stripe ++)
 	{
-		uint8_t * input_row_array = bitstream_2d_in[pix_origin_row + row] + jpeg.frame_byte_per_pix * pix_origin_col;
-		short * output_row_array = output_buf + row * block_len_col;
+		uint32_t mcu_row = stripe * stripe_rows;
+		uint32_t mcu_row_end = (mcu_row + stripe_rows < mcu_rows) ? mcu_row + stripe_rows : mcu_rows;
+
+		if (jpeg_encode_mcu_rows(ctx, &jpeg, input_buf_2d, mcu_row, mcu_row_end) != ESP_OK)
+		{
+			break;
+		}
 
-		for (uint32_t col = 0; col < block_len_col; col ++)
+		if (mcu_row_end != mcu_rows)
 		{
-			output_row_array[col] = input_row_array[2*col] - 128; //-128 to center the block about 0 for DCT
+			huffman_restart(ctx);
 		}
 	}
+
+	huffman_segment_end(ctx);
+
+	job->part_out[part].buf_written_size = huffman_output_size(ctx);
+	if (ctx->overflow)
+	{
+		jpeg.status = ESP_ERR_NO_MEM;
+		if (ctx->stats != NULL)
+		{
+			JPEG_STATS(ctx)->overflows ++;
+		}
+	}
+
+	job->part_status[part] = jpeg.status;
+	return jpeg.status;
 }
 
-//Note Cr is U Y0_U0_Y1_V0
-//expect to call for block len of 8x8
-void YUV422_get_Cr_pix_block(uint32_t pix_origin_row, uint32_t pix_origin_col, uint8_t pix_block_len_row, uint8_t pix_block_len_col, uint8_t ** bitstream_2d_in, short * output_buf)
+esp_err_t jpeg_encode_parallel_end(jpeg_encoder_ctx_t * ctx, jpeg_stripe_job_t * job)
 {
-	if (output_buf == NULL || bitstream_2d_in == NULL)
+	if (ctx == NULL || job == NULL || job->owner != ctx)
 	{
-		ESP_LOGE(TAG, "YUV422 get Cr pix block null buffer");
-		jpeg.status = ESP_ERR_INVALID_ARG;
-		return;
+		return ESP_ERR_INVALID_ARG;
 	}
-	if ((pix_origin_row + pix_block_len_row) > jpeg.frame_pix_height || (pix_origin_col + (pix_block_len_col << 1)) > jpeg.frame_pix_width)
+
+	jpeg_t * output = job->output;
+	uint32_t stats_mark = 0;
+
+	jpeg_stats_merge(ctx, job);
+
+	for (uint32_t part = 0; part < job->num_parts; part ++)
 	{
-		ESP_LOGE(TAG, "YUV422 get Cr pix block exceeded frame bounds");
-		jpeg.status = ESP_ERR_INVALID_ARG;
-		return;
+		if (job->part_status[part] == ESP_ERR_NO_MEM)
+		{
+			//one region overflowed, the frame may still fit when encoded in one piece
+			ESP_LOGW(TAG, "Part %d of the frame overflowed its region, re-encoding serially.", part);
+			return jpeg_encode_fit(ctx, job->input_buf, job->input_buf_size, job->frame_width, job->frame_height, output);
+		}
+		else if (job->part_status[part] != ESP_OK)
+		{
+			output->buf_written_size = 0;
+			jpeg_stats_end(ctx, job->part_status[part], 0);
+			return job->part_status[part];
+		}
 	}
 
-	for (uint32_t row = 0; row < pix_block_len_row; row ++)
+	//parts already end in the restart marker of the following stripe, close the gaps between the regions
+	JPEG_STATS_MARK(ctx, stats_mark);
+	for (uint32_t part = 0; part < job->num_parts; part ++)
 	{
-		uint8_t * input_row_array_1 = bitstream_2d_in[pix_origin_row + (row << 1)] + jpeg.frame_byte_per_pix * pix_origin_col; //select row + x axis offset
-		uint8_t * input_row_array_2 = bitstream_2d_in[pix_origin_row + (row << 1) + 1] + jpeg.frame_byte_per_pix * pix_origin_col; //select row + x axis offset
-		short * output_row_array = output_buf + row * pix_block_len_col;
-		// uint32_t output_offset = row * pix_block_len_col;
-		for (uint32_t col = 0; col < pix_block_len_col; col ++)
+		uint8_t * dst = output->buf + output->buf_written_size;
+		if (dst != job->part_out[part].buf)
 		{
-			short Cr_avg = (input_row_array_1[(col << 2)+3] + input_row_array_2[(col << 2)+3]) >> 1; //4*col + 3
-			output_row_array[col] = Cr_avg - 128; //-128 to center the block about 0 for DCT
+			memmove(dst, job->part_out[part].buf, job->part_out[part].buf_written_size);
 		}
+		output->buf_written_size += job->part_out[part].buf_written_size;
+	}
+
+	if (output->buf_written_size + 2 > output->buf_max_size)
+	{
+		ESP_LOGE (TAG, "JPEG frame buffer too small, unable to fit entire JPEG frame.");
+		output->buf_written_size = 0;
+		jpeg_stats_end(ctx, ESP_ERR_NO_MEM, 0);
+		return ESP_ERR_NO_MEM;
+	}
+
+	output->buf[output->buf_written_size ++] = 0xFF; // EOI - End of Image
+	output->buf[output->buf_written_size ++] = 0xD9;
+
+	JPEG_STATS_STAGE(ctx, JPEG_STAGE_OUTPUT, stats_mark);
+	jpeg_stats_end(ctx, ESP_OK, output->buf_written_size);
+
+	jpeg_rate_control_update(ctx, output->buf_written_size);
+	jpeg_huffman_update(ctx);
+
+	return ESP_OK;
+}
+
+esp_err_t jpeg_encode_stream_begin(jpeg_encoder_ctx_t * ctx, jpeg_stream_t * stream, uint8_t * input_buf, uint32_t input_buf_size, uint32_t frame_width, uint32_t frame_height, jpeg_t * output)
+{
+	esp_err_t ret_val = jpeg_check_args(ctx, input_buf, input_buf_size, frame_width, frame_height, output);
+	if (ret_val != ESP_OK)
+	{
+		return ret_val;
 	}
+
+	if (stream == NULL)
+	{
+		return ESP_ERR_INVALID_ARG;
+	}
+
+	if (ctx->replenish != NULL)
+	{
+		return ESP_ERR_NOT_SUPPORTED; //a stripe is only known to be unchanged once it is captured
+	}
+
+	stream->input_buf = input_buf;
+	stream->input_buf_size = input_buf_size;
+	stream->frame_width = frame_width;
+	stream->frame_height = frame_height;
+	stream->output = output;
+	stream->mcu_rows_done = 0;
+	stream->status = ESP_OK;
+
+	jpeg_stats_begin(ctx);
+
+	uint32_t stats_mark = 0;
+	m_jpeg_ctrl jpeg;
+	jpeg_ctrl_init(ctx, &jpeg, input_buf_size, frame_width, frame_height, output);
+	JPEG_STATS_MARK(ctx, stats_mark);
+	stream->status = jpeg_output_begin(ctx, &jpeg, output, true);
+	JPEG_STATS_STAGE(ctx, JPEG_STAGE_OUTPUT, stats_mark);
+
+	return stream->status;
 }
 
-//Note Cb is V Y0_U0_Y1_V0
-//expect to call for block len of 8x8
-void YUV422_get_Cb_pix_block(uint32_t pix_origin_row, uint32_t pix_origin_col, uint8_t pix_block_len_row, uint8_t pix_block_len_col, uint8_t ** bitstream_2d_in, short * output_buf)
+esp_err_t jpeg_encode_stream_rows(jpeg_encoder_ctx_t * ctx, jpeg_stream_t * stream, uint32_t lines_ready)
 {
-	if (output_buf == NULL || bitstream_2d_in == NULL)
+	if (ctx == NULL || stream == NULL)
 	{
-		ESP_LOGE(TAG, "YUV422 get Cb pix block null buffer");
-		jpeg.status = ESP_ERR_INVALID_ARG;
-		return;
+		return ESP_ERR_INVALID_ARG;
 	}
-	if ((pix_origin_row + pix_block_len_row) > jpeg.frame_pix_height || (pix_origin_col + (pix_block_len_col << 1)) > jpeg.frame_pix_width)
+
+	if (stream->status != ESP_OK)
 	{
-		ESP_LOGE(TAG, "YUV422 get Cb pix block exceeded frame bounds");
-		jpeg.status = ESP_ERR_INVALID_ARG;
-		return;
+		return stream->status; //keep going to the end, the frame is re-encoded there
+	}
+
+	m_jpeg_ctrl jpeg;
+	jpeg_ctrl_init(ctx, &jpeg, stream->input_buf_size, stream->frame_width, stream->frame_height, stream->output);
+
+	uint32_t mcu_rows = JPEG_MCU_COUNT(JPEG_FRAME_HEIGHT(&jpeg), JPEG_FRAME_MCU_HEIGHT(&jpeg));
+	uint32_t mcu_rows_ready = (lines_ready >= JPEG_FRAME_HEIGHT(&jpeg)) ? mcu_rows : lines_ready / JPEG_FRAME_MCU_HEIGHT(&jpeg);
+
+	if (mcu_rows_ready <= stream->mcu_rows_done)
+	{
+		return ESP_OK;
+	}
+
+	uint8_t * input_buf_2d[JPEG_FRAME_HEIGHT(&jpeg)];
+
+	bitstream_2d_convert(stream->input_buf_size, JPEG_FRAME_HEIGHT(&jpeg), stream->input_buf, input_buf_2d);
+
+	for (uint32_t mcu_row = stream->mcu_rows_done; mcu_row < mcu_rows_ready; mcu_row ++)
+	{
+		if (jpeg_encode_mcu_rows(ctx, &jpeg, input_buf_2d, mcu_row, mcu_row + 1) != ESP_OK)
+		{
+			break;
+		}
+
+		//same segments as jpeg_encode_frame()
+		if (ctx->restart_rows != 0 && (mcu_row + 1) % ctx->restart_rows == 0 && mcu_row + 1 != mcu_rows)
+		{
+			huffman_restart(ctx);
+		}
+	}
+
+	stream->mcu_rows_done = mcu_rows_ready;
+	stream->status = jpeg.status;
+	return stream->status;
+}
+
+esp_err_t jpeg_encode_stream_end(jpeg_encoder_ctx_t * ctx, jpeg_stream_t * stream)
+{
+	esp_err_t ret_val = jpeg_encode_stream_rows(ctx, stream, (stream != NULL) ? stream->frame_height : 0);
+	if (ret_val == ESP_ERR_INVALID_ARG)
+	{
+		return ret_val;
 	}
 
-	for (uint32_t row = 0; row < pix_block_len_row; row ++)
+	jpeg_t * output = stream->output;
+	uint32_t stats_mark = 0;
+
+	JPEG_STATS_MARK(ctx, stats_mark);
+	if (ret_val == ESP_OK)
 	{
-		uint8_t * input_row_array_1 = bitstream_2d_in[pix_origin_row + (row << 1)] + jpeg.frame_byte_per_pix * pix_origin_col; //select row + x axis offset
-		uint8_t * input_row_array_2 = bitstream_2d_in[pix_origin_row + (row << 1) + 1] + jpeg.frame_byte_per_pix * pix_origin_col; //select row + x axis offset
-		short * output_row_array = output_buf + row * pix_block_len_col;
-		// uint32_t output_offset = row * pix_block_len_col;
-		for (uint32_t col = 0; col < pix_block_len_col; col ++)
+		huffman_stop(ctx);
+
+		output->buf_written_size = huffman_output_size(ctx);
+		if (ctx->overflow)
 		{
-			short Cb_avg = (input_row_array_1[(col << 2)+1] + input_row_array_2[(col << 2)+1]) >> 1; //4*col + 1
-			output_row_array[col] = Cb_avg - 128; //-128 to center the block about 0 for DCT
+			ret_val = ESP_ERR_NO_MEM;
 		}
 	}
 
+	huffman_output_flush(ctx);
+	JPEG_STATS_STAGE(ctx, JPEG_STAGE_OUTPUT, stats_mark);
+
+	if (ret_val == ESP_ERR_NO_MEM && ctx->stats != NULL)
+	{
+		JPEG_STATS(ctx)->overflows ++;
+	}
+
+	if (ret_val == ESP_ERR_NO_MEM && ctx->sink == NULL)
+	{
+		//the frame is complete now, it may fit at lower quality
+		return jpeg_encode_fit(ctx, stream->input_buf, stream->input_buf_size, stream->frame_width, stream->frame_height, output);
+	}
+	else if (ret_val != ESP_OK)
+	{
+		output->buf_written_size = 0;
+		jpeg_stats_end(ctx, ret_val, 0);
+		return ret_val;
+	}
+
+	jpeg_stats_end(ctx, ESP_OK, output->buf_written_size);
+
+	jpeg_rate_control_update(ctx, output->buf_written_size);
+	jpeg_huffman_update(ctx);
+
+	return ESP_OK;
+}
+
+esp_err_t jpeg_encode_stream_abort(jpeg_encoder_ctx_t * ctx, jpeg_stream_t * stream)
+{
+	if (ctx == NULL || stream == NULL)
+	{
+		return ESP_ERR_INVALID_ARG;
+	}
+
+	ctx->overflow = 1; //the code-stream is incomplete
+	huffman_output_flush(ctx);
+
+	stream->output->buf_written_size = 0;
+	stream->status = ESP_ERR_INVALID_STATE;
+	return ESP_OK;
+}
+
+/* private functions */
+static esp_err_t jpeg_check_args(jpeg_encoder_ctx_t * ctx, uint8_t * input_buf, uint32_t input_buf_size, uint32_t frame_width, uint32_t frame_height, jpeg_t * output)
+{
+	if (ctx == NULL || input_buf == NULL || output == NULL)
+	{
+		ESP_LOGE(TAG, "Null frame buffers for JPEG encode.");
+		return ESP_ERR_INVALID_ARG;
+	}
+
+	if ((output->buf_max_size == 0 && ctx->sink == NULL) || input_buf_size == 0 || frame_width == 0 || frame_height == 0)
+	{
+		ESP_LOGE(TAG, "Implausible image buffer size of frame dimensions.");
+		return ESP_ERR_INVALID_ARG;
+	}
+
+	if (input_buf_size / frame_height / frame_width < 2)
+	{
+		ESP_LOGE(TAG, "Input buffer too small for a YUV422 frame of %dx%d.", frame_width, frame_height);
+		return ESP_ERR_INVALID_ARG;
+	}
+
+#if CONFIG_JPEG_FIXED_FRAME
+	if (frame_width != JPEG_FIXED_WIDTH || frame_height != JPEG_FIXED_HEIGHT || input_buf_size != JPEG_FIXED_WIDTH * JPEG_FIXED_HEIGHT * 2
+			|| ctx->colorspace != JPEG_FIXED_COLORSPACE)
+	{
+		ESP_LOGE(TAG, "Encoder built for %dx%d frames only.", JPEG_FIXED_WIDTH, JPEG_FIXED_HEIGHT);
+		return ESP_ERR_NOT_SUPPORTED;
+	}
+#endif
+
+	return ESP_OK;
+}
+
+static void jpeg_ctrl_init(jpeg_encoder_ctx_t * ctx, m_jpeg_ctrl * jpeg, uint32_t input_buf_size, uint32_t frame_width, uint32_t frame_height, jpeg_t * output)
+{
+	jpeg->mcu_width = JPEG_MCU_WIDTH(ctx->colorspace);
+	jpeg->mcu_height = JPEG_MCU_HEIGHT(ctx->colorspace);
+	jpeg->frame_pix_height = frame_height;
+	jpeg->frame_pix_width = frame_width;
+	jpeg->jpeg_out = output;
+	jpeg->jpeg_out->buf_written_size = 0;
+#if CONFIG_JPEG_FIXED_FRAME
+	jpeg->frame_byte_per_pix = 2;
+#else
+	jpeg->frame_byte_per_pix = input_buf_size/frame_height/frame_width;
+#endif
+	jpeg->status = ESP_OK;
+	jpeg_luma_map_attach(jpeg, output);
+
+	//a map made for another frame size or colorspace doesn't apply
+	bool roi_fits = ctx->roi_map_cols == JPEG_MCU_COUNT(frame_width, JPEG_FRAME_MCU_WIDTH(jpeg)) && ctx->roi_map_rows == JPEG_MCU_COUNT(frame_height, JPEG_FRAME_MCU_HEIGHT(jpeg));
+	jpeg->roi_map = roi_fits ? ctx->roi_map : NULL;
+	jpeg->roi_map_cols = ctx->roi_map_cols;
+}
+
+static void jpeg_luma_map_attach(m_jpeg_ctrl * jpeg, jpeg_t * output)
+{
+	bool fits = output->luma_map != NULL && output->luma_map_size >= JPEG_LUMA_MAP_SIZE(JPEG_FRAME_WIDTH(jpeg), JPEG_FRAME_HEIGHT(jpeg));
+
+	jpeg->luma_map = fits ? output->luma_map : NULL;
+	jpeg->luma_map_width = JPEG_MCU_COUNT(JPEG_FRAME_WIDTH(jpeg), 8);
+}
+
+//the DC coefficient of a Y block is 8 times its mean level shifted by 128, divided by the DC quantizer
+static inline void jpeg_luma_map_set(jpeg_encoder_ctx_t * ctx, m_jpeg_ctrl * jpeg, uint32_t pix_row, uint32_t pix_col, short dc)
+{
+	if (pix_row >= JPEG_FRAME_HEIGHT(jpeg) || pix_col >= JPEG_FRAME_WIDTH(jpeg))
+	{
+		return; //padding block of an edge MCU
+	}
+
+	int32_t luma = (dc * ctx->qtable_0[0][0] + 128 * 8 + 4) >> 3;
+
+	jpeg->luma_map[(pix_row >> 3) * jpeg->luma_map_width + (pix_col >> 3)] = (luma < 0) ? 0 : (luma > 255) ? 255 : luma;
+}
+
+//writes headers into output->buf, or into the first buffer of the sink if there is one. A sink that has no buffer for the
+//frame (e.g. nobody is receiving) fails it with ESP_ERR_INVALID_STATE. Partial frames have no headers, only the output is set.
+//The frame's quality is set first, a sink reads it with its first buffer
+static esp_err_t jpeg_output_begin(jpeg_encoder_ctx_t * ctx, m_jpeg_ctrl * jpeg, jpeg_t * output, bool keyframe)
+{
+	output->info.quality = ctx->quality;
+
+	if (ctx->sink != NULL)
+	{
+		huffman_set_output(ctx, NULL, 0);
+	}
+	else
+	{
+		huffman_set_output(ctx, output->buf, output->buf_max_size);
+	}
+
+	if (keyframe)
+	{
+		huffman_start(ctx, JPEG_FRAME_HEIGHT(jpeg), JPEG_FRAME_WIDTH(jpeg));
+	}
+	else
+	{
+		huffman_segment_begin(ctx, 0);
+	}
+
+	return jpeg_output_overflow(ctx, jpeg);
+}
+
+//fails the frame if it overflowed, see jpeg_output_begin()
+static esp_err_t jpeg_output_overflow(jpeg_encoder_ctx_t * ctx, m_jpeg_ctrl * jpeg)
+{
+	if (ctx->overflow)
+	{
+		jpeg->status = (ctx->sink != NULL && huffman_output_size(ctx) == 0) ? ESP_ERR_INVALID_STATE : ESP_ERR_NO_MEM;
+	}
+
+	return jpeg->status;
+}
+
+//encodes the whole frame with the current tables, args are already checked. With conditional replenishment only the
+//stripes that changed are encoded, unless the frame has to be a keyframe
+static esp_err_t jpeg_encode_frame(jpeg_encoder_ctx_t * ctx, uint8_t * input_buf, uint32_t input_buf_size, uint32_t frame_width, uint32_t frame_height, jpeg_t * output)
+{
+	jpeg_replenish_t * replenish = ctx->replenish;
+	uint32_t stats_mark = 0;
+	m_jpeg_ctrl jpeg;
+	jpeg_ctrl_init(ctx, &jpeg, input_buf_size, frame_width, frame_height, output);
+	jpeg_stats_attempt(ctx);
+
+	uint8_t * input_buf_2d[JPEG_FRAME_HEIGHT(&jpeg)];
+
+	bitstream_2d_convert(input_buf_size, JPEG_FRAME_HEIGHT(&jpeg), input_buf, input_buf_2d);
+
+	bool keyframe = jpeg_replenish_keyframe(ctx, &jpeg);
+
+	JPEG_STATS_MARK(ctx, stats_mark);
+	jpeg_output_begin(ctx, &jpeg, output, keyframe);
+	JPEG_STATS_STAGE(ctx, JPEG_STAGE_OUTPUT, stats_mark);
+
+	uint32_t mcu_rows = JPEG_MCU_COUNT(JPEG_FRAME_HEIGHT(&jpeg), JPEG_FRAME_MCU_HEIGHT(&jpeg));
+	uint32_t stripe_rows = (ctx->restart_rows != 0) ? ctx->restart_rows : mcu_rows;
+
+	for (uint32_t mcu_row = 0; mcu_row < mcu_rows && jpeg.status == ESP_OK; mcu_row += stripe_rows)
+	{
+		uint32_t mcu_row_end = (mcu_row + stripe_rows < mcu_rows) ? mcu_row + stripe_rows : mcu_rows;
+
+		if (replenish != NULL)
+		{
+			replenish->stripes ++;
+
+			if (!jpeg_replenish_stripe(replenish, &jpeg, input_buf_2d, mcu_row, mcu_row_end, keyframe))
+			{
+				jpeg_replenish_luma_map(replenish, &jpeg, mcu_row, mcu_row_end);
+				continue; //the receiver has it already
+			}
+
+			replenish->stripes_sent ++;
+
+			if (!keyframe)
+			{
+				huffman_stripe_begin(ctx, mcu_row / stripe_rows);
+				if (jpeg_output_overflow(ctx, &jpeg) != ESP_OK)
+				{
+					break;
+				}
+			}
+		}
+
+		if (jpeg_encode_mcu_rows(ctx, &jpeg, input_buf_2d, mcu_row, mcu_row_end) != ESP_OK)
+		{
+			break;
+		}
+
+		if (keyframe && mcu_row_end != mcu_rows)
+		{
+			huffman_restart(ctx);
+		}
+	}
+
+	JPEG_STATS_MARK(ctx, stats_mark);
+	if (jpeg.status == ESP_OK)
+	{
+		huffman_stop(ctx);
+
+		jpeg.jpeg_out->buf_written_size = huffman_output_size(ctx);
+		if (ctx->overflow)
+		{
+			jpeg.status = ESP_ERR_NO_MEM;
+		}
+	}
+
+	huffman_output_flush(ctx);
+	JPEG_STATS_STAGE(ctx, JPEG_STAGE_OUTPUT, stats_mark);
+
+	if (jpeg.status == ESP_ERR_NO_MEM && ctx->stats != NULL)
+	{
+		JPEG_STATS(ctx)->overflows ++;
+	}
+
+	if (jpeg.status != ESP_OK)
+	{
+		jpeg.jpeg_out->buf_written_size = 0;
+
+		if (replenish != NULL)
+		{
+			replenish->keyframe_pending = true; //signatures of the stripes in this frame were updated, but it won't arrive
+		}
+	}
+
+	return jpeg.status;
+}
+
+//steps quality towards the target size after a frame was encoded
+static void jpeg_rate_control_update(jpeg_encoder_ctx_t * ctx, uint32_t frame_size)
+{
+	uint32_t target = ctx->rc_target_size;
+	int step = 0;
+
+	if (target == 0)
+	{
+		return;
+	}
+
+	if (frame_size > target)
+	{
+		step = -(int)(1 + (frame_size - target) * JPEG_RC_GAIN / target);
+		if (step < -JPEG_RC_STEP_MAX)
+		{
+			step = -JPEG_RC_STEP_MAX;
+		}
+	}
+	else if (frame_size < target - target / JPEG_RC_HEADROOM_DIV)
+	{
+		step = 1;
+	}
+
+	int quality = ctx->quality + step;
+	if (quality > ctx->rc_quality_max)
+	{
+		quality = ctx->rc_quality_max;
+	}
+	if (quality < JPEG_RC_QUALITY_MIN)
+	{
+		quality = JPEG_RC_QUALITY_MIN;
+	}
+
+	jpeg_encoder_set_quality(ctx, quality);
+}
+
+//drops quality by a third after a frame didn't fit into the output buffer, returns false if it can't go any lower
+static bool jpeg_rate_control_overflow(jpeg_encoder_ctx_t * ctx)
+{
+	if (ctx->rc_target_size == 0 || ctx->quality <= JPEG_RC_QUALITY_MIN)
+	{
+		return false;
+	}
+
+	int quality = ctx->quality - (ctx->quality + 2) / 3;
+	if (quality < JPEG_RC_QUALITY_MIN)
+	{
+		quality = JPEG_RC_QUALITY_MIN;
+	}
+
+	jpeg_encoder_set_quality(ctx, quality);
+	return true;
+}
+
+//rebuilds Huffman tables from the statistics of the last period frames, so the next frame is coded with them
+static void jpeg_huffman_update(jpeg_encoder_ctx_t * ctx)
+{
+	if (ctx->huff_opt_period == 0)
+	{
+		return;
+	}
+
+	if (++ ctx->huff_opt_frames >= ctx->huff_opt_period)
+	{
+		ctx->huff_opt_frames = 0;
+		huffman_tables_optimize(ctx);
+	}
+}
+
+//whether the frame has to be complete. Partial frames reuse the tables, size and restart interval of the last keyframe,
+//and the signatures from it of the stripes they don't carry
+static bool jpeg_replenish_keyframe(jpeg_encoder_ctx_t * ctx, m_jpeg_ctrl * jpeg)
+{
+	jpeg_replenish_t * replenish = ctx->replenish;
+	unsigned header_size;
+
+	if (replenish == NULL)
+	{
+		return true;
+	}
+
+	huffman_header(ctx, &header_size); //0 once quality, Huffman tables or colorspace changed
+
+	bool keyframe = replenish->keyframe_pending || header_size == 0 || ctx->restart_rows == 0
+			|| ctx->restart_rows != replenish->restart_rows || JPEG_FRAME_WIDTH(jpeg) != replenish->frame_width
+			|| JPEG_FRAME_HEIGHT(jpeg) != replenish->frame_height
+			|| JPEG_REPLENISH_SIG_COUNT(JPEG_FRAME_WIDTH(jpeg), JPEG_FRAME_HEIGHT(jpeg)) > replenish->sig_count
+			|| ++ replenish->frames >= replenish->keyframe_period;
+
+	if (keyframe)
+	{
+		bool sig_fits = JPEG_REPLENISH_SIG_COUNT(JPEG_FRAME_WIDTH(jpeg), JPEG_FRAME_HEIGHT(jpeg)) <= replenish->sig_count;
+
+		replenish->frames = 0;
+		replenish->keyframe_pending = (ctx->restart_rows == 0 || !sig_fits); //no signatures kept, the next one is a keyframe too
+		replenish->frame_width = JPEG_FRAME_WIDTH(jpeg);
+		replenish->frame_height = JPEG_FRAME_HEIGHT(jpeg);
+		replenish->restart_rows = sig_fits ? ctx->restart_rows : 0;
+	}
+
+	replenish->keyframe = keyframe;
+	replenish->stripes = 0;
+	replenish->stripes_sent = 0;
+	return keyframe;
+}
+
+//compares the luma blocks of MCU rows [mcu_row_start, mcu_row_end) with their signatures as last sent and returns true if
+//any changed, then the stripe is going to be sent and all its signatures are updated. Keyframes only store them
+static bool jpeg_replenish_stripe(jpeg_replenish_t * replenish, m_jpeg_ctrl * jpeg, uint8_t ** input_buf_2d, uint32_t mcu_row_start, uint32_t mcu_row_end, bool keyframe)
+{
+	uint32_t blocks_per_row = JPEG_MCU_COUNT(JPEG_FRAME_WIDTH(jpeg), JPEG_FRAME_MCU_WIDTH(jpeg)) * JPEG_FRAME_MCU_WIDTH(jpeg) / 8;
+	uint32_t block_row_start = mcu_row_start * JPEG_FRAME_MCU_HEIGHT(jpeg) / 8;
+	uint32_t block_row_end = mcu_row_end * JPEG_FRAME_MCU_HEIGHT(jpeg) / 8;
+	bool changed = keyframe;
+
+	if (replenish->restart_rows == 0)
+	{
+		return true; //keyframe whose signatures aren't kept
+	}
+
+	for (uint32_t block_row = block_row_start; block_row < block_row_end && !changed; block_row ++)
+	{
+		uint32_t * sig = replenish->sig + block_row * blocks_per_row;
+
+		for (uint32_t block_col = 0; block_col < blocks_per_row && !changed; block_col ++)
+		{
+			changed = jpeg_signature_changed(sig[block_col], jpeg_block_signature(jpeg, input_buf_2d, block_row * 8, block_col * 8), replenish->threshold);
+		}
+	}
+
+	if (!changed)
+	{
+		return false;
+	}
+
+	for (uint32_t block_row = block_row_start; block_row < block_row_end; block_row ++)
+	{
+		uint32_t * sig = replenish->sig + block_row * blocks_per_row;
+
+		for (uint32_t block_col = 0; block_col < blocks_per_row; block_col ++)
+		{
+			sig[block_col] = jpeg_block_signature(jpeg, input_buf_2d, block_row * 8, block_col * 8);
+		}
+	}
+
+	return true;
+}
+
+//fills the luma map of a stripe that isn't encoded from the means in its signatures
+static void jpeg_replenish_luma_map(jpeg_replenish_t * replenish, m_jpeg_ctrl * jpeg, uint32_t mcu_row_start, uint32_t mcu_row_end)
+{
+	uint32_t blocks_per_row = JPEG_MCU_COUNT(JPEG_FRAME_WIDTH(jpeg), JPEG_FRAME_MCU_WIDTH(jpeg)) * JPEG_FRAME_MCU_WIDTH(jpeg) / 8;
+	uint32_t block_row_start = mcu_row_start * JPEG_FRAME_MCU_HEIGHT(jpeg) / 8;
+	uint32_t block_row_end = mcu_row_end * JPEG_FRAME_MCU_HEIGHT(jpeg) / 8;
+
+	if (jpeg->luma_map == NULL)
+	{
+		return;
+	}
+
+	if (block_row_end > JPEG_MCU_COUNT(JPEG_FRAME_HEIGHT(jpeg), 8))
+	{
+		block_row_end = JPEG_MCU_COUNT(JPEG_FRAME_HEIGHT(jpeg), 8); //padding rows of the last MCU row
+	}
+
+	for (uint32_t block_row = block_row_start; block_row < block_row_end; block_row ++)
+	{
+		const uint32_t * sig = replenish->sig + block_row * blocks_per_row;
+		uint8_t * luma = jpeg->luma_map + block_row * jpeg->luma_map_width;
+
+		for (uint32_t block_col = 0; block_col < jpeg->luma_map_width; block_col ++)
+		{
+			luma[block_col] = sig[block_col] & 0xFF;
+		}
+	}
+}
+
+//mean and horizontal and vertical gradients of the part of an 8x8 luma block inside the frame, straight from the YUYV
+//input. Packed as mean (8 bits) and the left-right and top-bottom differences of the half-block means (9 bits signed each)
+static uint32_t jpeg_block_signature(m_jpeg_ctrl * jpeg, uint8_t ** input_buf_2d, uint32_t pix_row, uint32_t pix_col)
+{
+	int32_t half_sum[2][2] = {{0, 0}, {0, 0}}; //[bottom][right]
+
+	if (pix_row >= JPEG_FRAME_HEIGHT(jpeg) || pix_col >= JPEG_FRAME_WIDTH(jpeg))
+	{
+		return 0; //padding, never changes
+	}
+
+	uint32_t rows = (pix_row + 8 <= JPEG_FRAME_HEIGHT(jpeg)) ? 8 : JPEG_FRAME_HEIGHT(jpeg) - pix_row;
+	uint32_t cols = (pix_col + 8 <= JPEG_FRAME_WIDTH(jpeg)) ? 8 : JPEG_FRAME_WIDTH(jpeg) - pix_col;
+
+	for (uint32_t row = 0; row < rows; row ++)
+	{
+		const uint8_t * input_row_array = input_buf_2d[pix_row + row] + JPEG_FRAME_BYTE_PER_PIX(jpeg) * pix_col;
+
+		for (uint32_t col = 0; col < cols; col ++)
+		{
+			half_sum[row >> 2][col >> 2] += input_row_array[JPEG_FRAME_BYTE_PER_PIX(jpeg) * col];
+		}
+	}
+
+	int32_t count = rows * cols;
+	int32_t mean = (half_sum[0][0] + half_sum[0][1] + half_sum[1][0] + half_sum[1][1] + count / 2) / count;
+	int32_t grad_x = 2 * (half_sum[0][0] + half_sum[1][0] - half_sum[0][1] - half_sum[1][1]) / count;
+	int32_t grad_y = 2 * (half_sum[0][0] + half_sum[0][1] - half_sum[1][0] - half_sum[1][1]) / count;
+
+	return (uint32_t) mean | ((uint32_t) (grad_x & 0x1FF) << 8) | ((uint32_t) (grad_y & 0x1FF) << 17);
+}
+
+static bool jpeg_signature_changed(uint32_t sig_1, uint32_t sig_2, uint32_t threshold)
+{
+	int32_t mean = (int32_t) (sig_1 & 0xFF) - (int32_t) (sig_2 & 0xFF);
+	int32_t grad_x = ((int32_t) (sig_1 << 15) >> 23) - ((int32_t) (sig_2 << 15) >> 23);
+	int32_t grad_y = ((int32_t) (sig_1 << 6) >> 23) - ((int32_t) (sig_2 << 6) >> 23);
+
+	return abs(mean) > (int32_t) threshold || abs(grad_x) > (int32_t) threshold || abs(grad_y) > (int32_t) threshold;
+}
+
+static uint32_t jpeg_stripe_count(jpeg_encoder_ctx_t * ctx, uint32_t frame_height)
+{
+	uint32_t mcu_rows = JPEG_MCU_COUNT(frame_height, JPEG_MCU_HEIGHT(ctx->colorspace));
+
+	if (ctx->restart_rows == 0 || mcu_rows == 0)
+	{
+		return 1;
+	}
+
+	return (mcu_rows + ctx->restart_rows - 1) / ctx->restart_rows;
+}
+
+//encodes MCU rows [mcu_row_start, mcu_row_end) into the current entropy-coded segment
+static esp_err_t jpeg_encode_mcu_rows(jpeg_encoder_ctx_t * ctx, m_jpeg_ctrl * jpeg, uint8_t ** input_buf_2d, uint32_t mcu_row_start, uint32_t mcu_row_end)
+{
+	short Y_8x8 [2][2][8][8];
+	short Cr_8x8 [8][8];
+	short Cb_8x8 [8][8];
+	uint32_t stats_mark = 0;
+
+	//blocks of an MCU in the order they are coded, with the component each belongs to
+	short (* blocks[HUFFMAN_MCU_BLOCKS_MAX])[8];
+	huffman_t * blocks_hctx[HUFFMAN_MCU_BLOCKS_MAX];
+	uint32_t num_blocks = 0;
+	jpeg_load_mcu_t load_mcu;
+
+	switch (JPEG_FRAME_COLORSPACE(ctx))
+	{
+		case YUV400:
+			load_mcu = yuv422_load_mcu_y;
+			break;
+		case YUV422:
+			load_mcu = yuv422_load_mcu_h2v1;
+			break;
+		default:
+			load_mcu = yuv422_load_mcu;
+			break;
+	}
+
+	for (uint32_t row = 0; row < JPEG_FRAME_MCU_HEIGHT(jpeg) / 8; row ++)
+		for (uint32_t col = 0; col < JPEG_FRAME_MCU_WIDTH(jpeg) / 8; col ++)
+		{
+			blocks[num_blocks] = Y_8x8[row][col];
+			blocks_hctx[num_blocks ++] = HUFFMAN_CTX_Y(ctx);
+		}
+
+	if (JPEG_FRAME_COLORSPACE(ctx) != YUV400)
+	{
+		blocks[num_blocks] = Cb_8x8;
+		blocks_hctx[num_blocks ++] = HUFFMAN_CTX_Cb(ctx);
+		blocks[num_blocks] = Cr_8x8;
+		blocks_hctx[num_blocks ++] = HUFFMAN_CTX_Cr(ctx);
+	}
+
+	uint32_t luma_cols = JPEG_FRAME_MCU_WIDTH(jpeg) / 8;
+	uint32_t num_luma_blocks = luma_cols * JPEG_FRAME_MCU_HEIGHT(jpeg) / 8; //coded first
+
+	for (uint32_t pix_position_row = mcu_row_start * JPEG_FRAME_MCU_HEIGHT(jpeg); pix_position_row < mcu_row_end * JPEG_FRAME_MCU_HEIGHT(jpeg); pix_position_row += JPEG_FRAME_MCU_HEIGHT(jpeg))
+	{
+		//MCUs which lie entirely inside the frame take the fast path, the partial ones at the right and bottom edges are padded
+		uint32_t full_cols_end = (pix_position_row + JPEG_FRAME_MCU_HEIGHT(jpeg) <= JPEG_FRAME_HEIGHT(jpeg)) ? JPEG_FRAME_WIDTH(jpeg) & -JPEG_FRAME_MCU_WIDTH(jpeg) : 0;
+
+		for (uint32_t pix_position_col = 0; pix_position_col < JPEG_FRAME_WIDTH(jpeg); pix_position_col += JPEG_FRAME_MCU_WIDTH(jpeg))
+		{
+			JPEG_STATS_MCU(ctx, stats_mark);
+
+			if (pix_position_col < full_cols_end)
+			{
+				load_mcu(input_buf_2d, pix_position_row, JPEG_FRAME_BYTE_PER_PIX(jpeg) * pix_position_col, Y_8x8, Cb_8x8, Cr_8x8);
+			}
+			else
+			{
+				yuv422_load_mcu_edge(jpeg, input_buf_2d, pix_position_row, pix_position_col, Y_8x8, Cb_8x8, Cr_8x8);
+			}
+
+			JPEG_STATS_STAGE(ctx, JPEG_STAGE_LOAD, stats_mark);
+
+			const jpeg_roi_level_t * roi = NULL;
+			if (jpeg->roi_map != NULL)
+			{
+				uint8_t level = jpeg->roi_map[(pix_position_row / JPEG_FRAME_MCU_HEIGHT(jpeg)) * jpeg->roi_map_cols + pix_position_col / JPEG_FRAME_MCU_WIDTH(jpeg)];
+				roi = (level == 0) ? NULL : &jpeg_roi_levels[(level < JPEG_ROI_LEVELS) ? level : JPEG_ROI_LEVELS - 1];
+			}
+
+			//space is reserved block by block rather than for the whole MCU, so when the output is packet-sized only the
+			//blocks at the end of each packet are encoded into the spill buffer and copied
+			for (uint32_t block = 0; block < num_blocks; block ++)
+			{
+				huffman_mcu_begin(ctx, 1);
+				JPEG_STATS_STAGE(ctx, JPEG_STAGE_OUTPUT, stats_mark);
+				short dc = jpeg_encode_block(ctx, blocks_hctx[block], blocks[block], roi, &stats_mark);
+				huffman_mcu_end(ctx);
+				JPEG_STATS_STAGE(ctx, JPEG_STAGE_OUTPUT, stats_mark);
+
+				if (block < num_luma_blocks && jpeg->luma_map != NULL)
+				{
+					jpeg_luma_map_set(ctx, jpeg, pix_position_row + 8 * (block / luma_cols), pix_position_col + 8 * (block % luma_cols), dc);
+				}
+			}
+
+			if (ctx->overflow)
+			{
+				jpeg->status = ESP_ERR_NO_MEM;
+			}
+
+			if (jpeg->status != ESP_OK)
+			{
+				return jpeg->status;
+			}
+		}
+	}
+
+	return jpeg->status;
+}
+
+//same as the loaders below for an MCU crossing the right or bottom edge of the frame, pixels outside of it repeat the last
+//row and column
+static void yuv422_load_mcu_edge(m_jpeg_ctrl * jpeg, uint8_t ** input_buf_2d, uint32_t pix_row, uint32_t pix_col, short Y_8x8[2][2][8][8], short Cb_8x8[8][8], short Cr_8x8[8][8])
+{
+	const uint8_t * input_rows[JPEG_PIX_BLOCK_SIZE];
+	uint32_t Y_offset[JPEG_PIX_BLOCK_SIZE]; //byte offset of Y of each pixel column
+	uint32_t UV_offset[JPEG_PIX_BLOCK_SIZE / 2]; //byte offset of the Y0_U0_Y1_V0 pair of each chroma column
+	uint32_t UV_row_step = JPEG_FRAME_MCU_HEIGHT(jpeg) / 8; //pixel rows averaged into one chroma row, 2 for 4:2:0 and 1 for 4:2:2
+
+	for (uint32_t i = 0; i < JPEG_PIX_BLOCK_SIZE; i ++)
+	{
+		uint32_t row = (pix_row + i < JPEG_FRAME_HEIGHT(jpeg)) ? pix_row + i : JPEG_FRAME_HEIGHT(jpeg) - 1;
+		uint32_t col = (pix_col + i < JPEG_FRAME_WIDTH(jpeg)) ? pix_col + i : JPEG_FRAME_WIDTH(jpeg) - 1;
+
+		input_rows[i] = input_buf_2d[row];
+		Y_offset[i] = JPEG_FRAME_BYTE_PER_PIX(jpeg) * col;
+		if ((i & 1) == 0)
+		{
+			UV_offset[i >> 1] = JPEG_FRAME_BYTE_PER_PIX(jpeg) * (col & ~1);
+		}
+	}
+
+	for (uint32_t row = 0; row < JPEG_FRAME_MCU_HEIGHT(jpeg); row ++)
+		for (uint32_t col = 0; col < JPEG_FRAME_MCU_WIDTH(jpeg); col ++)
+		{
+			Y_8x8[row >> 3][col >> 3][row & 7][col & 7] = input_rows[row][Y_offset[col]] - 128;
+		}
+
+	if (JPEG_FRAME_MCU_WIDTH(jpeg) == 8)
+	{
+		return; //Y only
+	}
+
+	for (uint32_t row = 0; row < 8; row ++)
+		for (uint32_t col = 0; col < 8; col ++)
+		{
+			const uint8_t * pair_1 = input_rows[row * UV_row_step] + UV_offset[col];
+			const uint8_t * pair_2 = input_rows[row * UV_row_step + UV_row_step - 1] + UV_offset[col];
+
+			Cb_8x8[row][col] = ((pair_1[1] + pair_2[1]) >> 1) - 128;
+			Cr_8x8[row][col] = ((pair_1[3] + pair_2[3]) >> 1) - 128;
+		}
+}
+
+//transforms, quantizes (coarser in an ROI level other than 0) and entropy-codes one 8x8 block, returns its quantized DC
+//coefficient
+static inline short jpeg_encode_block(jpeg_encoder_ctx_t * ctx, huffman_t * hctx, short pixels[8][8], const jpeg_roi_level_t * roi, uint32_t * stats_mark)
+{
+	short coefs [64]; //quantized, zig-zag order
+	unsigned last = dct_quantize(pixels, coefs, hctx->qtable); //last non-zero coefficient in coefs
+
+	if (roi != NULL)
+	{
+		last = jpeg_roi_requantize(coefs, last, roi);
+	}
+
+	JPEG_STATS_STAGE(ctx, JPEG_STAGE_DCT_QUANT, *stats_mark);
+
+	huffman_encode(ctx, hctx, coefs, last);
+
+	JPEG_STATS_STAGE(ctx, JPEG_STAGE_HUFFMAN, *stats_mark);
+
+	return coefs[0];
+}
+
+//clears the statistics for a new frame
+static void jpeg_stats_begin(jpeg_encoder_ctx_t * ctx)
+{
+	if (ctx->stats != NULL)
+	{
+		memset(ctx->stats, 0, sizeof(jpeg_stats_t));
+	}
+}
+
+//another attempt at the frame, block counts start over
+static void jpeg_stats_attempt(jpeg_encoder_ctx_t * ctx)
+{
+	jpeg_stats_t * stats = ctx->stats;
+
+	if (stats != NULL)
+	{
+		stats->mcus = 0;
+		memset(stats->component, 0, sizeof(stats->component));
+	}
+}
+
+//called once the frame is done, before rate control moves quality on
+static void jpeg_stats_end(jpeg_encoder_ctx_t * ctx, esp_err_t status, uint32_t size)
+{
+	jpeg_stats_t * stats = ctx->stats;
+
+	if (stats != NULL)
+	{
+		stats->size = (status == ESP_OK) ? size : 0;
+		stats->quality = ctx->quality;
+		stats->keyframe = (ctx->replenish == NULL || ((jpeg_replenish_t *) ctx->replenish)->keyframe);
+	}
+}
+
+//adds the statistics of the parts other contexts encoded to the owner's, so they cover the whole frame
+static void jpeg_stats_merge(jpeg_encoder_ctx_t * ctx, jpeg_stripe_job_t * job)
+{
+	jpeg_stats_t * stats = ctx->stats;
+
+	for (uint32_t part = 0; part < job->num_parts && stats != NULL; part ++)
+	{
+		jpeg_stats_t * part_stats = job->part_stats[part];
+
+		if (part_stats == NULL)
+		{
+			continue;
+		}
+
+		stats->mcus += part_stats->mcus;
+		for (uint32_t stage = 0; stage < JPEG_STAGE_COUNT; stage ++)
+		{
+			stats->ticks[stage] += part_stats->ticks[stage];
+		}
+		for (uint32_t i = 0; i < 3; i ++)
+		{
+			stats->component[i].bits += part_stats->component[i].bits;
+			stats->component[i].nonzero += part_stats->component[i].nonzero;
+			stats->component[i].eob += part_stats->component[i].eob;
+			stats->component[i].zrl += part_stats->component[i].zrl;
+		}
+		stats->overflows += part_stats->overflows;
+	}
+}
+
+//applies an ROI level to the quantized coefficients of a block, returns the new last non-zero one
+static unsigned jpeg_roi_requantize(short coefs[64], unsigned last, const jpeg_roi_level_t * roi)
+{
+	unsigned last_ac = roi->last_ac;
+	unsigned shift = roi->shift;
+	unsigned new_last = 0;
+
+	for (unsigned i = 1; i <= last; i ++)
+	{
+		int coef = coefs[i];
+		int magnitude = (coef < 0) ? -coef : coef;
+
+		if (coef == 0)
+		{
+			continue;
+		}
+
+		if (i > last_ac)
+		{
+			coefs[i] = 0;
+			continue;
+		}
+
+		if (shift != 0)
+		{
+			magnitude = ((magnitude + (1 << (shift - 1)) - 1) >> shift) << shift; //halves round towards 0, 1 doesn't grow to 2
+			coefs[i] = (coef < 0) ? -magnitude : magnitude;
+		}
+
+		if (magnitude != 0)
+		{
+			new_last = i;
+		}
+	}
+
+	return new_last;
+}
+
+static void bitstream_2d_convert(uint32_t total_len, uint32_t height, uint8_t * bitstream, uint8_t ** bitstream_2d)
+{
+	//converts to 2d_bitstream[row][col]
+#if CONFIG_JPEG_FIXED_FRAME
+	uint32_t width = JPEG_FIXED_WIDTH * 2;
+#else
+	uint32_t width = total_len/height;
+#endif
+
+	for (uint32_t row = 0; row < height; row ++)
+		bitstream_2d[row] = &bitstream[row*width];
+}
+
+//loads a whole 16x16 MCU in one pass over its 16 YUYV rows: four 8x8 Y blocks and 8x8 Cb and Cr blocks, chroma averaged
+//over each pair of rows for 4:2:0. Samples are centered about 0 for DCT. The MCU must lie inside the frame, checked by the caller
+static void yuv422_load_mcu(uint8_t ** input_buf_2d, uint32_t pix_row, uint32_t byte_col, short Y_8x8[2][2][8][8], short Cb_8x8[8][8], short Cr_8x8[8][8])
+{
+	for (uint32_t row = 0; row < 8; row ++)
+	{
+		const uint8_t * input_row_array_1 = input_buf_2d[pix_row + (row << 1)] + byte_col;
+		const uint8_t * input_row_array_2 = input_buf_2d[pix_row + (row << 1) + 1] + byte_col;
+		short * Cb_row = Cb_8x8[row];
+		short * Cr_row = Cr_8x8[row];
+
+		for (uint32_t block_col = 0; block_col < 2; block_col ++)
+		{
+			short * Y_row_1 = Y_8x8[row >> 2][block_col][(row & 3) << 1];
+			short * Y_row_2 = Y_row_1 + 8; //next row of the same block
+
+			for (uint32_t col = 0; col < 4; col ++)
+			{
+				//Y0_U0_Y1_V0, Cb is at offset 1 and Cr at offset 3
+				Y_row_1[2*col] = input_row_array_1[0] - 128;
+				Y_row_1[2*col + 1] = input_row_array_1[2] - 128;
+				Y_row_2[2*col] = input_row_array_2[0] - 128;
+				Y_row_2[2*col + 1] = input_row_array_2[2] - 128;
+				*Cb_row ++ = ((input_row_array_1[1] + input_row_array_2[1]) >> 1) - 128;
+				*Cr_row ++ = ((input_row_array_1[3] + input_row_array_2[3]) >> 1) - 128;
+
+				input_row_array_1 += 4;
+				input_row_array_2 += 4;
+			}
+		}
+	}
+}
+
+//4:2:2 (H2V1) MCU of 16x8: two 8x8 Y blocks side by side, Cb and Cr taken as they are from the YUYV pairs
+static void yuv422_load_mcu_h2v1(uint8_t ** input_buf_2d, uint32_t pix_row, uint32_t byte_col, short Y_8x8[2][2][8][8], short Cb_8x8[8][8], short Cr_8x8[8][8])
+{
+	for (uint32_t row = 0; row < 8; row ++)
+	{
+		const uint8_t * input_row_array = input_buf_2d[pix_row + row] + byte_col;
+		short * Cb_row = Cb_8x8[row];
+		short * Cr_row = Cr_8x8[row];
+
+		for (uint32_t block_col = 0; block_col < 2; block_col ++)
+		{
+			short * Y_row = Y_8x8[0][block_col][row];
+
+			for (uint32_t col = 0; col < 4; col ++)
+			{
+				Y_row[2*col] = input_row_array[0] - 128;
+				Y_row[2*col + 1] = input_row_array[2] - 128;
+				*Cb_row ++ = input_row_array[1] - 128;
+				*Cr_row ++ = input_row_array[3] - 128;
+
+				input_row_array += 4;
+			}
+		}
+	}
+}
+
+//grayscale MCU of 8x8: one Y block, chroma is skipped
+static void yuv422_load_mcu_y(uint8_t ** input_buf_2d, uint32_t pix_row, uint32_t byte_col, short Y_8x8[2][2][8][8], short Cb_8x8[8][8], short Cr_8x8[8][8])
+{
+	(void) Cb_8x8;
+	(void) Cr_8x8;
+
+	for (uint32_t row = 0; row < 8; row ++)
+	{
+		const uint8_t * input_row_array = input_buf_2d[pix_row + row] + byte_col;
+		short * Y_row = Y_8x8[0][0][row];
+
+		for (uint32_t col = 0; col < 8; col ++)
+		{
+			Y_row[col] = input_row_array[0] - 128;
+			input_row_array += 2;
+		}
+	}
 }
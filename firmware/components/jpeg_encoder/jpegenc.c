@@ -17,12 +17,14 @@
 ** with this program; if not, write to the Free Software Foundation, Inc.
 ******************************************************************************/
 
+#include <string.h>
+
 #include "arch.h"
 #include "jpegenc.h"
 
 
-/* tables from JPEG standard
-const unsigned char qtable_std_lum[64] =
+// tables from JPEG standard (Annex K), scaled by quality factor at runtime
+static const unsigned char qtable_std_lum[64] =
 {
 	16, 11, 10, 16, 24, 40, 51, 61,
 	12, 12, 14, 19, 26, 58, 60, 55,
@@ -34,7 +36,7 @@ const unsigned char qtable_std_lum[64] =
 	72, 92, 95, 98,112,100,103, 99
 };
 
-const unsigned char qtable_std_chrom[64] =
+static const unsigned char qtable_std_chrom[64] =
 {
 	17, 18, 24, 47, 99, 99, 99, 99,
 	18, 21, 26, 66, 99, 99, 99, 99,
@@ -45,81 +47,7 @@ const unsigned char qtable_std_chrom[64] =
 	99, 99, 99, 99, 99, 99, 99, 99,
 	99, 99, 99, 99, 99, 99, 99, 99
 };
-*/
-
-
-#define QTAB_SCALE	10
-
-// as you can see I use Paint tables
-static const unsigned char qtable_0_lum[64] =
-{
-	 8,  6,  5,  8, 12, 20, 26, 31,
-	 6,  6,  7, 10, 13, 29, 30, 28,
-	 7,  7,  8, 12, 20, 29, 35, 28,
-	 7,  9, 11, 15, 26, 44, 40, 31,
-	 9, 11, 19, 28, 34, 55, 52, 39,
-	12, 18, 28, 32, 41, 52, 57, 46,
-	25, 32, 39, 44, 52, 61, 60, 51,
-	36, 46, 48, 49, 56, 50, 52, 50
-};
-
-static const unsigned char qtable_0_chrom[64] =
-{
-	 9,  9, 12, 24, 50, 50, 50, 50,
-	 9, 11, 13, 33, 50, 50, 50, 50,
-	12, 13, 28, 50, 50, 50, 50, 50,
-	24, 33, 50, 50, 50, 50, 50, 50,
-	50, 50, 50, 50, 50, 50, 50, 50,
-	50, 50, 50, 50, 50, 50, 50, 50,
-	50, 50, 50, 50, 50, 50, 50, 50,
-	50, 50, 50, 50, 50, 50, 50, 50
-};
-
-// (1 << QTAB_SCALE)/qtable_0_lum[][]
-static const unsigned char qtable_lum[64] =
-{
-	128,171,205,128, 85, 51, 39, 33,
-	171,171,146,102, 79, 35, 34, 37,
-	146,146,128, 85, 51, 35, 29, 37,
-	146,114, 93, 68, 39, 23, 26, 33,
-	114, 93, 54, 37, 30, 19, 20, 26,
-	 85, 57, 37, 32, 25, 20, 18, 22,
-	 41, 32, 26, 23, 20, 17, 17, 20,
-	 28, 22, 21, 21, 18, 20, 20, 20
-};
 
-// (1 << QTAB_SCALE)/qtable_0_chrom[][]
-static const unsigned char qtable_chrom[64] =
-{
-	114,114, 85, 43, 20, 20, 20, 20,
-	114, 93, 79, 31, 20, 20, 20, 20,
-	 85, 79, 37, 20, 20, 20, 20, 20,
-	 43, 31, 20, 20, 20, 20, 20, 20,
-	 20, 20, 20, 20, 20, 20, 20, 20,
-	 20, 20, 20, 20, 20, 20, 20, 20,
-	 20, 20, 20, 20, 20, 20, 20, 20,
-	 20, 20, 20, 20, 20, 20, 20, 20
-};
-
-// zig-zag table
-static const unsigned char zig[64] =
-{
-	 0,
-	 1, 8,
-	16, 9, 2, 
-	 3,10,17,24,
-	32,25,18,11, 4,
-	 5,12,19,26,33,40,
-	48,41,34,27,20,13, 6,
-	 7,14,21,28,35,42,49,56,
-	57,50,43,36,29,22,15,
-	23,30,37,44,51,58,
-	59,52,45,38,31,
-	39,46,53,60,
-	61,54,47,
-	55,62,
-	63
-};
 
 static const unsigned char std_dc_luminance_nrcodes[16] =
 {
@@ -199,174 +127,58 @@ static const unsigned char std_ac_chrominance_values[162] =
 	0xf9, 0xfa
 };
 
-static const unsigned char HYDClen[12] =
-{
-	0x02, 0x03, 0x03, 0x03, 0x03, 0x03, 0x04, 0x05,
-	0x06, 0x07, 0x08, 0x09
-};
-
-static const unsigned char HCDClen[12] =
-{
-	0x02, 0x02, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
-	0x08, 0x09, 0x0a, 0x0b
-};
-
-static const unsigned short HYDCbits[12] =
-{
-	0x0000, 0x0002, 0x0003, 0x0004, 0x0005, 0x0006, 0x000e, 0x001e,
-	0x003e, 0x007e, 0x00fe, 0x01fe
-};
-
-static const unsigned short HCDCbits[12] =
-{
-	0x0000, 0x0001, 0x0002, 0x0006, 0x000e, 0x001e, 0x003e, 0x007e,
-	0x00fe, 0x01fe, 0x03fe, 0x07fe
-};
-
-
-static const unsigned char HYAClen[16][11] =
-{
-	{0x04, 0x02, 0x02, 0x03, 0x04, 0x05, 0x07, 0x08, 0x0a, 0x10, 0x10},
-	{0x00, 0x04, 0x05, 0x07, 0x09, 0x0b, 0x10, 0x10, 0x10, 0x10, 0x10},
-	{0x00, 0x05, 0x08, 0x0a, 0x0c, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10},
-	{0x00, 0x06, 0x09, 0x0c, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10},
-	{0x00, 0x06, 0x0a, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10},
-	{0x00, 0x07, 0x0b, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10},
-	{0x00, 0x07, 0x0c, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10},
-	{0x00, 0x08, 0x0c, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10},
-	{0x00, 0x09, 0x0f, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10},
-	{0x00, 0x09, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10},
-	{0x00, 0x09, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10},
-	{0x00, 0x0a, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10},
-	{0x00, 0x0a, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10},
-	{0x00, 0x0b, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10},
-	{0x00, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10},
-	{0x0b, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10}
-};
-
-static const unsigned short HYACbits[16][11] =
-{
-	{0xfffa, 0xfff0, 0xfff1, 0xfff4, 0xfffb, 0xfffa, 0xfff8, 0xfff8, 0xfff6, 0xff82, 0xff83},
-	{0x0000, 0xfffc, 0xfffb, 0xfff9, 0xfff6, 0xfff6, 0xff84, 0xff85, 0xff86, 0xff87, 0xff88},
-	{0x0000, 0xfffc, 0xfff9, 0xfff7, 0xfff4, 0xff89, 0xff8a, 0xff8b, 0xff8c, 0xff8d, 0xff8e},
-	{0x0000, 0xfffa, 0xfff7, 0xfff5, 0xff8f, 0xff90, 0xff91, 0xff92, 0xff93, 0xff94, 0xff95},
-	{0x0000, 0xfffb, 0xfff8, 0xff96, 0xff97, 0xff98, 0xff99, 0xff9a, 0xff9b, 0xff9c, 0xff9d},
-	{0x0000, 0xfffa, 0xfff7, 0xff9e, 0xff9f, 0xffa0, 0xffa1, 0xffa2, 0xffa3, 0xffa4, 0xffa5},
-	{0x0000, 0xfffb, 0xfff6, 0xffa6, 0xffa7, 0xffa8, 0xffa9, 0xffaa, 0xffab, 0xffac, 0xffad},
-	{0x0000, 0xfffa, 0xfff7, 0xffae, 0xffaf, 0xffb0, 0xffb1, 0xffb2, 0xffb3, 0xffb4, 0xffb5},
-	{0x0000, 0xfff8, 0xffc0, 0xffb6, 0xffb7, 0xffb8, 0xffb9, 0xffba, 0xffbb, 0xffbc, 0xffbd},
-	{0x0000, 0xfff9, 0xffbe, 0xffbf, 0xffc0, 0xffc1, 0xffc2, 0xffc3, 0xffc4, 0xffc5, 0xffc6},
-	{0x0000, 0xfffa, 0xffc7, 0xffc8, 0xffc9, 0xffca, 0xffcb, 0xffcc, 0xffcd, 0xffce, 0xffcf},
-	{0x0000, 0xfff9, 0xffd0, 0xffd1, 0xffd2, 0xffd3, 0xffd4, 0xffd5, 0xffd6, 0xffd7, 0xffd8},
-	{0x0000, 0xfffa, 0xffd9, 0xffda, 0xffdb, 0xffdc, 0xffdd, 0xffde, 0xffdf, 0xffe0, 0xffe1},
-	{0x0000, 0xfff8, 0xffe2, 0xffe3, 0xffe4, 0xffe5, 0xffe6, 0xffe7, 0xffe8, 0xffe9, 0xffea},
-	{0x0000, 0xffeb, 0xffec, 0xffed, 0xffee, 0xffef, 0xfff0, 0xfff1, 0xfff2, 0xfff3, 0xfff4},
-	{0xfff9, 0xfff5, 0xfff6, 0xfff7, 0xfff8, 0xfff9, 0xfffa, 0xfffb, 0xfffc, 0xfffd, 0xfffe}
-};
-
-static const unsigned char HCAClen[16][11] =
-{
-	{0x02, 0x02, 0x03, 0x04, 0x05, 0x05, 0x06, 0x07, 0x09, 0x0a, 0x0c},
-	{0x00, 0x04, 0x06, 0x08, 0x09, 0x0b, 0x0c, 0x10, 0x10, 0x10, 0x10},
-	{0x00, 0x05, 0x08, 0x0a, 0x0c, 0x0f, 0x10, 0x10, 0x10, 0x10, 0x10},
-	{0x00, 0x05, 0x08, 0x0a, 0x0c, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10},
-	{0x00, 0x06, 0x09, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10},
-	{0x00, 0x06, 0x0a, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10},
-	{0x00, 0x07, 0x0b, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10},
-	{0x00, 0x07, 0x0b, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10},
-	{0x00, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10},
-	{0x00, 0x09, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10},
-	{0x00, 0x09, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10},
-	{0x00, 0x09, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10},
-	{0x00, 0x09, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10},
-	{0x00, 0x0b, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10},
-	{0x00, 0x0e, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10},
-	{0x0a, 0x0f, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10}
-};
-
-static const unsigned short HCACbits[16][11] =
-{
-	{0x0000, 0x0001, 0x0004, 0x000a, 0x0018, 0x0019, 0x0038, 0x0078, 0x01f4, 0x03f6, 0x0ff4},
-	{0x0000, 0x000b, 0x0039, 0x00f6, 0x01f5, 0x07f6, 0x0ff5, 0xff88, 0xff89, 0xff8a, 0xff8b},
-	{0x0000, 0x001a, 0x00f7, 0x03f7, 0x0ff6, 0x7fc2, 0xff8c, 0xff8d, 0xff8e, 0xff8f, 0xff90},
-	{0x0000, 0x001b, 0x00f8, 0x03f8, 0x0ff7, 0xff91, 0xff92, 0xff93, 0xff94, 0xff95, 0xff96},
-	{0x0000, 0x003a, 0x01f6, 0xff97, 0xff98, 0xff99, 0xff9a, 0xff9b, 0xff9c, 0xff9d, 0xff9e},
-	{0x0000, 0x003b, 0x03f9, 0xff9f, 0xffa0, 0xffa1, 0xffa2, 0xffa3, 0xffa4, 0xffa5, 0xffa6},
-	{0x0000, 0x0079, 0x07f7, 0xffa7, 0xffa8, 0xffa9, 0xffaa, 0xffab, 0xffac, 0xffaf, 0xffae},
-	{0x0000, 0x007a, 0x07f8, 0xffaf, 0xffb0, 0xffb1, 0xffb2, 0xffb3, 0xffb4, 0xffb5, 0xffb6},
-	{0x0000, 0x00f9, 0xffb7, 0xffb8, 0xffb9, 0xffba, 0xffbb, 0xffbc, 0xffbd, 0xffbe, 0xffbf},
-	{0x0000, 0x01f7, 0xffc0, 0xffc1, 0xffc2, 0xffc3, 0xffc4, 0xffc5, 0xffc6, 0xffc7, 0xffc8},
-	{0x0000, 0x01f8, 0xffc9, 0xffca, 0xffcb, 0xffcc, 0xffcd, 0xffce, 0xffcf, 0xffd0, 0xffd1},
-	{0x0000, 0x01f9, 0xffd2, 0xffd3, 0xffd4, 0xffd5, 0xffd6, 0xffd7, 0xffd8, 0xffd9, 0xffda},
-	{0x0000, 0x01fa, 0xffdb, 0xffdc, 0xffdd, 0xffde, 0xffdf, 0xffe0, 0xffe1, 0xffe2, 0xffe3},
-	{0x0000, 0x07f9, 0xffe4, 0xffe5, 0xffe6, 0xffe7, 0xffe8, 0xffe9, 0xffea, 0xffeb, 0xffec},
-	{0x0000, 0x3fe0, 0xffed, 0xffee, 0xffef, 0xfff0, 0xfff1, 0xfff2, 0xfff3, 0xfff4, 0xfff5},
-	{0x03fa, 0x7fc3, 0xfff6, 0xfff7, 0xfff8, 0xfff9, 0xfffa, 0xfffb, 0xfffc, 0xfffd, 0xfffe}
-};
-
-huffman_t huffman_ctx[3] =
-{
-	{HYAClen, HYACbits, HYDClen, HYDCbits, qtable_lum,   0}, // Y
-	{HCAClen, HCACbits, HCDClen, HCDCbits, qtable_chrom, 0}, // Cb
-	{HCAClen, HCACbits, HCDClen, HCDCbits, qtable_chrom, 0}, // Cr
-};
-
-typedef struct bitbuffer_s
-{
-	unsigned long buf; // buffer
-	unsigned      n;   // number of bits in it
-}
-bitbuffer_t;
-
-// global bit-buffer
-static bitbuffer_t bitbuf;
-
-// global output code-stream size
-static unsigned jpgn = 0;
-// global output code-stream buffer, adjust its size if you need
-static unsigned char jpgbuff[256];
-
-
 /******************************************************************************
-**  quantize
+**  huffman_output_next
 **  --------------------------------------------------------------------------
-**  DCT coeficient quantization.
-**  To avoid division function uses quantization coefs amplified by 2^QTAB_SCALE
-**  and then shifts the product by QTAB_SCALE bits to the right.
-**  To make this operation a bit faster some tricks are used but it is just
-**  returns round(data[i]/qt0[i]).
+**  Hands the output buffer, written up to the bit-buffer pointer, to the
+**  sink and continues in the buffer it returns. Once the sink has failed
+**  to give a buffer the rest of the frame is dropped.
 **  
 **  ARGUMENTS:
-**      data    - DCT freq value;
-**      qt      - quantization value ( (1 << QTAB_SCALE)/qt0 );
+**      ctx     - pointer to encoder context;
 **
-**  RETURN: quantized value.
+**  RETURN: non-zero if there is a new output buffer
 ******************************************************************************/
-static short quantize(const short data, const unsigned short qt)
+static int huffman_output_next(jpeg_encoder_ctx_t *const ctx)
 {
-	return (data*qt - (data>>15) + ((1<<(QTAB_SCALE-1))-1)) >> QTAB_SCALE;
+	unsigned char *buf;
+	unsigned size = 0;
+
+	if (!ctx->sink || ctx->overflow)
+		return 0;
+
+	ctx->out_flushed += ctx->bitbuf.out - ctx->out_start;
+
+	buf = ctx->sink(ctx->sink_arg, ctx->out_start, ctx->bitbuf.out - ctx->out_start, 0, &size);
+	if (!buf)
+		size = 0;
+
+	ctx->out_start = buf;
+	ctx->out_end = buf + size;
+	ctx->bitbuf.out = buf;
+
+	return size != 0;
 }
 
 /******************************************************************************
 **  writebyte
 **  --------------------------------------------------------------------------
-**  This function writes byte into output buffer
-**  and flushes the buffer if it is full.
-**  	jpgbuff[] - global output buffer;
-**  	jpgn      - global output data size;
+**  This function writes byte into output buffer checking its bounds.
+**  Used for headers and markers, entropy-coded data goes through writebits.
+**  Sets ctx->overflow if the buffer is full and there is no sink to take it.
 **  
-**  ARGUMENTS: b - byte;
+**  ARGUMENTS:
+**      ctx     - pointer to encoder context;
+**      b       - byte;
 **
 **  RETURN: -
 ******************************************************************************/
-static void writebyte(const unsigned char b)
+static void writebyte(jpeg_encoder_ctx_t *const ctx, const unsigned char b)
 {
-	jpgbuff[jpgn++] = b;
-
-	if (jpgn == sizeof(jpgbuff)) {
-		jpgn = 0;
-		write_jpeg(jpgbuff, sizeof(jpgbuff)); // external callback
-	}
+	if (ctx->bitbuf.out < ctx->out_end || huffman_output_next(ctx))
+		*ctx->bitbuf.out++ = b;
+	else
+		ctx->overflow = 1;
 }
 
 /******************************************************************************
@@ -374,117 +186,198 @@ static void writebyte(const unsigned char b)
 **  --------------------------------------------------------------------------
 **  This function writes a word into output buffer. High byte goes first.
 **
-**  ARGUMENTS: w - word;
+**  ARGUMENTS:
+**      ctx     - pointer to encoder context;
+**      w       - word;
 **
 **  RETURN: -
 ******************************************************************************/
-static void writeword(const unsigned short w)
+static void writeword(jpeg_encoder_ctx_t *const ctx, const unsigned short w)
 {
-	writebyte(w >> 8); writebyte((const unsigned char)w);
+	writebyte(ctx, w >> 8); writebyte(ctx, (const unsigned char)w);
 }
 
-static void write_APP0info(void)
+static void write_APP0info(jpeg_encoder_ctx_t *const ctx)
 {
-	writeword(0xFFE0); //marker
-	writeword(16);     //length
-	writebyte('J');
-	writebyte('F');
-	writebyte('I');
-	writebyte('F');
-	writebyte(0);
-	writebyte(1);//versionhi
-	writebyte(1);//versionlo
-	writebyte(0);//xyunits
-	writeword(1);//xdensity
-	writeword(1);//ydensity
-	writebyte(0);//thumbnwidth
-	writebyte(0);//thumbnheight
+	writeword(ctx, 0xFFE0); //marker
+	writeword(ctx, 16);     //length
+	writebyte(ctx, 'J');
+	writebyte(ctx, 'F');
+	writebyte(ctx, 'I');
+	writebyte(ctx, 'F');
+	writebyte(ctx, 0);
+	writebyte(ctx, 1);//versionhi
+	writebyte(ctx, 1);//versionlo
+	writebyte(ctx, 0);//xyunits
+	writeword(ctx, 1);//xdensity
+	writeword(ctx, 1);//ydensity
+	writebyte(ctx, 0);//thumbnwidth
+	writebyte(ctx, 0);//thumbnheight
 }
 
 // should set width and height before writing
-static void write_SOF0info(const short height, const short width)
-{
-	writeword(0xFFC0);	//marker
-	writeword(17);		//length
-	writebyte(8);		//precision
-	writeword(height);	//height
-	writeword(width);	//width
-	writebyte(3);		//nrofcomponents
-	writebyte(1);		//IdY
-	writebyte(0x22);	//HVY, 4:2:0 subsampling
-	writebyte(0);		//QTY
-	writebyte(2);		//IdCb
-	writebyte(0x11);	//HVCb
-	writebyte(1);		//QTCb
-	writebyte(3);		//IdCr
-	writebyte(0x11);	//HVCr
-	writebyte(1);		//QTCr
-}
-
-static void write_SOSinfo(void)
-{
-	writeword(0xFFDA);	//marker
-	writeword(12);		//length
-	writebyte(3);		//nrofcomponents
-	writebyte(1);		//IdY
-	writebyte(0);		//HTY
-	writebyte(2);		//IdCb
-	writebyte(0x11);	//HTCb
-	writebyte(3);		//IdCr
-	writebyte(0x11);	//HTCr
-	writebyte(0);		//Ss
-	writebyte(0x3F);	//Se
-	writebyte(0);		//Bf
-}
-
-static void write_DQTinfo(void)
+static void write_SOF0info(jpeg_encoder_ctx_t *const ctx, const short height, const short width)
+{
+	const unsigned ncomp = (ctx->colorspace == YUV400)? 1: 3;
+
+	writeword(ctx, 0xFFC0);	//marker
+	writeword(ctx, 8 + 3*ncomp);	//length
+	writebyte(ctx, 8);		//precision
+	writeword(ctx, height);	//height
+	writeword(ctx, width);	//width
+	writebyte(ctx, ncomp);	//nrofcomponents
+	writebyte(ctx, 1);		//IdY
+	writebyte(ctx, (JPEG_MCU_WIDTH(ctx->colorspace) / 8 << 4) | JPEG_MCU_HEIGHT(ctx->colorspace) / 8);	//HVY, 0x22 - 4:2:0, 0x21 - 4:2:2
+	writebyte(ctx, 0);		//QTY
+
+	if (ncomp == 1)
+		return;
+
+	writebyte(ctx, 2);		//IdCb
+	writebyte(ctx, 0x11);	//HVCb
+	writebyte(ctx, 1);		//QTCb
+	writebyte(ctx, 3);		//IdCr
+	writebyte(ctx, 0x11);	//HVCr
+	writebyte(ctx, 1);		//QTCr
+}
+
+static void write_SOSinfo(jpeg_encoder_ctx_t *const ctx)
+{
+	const unsigned ncomp = (ctx->colorspace == YUV400)? 1: 3;
+
+	writeword(ctx, 0xFFDA);	//marker
+	writeword(ctx, 6 + 2*ncomp);	//length
+	writebyte(ctx, ncomp);	//nrofcomponents
+	writebyte(ctx, 1);		//IdY
+	writebyte(ctx, 0);		//HTY
+
+	if (ncomp == 3)
+	{
+		writebyte(ctx, 2);		//IdCb
+		writebyte(ctx, 0x11);	//HTCb
+		writebyte(ctx, 3);		//IdCr
+		writebyte(ctx, 0x11);	//HTCr
+	}
+
+	writebyte(ctx, 0);		//Ss
+	writebyte(ctx, 0x3F);	//Se
+	writebyte(ctx, 0);		//Bf
+}
+
+// restart interval is given in MCUs
+static void write_DRIinfo(jpeg_encoder_ctx_t *const ctx, const unsigned short interval)
+{
+	writeword(ctx, 0xFFDD);	//marker
+	writeword(ctx, 4);		//length
+	writeword(ctx, interval);	//Ri
+}
+
+static void write_DQTinfo(jpeg_encoder_ctx_t *const ctx)
 {
 	unsigned i;
 	
-	writeword(0xFFDB);
-	writeword(132);
-	writebyte(0);
+	writeword(ctx, 0xFFDB);
+	writeword(ctx, 132);
+	writebyte(ctx, 0);
 
 	for (i = 0; i < 64; i++) 
-		writebyte(((unsigned char*)qtable_0_lum)[zig[i]]); // zig-zag order
+		writebyte(ctx, ctx->qtable_0[0][dct_zig[i]]); // zig-zag order
 
-	writebyte(1);
+	writebyte(ctx, 1);
 
 	for (i = 0; i < 64; i++) 
-		writebyte(((unsigned char*)qtable_0_chrom)[zig[i]]); // zig-zag order
+		writebyte(ctx, ctx->qtable_0[1][dct_zig[i]]); // zig-zag order
 }
 
-static void write_DHTinfo(void)
+static void write_DHTinfo(jpeg_encoder_ctx_t *const ctx)
 {
-	unsigned i;
-	
-	writeword(0xFFC4); // marker
-	writeword(0x01A2); // length
-
-	writebyte(0); // HTYDCinfo
-	for (i = 0; i < 16; i++) 
-		writebyte(std_dc_luminance_nrcodes[i]);
-	for (i = 0; i < 12; i++) 
-		writebyte(std_dc_luminance_values[i]);
-
-	writebyte(0x10); // HTYACinfo
-	for (i = 0; i < 16; i++)
-		writebyte(std_ac_luminance_nrcodes[i]);
-	for (i = 0; i < 162; i++)
-		writebyte(std_ac_luminance_values[i]);
-	
+	static const unsigned char id[4] = {0x00, 0x10, 0x01, 0x11}; // HTYDC, HTYAC, HTCbDC, HTCbAC
+	unsigned count[4];
+	unsigned length = 2;
+	unsigned t, i;
 
-	writebyte(1); // HTCbDCinfo
-	for (i = 0; i < 16; i++)
-		writebyte(std_dc_chrominance_nrcodes[i]);
-	for (i = 0; i < 12; i++)
-		writebyte(std_dc_chrominance_values[i]);
-	
-	writebyte(0x11); // HTCbACinfo = 0x11;
-	for (i = 0; i < 16; i++)
-		writebyte(std_ac_chrominance_nrcodes[i]);
-	for (i = 0; i < 162; i++)
-		writebyte(std_ac_chrominance_values[i]);
+	for (t = 0; t < 4; t++)
+	{
+		for (count[t] = 0, i = 0; i < 16; i++)
+			count[t] += ctx->dht_bits[t][i];
+
+		length += 1 + 16 + count[t];
+	}
+
+	writeword(ctx, 0xFFC4); // marker
+	writeword(ctx, length); // length
+
+	for (t = 0; t < 4; t++)
+	{
+		writebyte(ctx, id[t]);
+		for (i = 0; i < 16; i++)
+			writebyte(ctx, ctx->dht_bits[t][i]);
+		for (i = 0; i < count[t]; i++)
+			writebyte(ctx, ctx->dht_vals[t][i]);
+	}
+}
+
+/******************************************************************************
+**  build_header
+**  --------------------------------------------------------------------------
+**  Writes SOI and all headers up to SOS into ctx->header, so huffman_start
+**  only has to copy them. Image size in SOF0 is left 0 and its offset is
+**  remembered for patching. The output buffer is kept untouched.
+**  
+**  ARGUMENTS:
+**      ctx     - pointer to encoder context;
+**      interval- restart interval (MCUs), 0 - no DRI;
+**
+**  RETURN: -
+******************************************************************************/
+static void build_header(jpeg_encoder_ctx_t *const ctx, const unsigned interval)
+{
+	unsigned char *const out = ctx->bitbuf.out;
+	unsigned char *const out_end = ctx->out_end;
+	const int overflow = ctx->overflow;
+
+	ctx->bitbuf.out = ctx->header;
+	ctx->out_end = ctx->header + sizeof(ctx->header);
+
+	writeword(ctx, 0xFFD8); // SOI
+	write_APP0info(ctx);
+	write_DQTinfo(ctx);
+	ctx->header_sof = ctx->bitbuf.out - ctx->header + 5; // after marker, length and precision
+	write_SOF0info(ctx, 0, 0);
+	write_DHTinfo(ctx);
+	if (interval)
+		write_DRIinfo(ctx, interval);
+	write_SOSinfo(ctx);
+
+	ctx->header_size = ctx->bitbuf.out - ctx->header;
+	ctx->header_interval = interval;
+
+	ctx->bitbuf.out = out;
+	ctx->out_end = out_end;
+	ctx->overflow = overflow;
+}
+
+/******************************************************************************
+**  emitbyte
+**  --------------------------------------------------------------------------
+**  Write entropy-coded byte into output buffer without any checks.
+**  0x00 is always written after the byte but kept only if the byte is 0xFF,
+**  so byte stuffing needs no branch. Space must be reserved by
+**  huffman_mcu_begin, including one spare byte.
+**  
+**  ARGUMENTS:
+**      pbb     - pointer to bit-buffer context;
+**      b       - byte;
+**
+**  RETURN: -
+******************************************************************************/
+static inline void emitbyte(bitbuffer_t *const pbb, const unsigned char b)
+{
+	unsigned char *const out = pbb->out;
+
+	out[0] = b;
+	out[1] = 0;
+	pbb->out = out + 1 + (b == 0xFF);
 }
 
 /******************************************************************************
@@ -492,6 +385,8 @@ static void write_DHTinfo(void)
 **  --------------------------------------------------------------------------
 **  Write bits into bit-buffer.
 **  If the number of bits exceeds 16 the result is unpredictable.
+**  Less than 16 bits are kept in the buffer between calls, so the 32-bit
+**  accumulator never overflows and at most one pair of bytes is written.
 **  
 **  ARGUMENTS:
 **      pbb     - pointer to bit-buffer context;
@@ -500,7 +395,7 @@ static void write_DHTinfo(void)
 **
 **  RETURN: -
 ******************************************************************************/
-static void writebits(bitbuffer_t *const pbb, unsigned bits, unsigned nbits)
+static inline void writebits(bitbuffer_t *const pbb, unsigned bits, unsigned nbits)
 {
 	// shift old bits to the left, add new to the right
 	pbb->buf = (pbb->buf << nbits) | (bits & ((1 << nbits)-1));
@@ -508,18 +403,12 @@ static void writebits(bitbuffer_t *const pbb, unsigned bits, unsigned nbits)
 	// new number of bits
 	nbits += pbb->n;
 
-	// flush whole bytes
-	while (nbits >= 8)
+	// flush two whole bytes
+	if (nbits >= 16)
 	{
-		unsigned char b;
-
-		nbits -= 8;
-		b = pbb->buf >> nbits;
-
-		writebyte(b);
-
-		if (b == 0xFF)
-			writebyte(0); // add 0x00 after 0xFF
+		nbits -= 16;
+		emitbyte(pbb, (unsigned char)(pbb->buf >> (nbits + 8)));
+		emitbyte(pbb, (unsigned char)(pbb->buf >> nbits));
 	}
 
 	// remember how many bits is remained
@@ -529,19 +418,39 @@ static void writebits(bitbuffer_t *const pbb, unsigned bits, unsigned nbits)
 /******************************************************************************
 **  flushbits
 **  --------------------------------------------------------------------------
-**  Flush bits into bit-buffer.
+**  Flush bits from bit-buffer.
 **  If there is not an integer number of bytes in bit-buffer - add 1-s
 **  and write these bytes.
 **  
 **  ARGUMENTS:
-**      pbb     - pointer to bit-buffer context;
+**      ctx     - pointer to encoder context, owns the bit-buffer;
 **
 **  RETURN: -
 ******************************************************************************/
-static void flushbits(bitbuffer_t *pbb)
+static void flushbits(jpeg_encoder_ctx_t *const ctx)
 {
-	if (pbb->n)
-		writebits(pbb, 0xFF, 8 - pbb->n);
+	bitbuffer_t *const pbb = &ctx->bitbuf;
+
+	if (pbb->n & 7)
+	{
+		const unsigned pad = 8 - (pbb->n & 7);
+
+		pbb->buf = (pbb->buf << pad) | ((1 << pad)-1);
+		pbb->n += pad;
+	}
+
+	while (pbb->n)
+	{
+		unsigned char b;
+
+		pbb->n -= 8;
+		b = pbb->buf >> pbb->n;
+
+		writebyte(ctx, b);
+
+		if (b == 0xFF)
+			writebyte(ctx, 0); // add 0x00 after 0xFF
+	}
 }
 
 /******************************************************************************
@@ -574,116 +483,815 @@ static unsigned huffman_bits(const short value)
 ******************************************************************************/
 static unsigned huffman_magnitude(const short value)
 {
-	unsigned x = (value < 0)? -value: value;
-	unsigned m = 0;
+	const unsigned x = (value < 0)? -value: value;
+
+	return x ? 32 - __builtin_clz(x): 0; // NSAU on Xtensa
+}
+
+/******************************************************************************
+**  huffman_build_lut
+**  --------------------------------------------------------------------------
+**  Generates Huffman codes from a DHT-style table specification (number of
+**  codes of each length and symbols in code order, JPEG Annex C) and packs
+**  them into a lookup table indexed by symbol: (length << 16) | code.
+**  For AC tables the symbol is (run << 4) | size, so ZRL is 0xF0 and EOB 0.
+**  
+**  ARGUMENTS:
+**      lut     - lookup table, 256 entries for AC or 16 for DC;
+**      nrcodes - number of codes of length 1..16;
+**      values  - symbols;
+**
+**  RETURN: -
+******************************************************************************/
+static void huffman_build_lut(unsigned *const lut, const unsigned char nrcodes[16], const unsigned char *values)
+{
+	unsigned code = 0;
+	unsigned len, i;
+
+	for (len = 1; len <= 16; len++)
+	{
+		for (i = 0; i < nrcodes[len-1]; i++)
+			lut[*values++] = (len << 16) | code++;
+
+		code <<= 1;
+	}
+}
+
+/******************************************************************************
+**  huffman_load_tables
+**  --------------------------------------------------------------------------
+**  Generates code lookup tables from the DHT specification held by context
+**  and marks cached headers stale, so the new DHT is written.
+**  
+**  ARGUMENTS:
+**      ctx     - pointer to encoder context;
+**
+**  RETURN: -
+******************************************************************************/
+static void huffman_load_tables(jpeg_encoder_ctx_t *const ctx)
+{
+	unsigned c;
+
+	memset(ctx->huff_dc, 0, sizeof(ctx->huff_dc));
+	memset(ctx->huff_ac, 0, sizeof(ctx->huff_ac));
+
+	for (c = 0; c < 2; c++)
+	{
+		huffman_build_lut(ctx->huff_dc[c], ctx->dht_bits[2*c], ctx->dht_vals[2*c]);
+		huffman_build_lut(ctx->huff_ac[c], ctx->dht_bits[2*c + 1], ctx->dht_vals[2*c + 1]);
+	}
+
+	ctx->header_size = 0; // DHT changed
+}
 
-	while (x >> m) ++m;
+/******************************************************************************
+**  huffman_symbol_valid
+**  --------------------------------------------------------------------------
+**  Tells whether a symbol can occur in baseline code-stream, each of them
+**  must have a code in optimized tables.
+**  
+**  ARGUMENTS:
+**      t       - table, 0 - DC lum, 1 - AC lum, 2 - DC chrom, 3 - AC chrom;
+**      sym     - symbol;
+**
+**  RETURN: non-zero if valid
+******************************************************************************/
+static int huffman_symbol_valid(const unsigned t, const unsigned sym)
+{
+	if (!(t & 1))
+		return sym < 12; // DC: size 0..11
 
-	return m;
+	return sym == 0x00 || sym == 0xF0 || ((sym & 15) >= 1 && (sym & 15) <= 10); // EOB, ZRL, run/size
+}
+
+/******************************************************************************
+**  huffman_optimal_table
+**  --------------------------------------------------------------------------
+**  Builds optimal DHT specification from symbol frequencies, JPEG Annex K.2:
+**  code sizes by Huffman's algorithm, limited to 16 bits, with a reserved
+**  symbol so no code is all 1-s. Every valid symbol gets a code, even if
+**  it did not occur, as the table is used for the following frames.
+**  Frequencies are destroyed.
+**  
+**  ARGUMENTS:
+**      ctx     - pointer to encoder context, provides scratch memory;
+**      t       - table to build;
+**
+**  RETURN: -
+******************************************************************************/
+static void huffman_optimal_table(jpeg_encoder_ctx_t *const ctx, const unsigned t)
+{
+	unsigned *const freq = ctx->huff_freq[t];
+	unsigned char *const codesize = ctx->huff_codesize;
+	short *const others = ctx->huff_others;
+	unsigned char bits[33];
+	unsigned max = 0, shift = 0;
+	unsigned i, j, p;
+
+	// scale down so the longest code before limiting fits 32 bits
+	for (i = 0; i < 256; i++)
+		if (freq[i] > max) max = freq[i];
+	while ((max >> shift) >= (1 << 14))
+		shift++;
+
+	for (i = 0; i < 256; i++)
+		freq[i] = huffman_symbol_valid(t, i)? (freq[i] >> shift) + 1: 0;
+	freq[256] = 1; // reserved
+
+	memset(codesize, 0, 257);
+	for (i = 0; i < 257; i++)
+		others[i] = -1;
+
+	for (;;)
+	{
+		int c1 = -1, c2 = -1;
+		unsigned v;
+
+		// two least frequent symbols, c1 - the least
+		for (v = ~0u, i = 0; i < 257; i++)
+			if (freq[i] && freq[i] <= v) { v = freq[i]; c1 = i; }
+		for (v = ~0u, i = 0; i < 257; i++)
+			if (freq[i] && freq[i] <= v && (int)i != c1) { v = freq[i]; c2 = i; }
+
+		if (c2 < 0)
+			break;
+
+		// merge c2 into c1, one bit longer codes for both branches
+		freq[c1] += freq[c2];
+		freq[c2] = 0;
+
+		codesize[c1]++;
+		while (others[c1] >= 0) { c1 = others[c1]; codesize[c1]++; }
+		others[c1] = c2;
+
+		codesize[c2]++;
+		while (others[c2] >= 0) { c2 = others[c2]; codesize[c2]++; }
+	}
+
+	memset(bits, 0, sizeof(bits));
+	for (i = 0; i < 257; i++)
+		if (codesize[i]) bits[codesize[i]]++;
+
+	// limit code length to 16 bits
+	for (i = 32; i > 16; i--)
+	{
+		while (bits[i] > 0)
+		{
+			j = i - 2;
+			while (bits[j] == 0) j--;
+
+			bits[i] -= 2;
+			bits[i-1]++;
+			bits[j+1] += 2;
+			bits[j]--;
+		}
+	}
+
+	// drop the reserved symbol, it has the longest code
+	while (bits[i] == 0) i--;
+	bits[i]--;
+
+	memcpy(ctx->dht_bits[t], bits + 1, 16);
+
+	for (p = 0, i = 1; i <= 32; i++)
+		for (j = 0; j < 256; j++)
+			if (codesize[j] == i) ctx->dht_vals[t][p++] = j;
+}
+
+/******************************************************************************
+**  huffman_tables_default
+**  --------------------------------------------------------------------------
+**  Selects Huffman tables from JPEG standard (Annex K.3).
+**  
+**  ARGUMENTS:
+**      ctx     - pointer to encoder context;
+**
+**  RETURN: -
+******************************************************************************/
+void huffman_tables_default(jpeg_encoder_ctx_t *const ctx)
+{
+	memcpy(ctx->dht_bits[0], std_dc_luminance_nrcodes, 16);
+	memcpy(ctx->dht_vals[0], std_dc_luminance_values, 12);
+	memcpy(ctx->dht_bits[1], std_ac_luminance_nrcodes, 16);
+	memcpy(ctx->dht_vals[1], std_ac_luminance_values, 162);
+	memcpy(ctx->dht_bits[2], std_dc_chrominance_nrcodes, 16);
+	memcpy(ctx->dht_vals[2], std_dc_chrominance_values, 12);
+	memcpy(ctx->dht_bits[3], std_ac_chrominance_nrcodes, 16);
+	memcpy(ctx->dht_vals[3], std_ac_chrominance_values, 162);
+
+	huffman_load_tables(ctx);
+}
+
+/******************************************************************************
+**  huffman_stats_enable
+**  --------------------------------------------------------------------------
+**  Starts or stops gathering symbol statistics in huffman_encode, used to
+**  build optimized tables. Clears statistics gathered so far.
+**  
+**  ARGUMENTS:
+**      ctx     - pointer to encoder context;
+**      enable  - non-zero to gather statistics;
+**
+**  RETURN: -
+******************************************************************************/
+void huffman_stats_enable(jpeg_encoder_ctx_t *const ctx, const int enable)
+{
+	unsigned i;
+
+	memset(ctx->huff_freq, 0, sizeof(ctx->huff_freq));
+
+	for (i = 0; i < 3; i++)
+	{
+		ctx->huffman[i].dcfreq = enable? ctx->huff_freq[2*(i != 0)]: 0;
+		ctx->huffman[i].acfreq = enable? ctx->huff_freq[2*(i != 0) + 1]: 0;
+	}
+}
+
+/******************************************************************************
+**  huffman_tables_optimize
+**  --------------------------------------------------------------------------
+**  Replaces Huffman tables by the optimal ones for the statistics gathered
+**  since the last call (see huffman_stats_enable) and clears statistics.
+**  Takes effect from the next huffman_start, tables must not be changed
+**  while a frame is being encoded.
+**  
+**  ARGUMENTS:
+**      ctx     - pointer to encoder context;
+**
+**  RETURN: -
+******************************************************************************/
+void huffman_tables_optimize(jpeg_encoder_ctx_t *const ctx)
+{
+	unsigned t;
+
+	for (t = 0; t < 4; t++)
+		huffman_optimal_table(ctx, t);
+
+	huffman_load_tables(ctx);
+	memset(ctx->huff_freq, 0, sizeof(ctx->huff_freq));
+}
+
+/******************************************************************************
+**  jpeg_encoder_ctx_init
+**  --------------------------------------------------------------------------
+**  Initializes encoder context with standard Huffman tables and quantization
+**  tables of JPEG_QUALITY_DEFAULT.
+**  Must be called once before the context is used for the first time.
+**  
+**  ARGUMENTS:
+**      ctx     - pointer to encoder context;
+**
+**  RETURN: -
+******************************************************************************/
+void jpeg_encoder_ctx_init(jpeg_encoder_ctx_t *const ctx)
+{
+	unsigned i;
+
+	for (i = 0; i < 3; i++)
+	{
+		ctx->huffman[i].dclut = ctx->huff_dc[i != 0];
+		ctx->huffman[i].aclut = ctx->huff_ac[i != 0];
+		ctx->huffman[i].dcfreq = 0;
+		ctx->huffman[i].acfreq = 0;
+		ctx->huffman[i].counts = 0;
+		ctx->huffman[i].dc = 0;
+	}
+
+	ctx->header_interval = 0;
+	huffman_tables_default(ctx);
+	ctx->huff_opt_period = 0;
+	ctx->huff_opt_frames = 0;
+	ctx->stats = 0;
+	ctx->replenish = 0;
+
+	ctx->quality = 0;
+	jpeg_encoder_set_quality(ctx, JPEG_QUALITY_DEFAULT);
+	ctx->rc_quality_max = JPEG_QUALITY_DEFAULT;
+	ctx->rc_target_size = 0;
+
+	ctx->bitbuf.buf = 0;
+	ctx->bitbuf.n = 0;
+	ctx->restart_rows = 0;
+	ctx->restart_count = 0;
+	ctx->colorspace = YUV420;
+	ctx->roi_map = 0;
+	ctx->roi_map_cols = 0;
+	ctx->roi_map_rows = 0;
+
+	huffman_set_sink(ctx, 0, 0);
+	huffman_set_output(ctx, 0, 0);
+}
+
+/******************************************************************************
+**  jpeg_encoder_ctx_share_tables
+**  --------------------------------------------------------------------------
+**  Makes context encode with the same tables, restart interval and ROI map
+**  as another one, so both can produce parts of the same code-stream.
+**  
+**  ARGUMENTS:
+**      ctx     - pointer to encoder context to set up;
+**      src     - pointer to encoder context which wrote the headers;
+**
+**  RETURN: -
+******************************************************************************/
+void jpeg_encoder_ctx_share_tables(jpeg_encoder_ctx_t *const ctx, const jpeg_encoder_ctx_t *const src)
+{
+	unsigned i;
+
+	for (i = 0; i < 3; i++)
+	{
+		huffman_counts_t *const counts = ctx->huffman[i].counts;
+
+		ctx->huffman[i] = src->huffman[i];
+		// statistics are gathered by the context which owns the tables only,
+		// block counts by every context for its own blocks
+		ctx->huffman[i].dcfreq = 0;
+		ctx->huffman[i].acfreq = 0;
+		ctx->huffman[i].counts = counts;
+	}
+
+	ctx->restart_rows = src->restart_rows;
+	ctx->colorspace = src->colorspace;
+	ctx->roi_map = src->roi_map;
+	ctx->roi_map_cols = src->roi_map_cols;
+	ctx->roi_map_rows = src->roi_map_rows;
+}
+
+/******************************************************************************
+**  jpeg_encoder_set_colorspace
+**  --------------------------------------------------------------------------
+**  Selects sampling of the code-stream: YUV420 (H2V2), YUV422 (H2V1) or
+**  YUV400 (Y only). It sets the MCU size, so restart intervals and the
+**  blocks the application passes to huffman_encode follow it.
+**  
+**  ARGUMENTS:
+**      ctx        - pointer to encoder context;
+**      colorspace - output colorspace;
+**
+**  RETURN: -
+******************************************************************************/
+void jpeg_encoder_set_colorspace(jpeg_encoder_ctx_t *const ctx, const colorspace_t colorspace)
+{
+	if (colorspace != ctx->colorspace)
+		ctx->header_size = 0; // SOF0 and SOS changed
+
+	ctx->colorspace = colorspace;
+}
+
+/******************************************************************************
+**  jpeg_encoder_set_quality
+**  --------------------------------------------------------------------------
+**  Scales the standard quantization tables by quality factor the same way
+**  IJG libjpeg does (50 - standard tables, 100 - all ones) and rebuilds
+**  reciprocals used by dct_quantize. Quality 75 gives the Paint tables this
+**  encoder used to have built in.
+**  Takes effect from the next huffman_start, tables must not be changed
+**  while a frame is being encoded.
+**  
+**  ARGUMENTS:
+**      ctx     - pointer to encoder context;
+**      quality - quality factor, clamped to 1..100;
+**
+**  RETURN: -
+******************************************************************************/
+void jpeg_encoder_set_quality(jpeg_encoder_ctx_t *const ctx, int quality)
+{
+	static const unsigned char *const qtable_std[2] = {qtable_std_lum, qtable_std_chrom};
+	unsigned t, i;
+	int scale;
+
+	if (quality < JPEG_QUALITY_MIN) quality = JPEG_QUALITY_MIN;
+	if (quality > JPEG_QUALITY_MAX) quality = JPEG_QUALITY_MAX;
+
+	if (quality == ctx->quality)
+		return;
+
+	scale = (quality < 50)? 5000/quality: 200 - 2*quality;
+
+	for (t = 0; t < 2; t++)
+	{
+		for (i = 0; i < 64; i++)
+		{
+			int q = (qtable_std[t][i]*scale + 50) / 100;
+
+			if (q < 1) q = 1;
+			if (q > 255) q = 255;
+
+			ctx->qtable_0[t][i] = q;
+		}
+
+		dct_qtable_init(&ctx->qtable[t], ctx->qtable_0[t]);
+	}
+
+	ctx->quality = quality;
+	ctx->header_size = 0; // DQT changed
+	ctx->huffman[0].qtable = &ctx->qtable[0];
+	ctx->huffman[1].qtable = &ctx->qtable[1];
+	ctx->huffman[2].qtable = &ctx->qtable[1];
+}
+
+/******************************************************************************
+**  huffman_set_output
+**  --------------------------------------------------------------------------
+**  Sets the buffer the code-stream is written into and clears overflow flag.
+**  
+**  ARGUMENTS:
+**      ctx     - pointer to encoder context;
+**      buf     - output buffer;
+**      size    - output buffer size (bytes);
+**
+**  RETURN: -
+******************************************************************************/
+void huffman_set_output(jpeg_encoder_ctx_t *const ctx, unsigned char *const buf, const unsigned size)
+{
+	ctx->out_start = buf;
+	ctx->out_end = buf + size;
+	ctx->bitbuf.out = buf;
+	ctx->spill_dst = 0;
+	ctx->out_flushed = 0;
+	ctx->overflow = 0;
+}
+
+/******************************************************************************
+**  huffman_output_size
+**  --------------------------------------------------------------------------
+**  Returns number of bytes written so far, including the ones already
+**  handed to the sink.
+**  
+**  ARGUMENTS:
+**      ctx     - pointer to encoder context;
+**
+**  RETURN: code-stream size (bytes)
+******************************************************************************/
+unsigned huffman_output_size(const jpeg_encoder_ctx_t *const ctx)
+{
+	return ctx->out_flushed + (ctx->bitbuf.out - ctx->out_start);
+}
+
+/******************************************************************************
+**  huffman_set_sink
+**  --------------------------------------------------------------------------
+**  Sets the sink full output buffers are handed to, see huffman_sink_t.
+**  With a sink the output buffer may be set to 0, the sink then gives the
+**  first buffer too.
+**  
+**  ARGUMENTS:
+**      ctx     - pointer to encoder context;
+**      sink    - output sink, 0 - none;
+**      arg     - passed to the sink;
+**
+**  RETURN: -
+******************************************************************************/
+void huffman_set_sink(jpeg_encoder_ctx_t *const ctx, const huffman_sink_t sink, void *const arg)
+{
+	ctx->sink = sink;
+	ctx->sink_arg = arg;
+}
+
+/******************************************************************************
+**  huffman_output_flush
+**  --------------------------------------------------------------------------
+**  Hands the last buffer of the frame to the sink, after huffman_stop or
+**  when the frame is abandoned (ctx->overflow is set). Does nothing
+**  without a sink.
+**  
+**  ARGUMENTS:
+**      ctx     - pointer to encoder context;
+**
+**  RETURN: -
+******************************************************************************/
+void huffman_output_flush(jpeg_encoder_ctx_t *const ctx)
+{
+	unsigned size = 0;
+
+	if (!ctx->sink)
+		return;
+
+	ctx->sink(ctx->sink_arg, ctx->out_start, ctx->bitbuf.out - ctx->out_start, ctx->overflow? -1: 1, &size);
+
+	ctx->out_flushed += ctx->bitbuf.out - ctx->out_start;
+	ctx->out_start = ctx->out_end = ctx->bitbuf.out = 0;
 }
 
 /******************************************************************************
 **  huffman_start
 **  --------------------------------------------------------------------------
 **  Starts Huffman encoding by writing Start of Image (SOI) and all headers.
-**  Sets image size in Start of File (SOF) header before writing it.
+**  Headers are copied from the template built when quality or restart
+**  interval changed, only image size in Start of File (SOF) is patched.
 **  
 **  ARGUMENTS:
+**      ctx     - pointer to encoder context;
 **      height  - image height (pixels);
 **      width   - image width (pixels);
 **
 **  RETURN: -
 ******************************************************************************/
-void huffman_start(short height, short width)
+void huffman_start(jpeg_encoder_ctx_t *const ctx, short height, short width)
+{
+	const unsigned mcu_width = JPEG_MCU_WIDTH(ctx->colorspace);
+	const unsigned interval = ctx->restart_rows * ((width + mcu_width - 1) / mcu_width);
+
+	const unsigned char dims[4] = {height >> 8, height, width >> 8, width};
+	unsigned char *out;
+	unsigned i;
+
+	ctx->bitbuf.n = 0;
+	ctx->restart_count = 0;
+
+	if (!ctx->header_size || ctx->header_interval != interval)
+		build_header(ctx, interval);
+
+	// a sink gives the first buffer of the frame
+	if (ctx->sink && !ctx->out_start)
+		huffman_output_next(ctx);
+
+	out = ctx->bitbuf.out;
+
+	if (out + ctx->header_size <= ctx->out_end)
+	{
+		memcpy(out, ctx->header, ctx->header_size);
+		memcpy(out + ctx->header_sof, dims, 4);
+		ctx->bitbuf.out = out + ctx->header_size;
+	}
+	else // across buffers of the sink, or overflows
+		for (i = 0; i < ctx->header_size; i++)
+			writebyte(ctx, (i - ctx->header_sof < 4)? dims[i - ctx->header_sof]: ctx->header[i]);
+
+	ctx->huffman[2].dc = 
+	ctx->huffman[1].dc = 
+	ctx->huffman[0].dc = 0;
+}
+
+/******************************************************************************
+**  huffman_header
+**  --------------------------------------------------------------------------
+**  Returns headers cached by the last huffman_start. Image height and
+**  width in SOF0 are left 0, every frame patches them in its own copy.
+**  
+**  ARGUMENTS:
+**      ctx     - pointer to encoder context;
+**      size    - receives header size (bytes), 0 if there is none yet;
+**
+**  RETURN: pointer to headers, from SOI to SOS
+******************************************************************************/
+const unsigned char *huffman_header(const jpeg_encoder_ctx_t *const ctx, unsigned *const size)
+{
+	*size = ctx->header_size;
+	return ctx->header;
+}
+
+/******************************************************************************
+**  huffman_restart
+**  --------------------------------------------------------------------------
+**  Ends the current restart interval: flushes bit-buffer, writes next
+**  Restart (RSTn) marker and resets DC predictors, so the following
+**  interval can be decoded independently from the previous ones.
+**  
+**  ARGUMENTS:
+**      ctx     - pointer to encoder context;
+**
+**  RETURN: -
+******************************************************************************/
+void huffman_restart(jpeg_encoder_ctx_t *const ctx)
 {
-	bitbuf.n = 0;
+	flushbits(ctx);
+	writeword(ctx, 0xFFD0 + (ctx->restart_count++ & 7)); // RSTn
+
+	ctx->huffman[2].dc = 
+	ctx->huffman[1].dc = 
+	ctx->huffman[0].dc = 0;
+}
 
-	writeword(0xFFD8); // SOI
-	write_APP0info();
-	write_DQTinfo();
-	write_SOF0info(height, width);
-	write_DHTinfo();
-	write_SOSinfo();
+/******************************************************************************
+**  huffman_segment_begin
+**  --------------------------------------------------------------------------
+**  Starts encoding of a run of restart intervals without writing headers,
+**  used when one frame is split between several encoder contexts.
+**  
+**  ARGUMENTS:
+**      ctx           - pointer to encoder context;
+**      restart_count - index of the first restart interval of the run;
+**
+**  RETURN: -
+******************************************************************************/
+void huffman_segment_begin(jpeg_encoder_ctx_t *const ctx, unsigned restart_count)
+{
+	ctx->bitbuf.n = 0;
+	ctx->restart_count = restart_count;
 
-	huffman_ctx[2].dc = 
-	huffman_ctx[1].dc = 
-	huffman_ctx[0].dc = 0;
+	ctx->huffman[2].dc = 
+	ctx->huffman[1].dc = 
+	ctx->huffman[0].dc = 0;
+}
+
+/******************************************************************************
+**  huffman_segment_end
+**  --------------------------------------------------------------------------
+**  Flushes bit-buffer and output buffer without writing End of Image (EOI).
+**  
+**  ARGUMENTS:
+**      ctx     - pointer to encoder context;
+**
+**  RETURN: -
+******************************************************************************/
+void huffman_segment_end(jpeg_encoder_ctx_t *const ctx)
+{
+	flushbits(ctx);
+}
+
+/******************************************************************************
+**  huffman_stripe_begin
+**  --------------------------------------------------------------------------
+**  Starts a stripe of a partial frame, used for conditional replenishment.
+**  A partial frame has no headers: it is a run of stripes coded with the
+**  tables of the last complete frame, each replacing one of its restart
+**  intervals, ended by huffman_stop. Flushes the previous stripe, writes
+**  the stripe marker (JPEG_MARKER_STRIPE) with the index of the restart
+**  interval and resets DC predictors.
+**  
+**  ARGUMENTS:
+**      ctx     - pointer to encoder context;
+**      stripe  - index of the restart interval in the frame;
+**
+**  RETURN: -
+******************************************************************************/
+void huffman_stripe_begin(jpeg_encoder_ctx_t *const ctx, const unsigned stripe)
+{
+	flushbits(ctx);
+	writeword(ctx, JPEG_MARKER_STRIPE);
+	writeword(ctx, stripe);
+
+	ctx->huffman[2].dc = 
+	ctx->huffman[1].dc = 
+	ctx->huffman[0].dc = 0;
 }
 
 /******************************************************************************
 **  huffman_stop
 **  --------------------------------------------------------------------------
-**  Finalize Huffman encoding by flushing bit-buffer, writing End of Image (EOI)
-**  into output buffer and flusing this buffer.
+**  Finalize Huffman encoding by flushing bit-buffer and writing End of Image
+**  (EOI) into output buffer.
 **  
-**  ARGUMENTS: -
+**  ARGUMENTS:
+**      ctx     - pointer to encoder context;
 **
 **  RETURN: -
 ******************************************************************************/
-void huffman_stop(void)
+void huffman_stop(jpeg_encoder_ctx_t *const ctx)
 {
-	flushbits(&bitbuf);
-	writeword(0xFFD9); // EOI - End of Image
-	write_jpeg(jpgbuff, jpgn);
-	jpgn = 0;
+	flushbits(ctx);
+	writeword(ctx, 0xFFD9); // EOI - End of Image
+}
+
+/******************************************************************************
+**  huffman_mcu_begin
+**  --------------------------------------------------------------------------
+**  Reserves output space for one MCU, so huffman_encode can write without
+**  checking bounds. Near the end of output buffer the MCU is encoded into
+**  ctx->spill[] instead and copied by huffman_mcu_end.
+**  
+**  ARGUMENTS:
+**      ctx     - pointer to encoder context;
+**      blocks  - number of 8x8 blocks in MCU, up to HUFFMAN_MCU_BLOCKS_MAX;
+**
+**  RETURN: -
+******************************************************************************/
+void huffman_mcu_begin(jpeg_encoder_ctx_t *const ctx, const unsigned blocks)
+{
+	if ((unsigned)(ctx->out_end - ctx->bitbuf.out) < blocks * HUFFMAN_BLOCK_BYTES_MAX + 2)
+	{
+		ctx->spill_dst = ctx->bitbuf.out;
+		ctx->bitbuf.out = ctx->spill;
+	}
+}
+
+/******************************************************************************
+**  huffman_mcu_end
+**  --------------------------------------------------------------------------
+**  Finishes MCU started by huffman_mcu_begin. Copies spilled MCU into output
+**  buffer, continuing in the next buffers of the sink if there is one.
+**  Sets ctx->overflow if it does not fit.
+**  
+**  ARGUMENTS:
+**      ctx     - pointer to encoder context;
+**
+**  RETURN: -
+******************************************************************************/
+void huffman_mcu_end(jpeg_encoder_ctx_t *const ctx)
+{
+	if (ctx->spill_dst)
+	{
+		const unsigned char *src = ctx->spill;
+		unsigned size = ctx->bitbuf.out - ctx->spill;
+
+		ctx->bitbuf.out = ctx->spill_dst;
+		ctx->spill_dst = 0;
+
+		for (;;)
+		{
+			const unsigned room = ctx->out_end - ctx->bitbuf.out;
+			const unsigned n = (size < room)? size: room;
+
+			if (n)
+				memcpy(ctx->bitbuf.out, src, n);
+			ctx->bitbuf.out += n;
+			src += n;
+			size -= n;
+
+			if (!size)
+				break;
+
+			if (!huffman_output_next(ctx)) {
+				ctx->overflow = 1;
+				break;
+			}
+		}
+	}
 }
 
 /******************************************************************************
 **  huffman_encode
 **  --------------------------------------------------------------------------
-**  Quantize and Encode a 8x8 DCT block by JPEG Huffman lossless coding.
-**  This function writes encoded bit-stream into bit-buffer.
+**  Encode a quantized 8x8 DCT block by JPEG Huffman lossless coding.
+**  This function writes encoded bit-stream into bit-buffer and, if the
+**  component has counts, adds the block to them.
 **  
 **  ARGUMENTS:
 **      ctx     - pointer to encoder context;
-**      data    - pointer to 8x8 DCT block;
+**      hctx    - pointer to Huffman context of the block component;
+**      data    - 64 quantized coefficients in zig-zag order (dct_quantize);
+**      last    - zig-zag index of the last non-zero AC coefficient, 0 if none;
 **
 **  RETURN: -
 ******************************************************************************/
-void huffman_encode(huffman_t *const ctx, const short data[])
+void huffman_encode(jpeg_encoder_ctx_t *const ctx, huffman_t *const hctx, const short data[64], const unsigned last)
 {
-	unsigned magn, bits;
+	bitbuffer_t bb = ctx->bitbuf; // local copy stays in registers
+	const unsigned *const aclut = hctx->aclut;
+	unsigned *const acfreq = hctx->acfreq; // 0 - no statistics
+	unsigned magn, code;
 	unsigned zerorun, i;
+	unsigned nonzero = 0, zrl = 0;
 	short    diff;
 
-	short  dc = quantize(data[0], ctx->qtable[0]);
+	short  dc = data[0];
 	// difference between new and old DC
-	diff = dc - ctx->dc;
-	ctx->dc = dc; // remember DC
+	diff = dc - hctx->dc;
+	hctx->dc = dc; // remember DC
 
-	bits = huffman_bits(diff); // VLI
 	magn = huffman_magnitude(diff); // VLI length
+	code = hctx->dclut[magn];
+	if (hctx->dcfreq) hctx->dcfreq[magn]++;
 
 	// encode VLI length
-	writebits(&bitbuf, ctx->hdcbit[magn], ctx->hdclen[magn]);
+	writebits(&bb, code, code >> 16);
 	// encode VLI itself
-	writebits(&bitbuf, bits, magn);
+	writebits(&bb, huffman_bits(diff), magn);
 
-	for (zerorun = 0, i = 1; i < 64; i++)
+	// coefficients after the last non-zero one are all covered by EOB
+	for (zerorun = 0, i = 1; i <= last; i++)
 	{
-		const unsigned char zi = zig[i]; // zig-zag index
-		const short ac = quantize(data[zi], ctx->qtable[zi]);
+		const short ac = data[i];
 
 		if (ac)
 		{
 			while (zerorun >= 16) {
 				zerorun -= 16;
 				// ZRL
-				writebits(&bitbuf, ctx->hacbit[15][0], ctx->haclen[15][0]);
+				writebits(&bb, aclut[0xF0], aclut[0xF0] >> 16);
+				if (acfreq) acfreq[0xF0]++;
+				zrl++;
 			}
 
-			bits = huffman_bits(ac);
 			magn = huffman_magnitude(ac);
+			code = aclut[(zerorun << 4) | magn];
+			if (acfreq) acfreq[(zerorun << 4) | magn]++;
 
-			writebits(&bitbuf, ctx->hacbit[zerorun][magn], ctx->haclen[zerorun][magn]);
-			writebits(&bitbuf, bits, magn);
+			writebits(&bb, code, code >> 16);
+			writebits(&bb, huffman_bits(ac), magn);
 
 			zerorun = 0;
+			nonzero++;
 		}
 		else zerorun++;
 	}
 
-	if (zerorun) { // EOB - End Of Block
-		writebits(&bitbuf, ctx->hacbit[0][0], ctx->haclen[0][0]);
+	if (last != 63) { // EOB - End Of Block
+		writebits(&bb, aclut[0x00], aclut[0x00] >> 16);
+		if (acfreq) acfreq[0x00]++;
+	}
+
+	if (hctx->counts)
+	{
+		huffman_counts_t *const counts = hctx->counts;
+
+		// the block is written in one piece, see huffman_mcu_begin
+		counts->bits += (bb.out - ctx->bitbuf.out) * 8 + bb.n - ctx->bitbuf.n;
+		counts->nonzero += nonzero + (dc != 0);
+		counts->eob += (last != 63);
+		counts->zrl += zrl;
 	}
+
+	ctx->bitbuf = bb;
 }
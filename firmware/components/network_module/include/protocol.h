@@ -4,9 +4,10 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include "esp_err.h"
+#include "jpeg.h"
 
 #define PROTOCOL_FRAME_SIZE 			1024
-#define PROTOCOL_HEADER_SIZE			16
+#define PROTOCOL_HEADER_SIZE			48
 #define PROTOCOL_MAX_PAYLOAD_SIZE		((PROTOCOL_FRAME_SIZE)-(PROTOCOL_HEADER_SIZE))
 
 typedef enum
@@ -23,7 +24,8 @@ typedef enum
 {
 	PROTOCOL_CTRL_PKT = 0xF,
 	PROTOCOL_DATA_PKT,
-	PROTOCOL_ERR_PKT
+	PROTOCOL_ERR_PKT,
+	PROTOCOL_PARTIAL_PKT //frame of conditional replenishment, stripes that replace those of the last data frame
 } protocol_pkt_type_t;
 
 typedef enum
@@ -33,9 +35,13 @@ typedef enum
 //	PROTOCOL_CONNECTED,
 	PROTOCOL_STREAM_RQST = 0xF,
 	PROTOCOL_STREAM_STOP,
-	PROTOCOL_STREAM_KEEPALIVE
+	PROTOCOL_STREAM_KEEPALIVE,
+	PROTOCOL_STREAM_RECONFIG //followed by the camera's framesize_t, pixformat_t and frame buffer count (0 - unchanged), one byte each.
+	                         //Only while streaming, the camera replies with PROTOCOL_STREAM_RECONFIG and a protocol_err_t byte
 } protocol_ctrl_payload_t;
 
+#define PROTOCOL_RECONFIG_PAYLOAD_SIZE	4
+
 typedef enum
 {
 	PROTOCOL_EVT_SESSION_STARTED = 0xF,
@@ -59,10 +65,27 @@ typedef union
 		uint8_t pkt_sequence;
 		uint32_t payload_len;
 		int64_t local_timestamp_ms; //only updated for new frame
+		//where the frame comes from, the same in all its packets. Times are us of the camera's clock, relative to capture_us
+		int64_t capture_us;         //VSYNC of the camera frame
+		uint32_t encode_start_us;
+		uint32_t encode_end_us;     //with the packet sink only known in the frame's last packet, 0 before
+		uint32_t send_us;           //first packet of the frame
+		uint32_t frame_seq;         //camera frame sequence number, gaps are frames lost before they were sent
+		uint16_t width;
+		uint16_t height;
+		uint8_t quality;
 	};
 	uint8_t val [PROTOCOL_HEADER_SIZE];
 } protocol_packet_hdr_t;
 
+//packet as it is sent, header followed by up to PROTOCOL_MAX_PAYLOAD_SIZE bytes of payload. total_packets of data packets
+//written by the encoder's output sink is 0 in all but the last packet of a frame, the count is only known once it is encoded
+typedef union
+{
+	protocol_packet_hdr_t hdr;
+	uint8_t val [PROTOCOL_FRAME_SIZE];
+} protocol_packet_t;
+
 //esp_err_t protocol_session_init(protocol_init_t * init);
 //
 //esp_err_t protocol_send_data(void * buf, uint32_t len);
@@ -33,6 +33,10 @@
 #define NETWORK_FSM_QUEUE_LEN		10
 #define NETWORK_SESSION_TIMEOUT_US	(5000000U)
 
+#if CONFIG_JPEG_PACKET_SINK
+#define NETWORK_PACKET_WAIT			(20 / portTICK_PERIOD_MS) //an encoder waits this long for a free packet before giving up the frame
+#endif
+
 /*------------typedefs-------------------*/
 typedef struct
 {
@@ -52,6 +56,19 @@ typedef struct
 	uint8_t * frame_buf;
 } m_protocol_ctrl; //protocol session data
 
+#if CONFIG_JPEG_PACKET_SINK
+typedef struct
+{
+	uint8_t frame_id;
+	uint8_t frame_type;
+	uint8_t pkt_sequence; //of the last packet queued
+	int64_t local_timestamp_ms;
+	int64_t send_us;      //first packet of the frame
+	uint32_t encoder;     //encode task writing into the stream
+	jpeg_frame_info_t info;
+} m_packet_stream; //frame an encode task is writing into packets
+#endif
+
 /*-----------------------------private functions------------------------------*/
 /*-----------Tasks-----------*/
 static void network_data_send_task(void *pvParameter);
@@ -62,7 +79,16 @@ static esp_err_t udp_server_init(void);
 static void udp_server_destroy(void);
 
 /*-------Protocol-mgmt-------*/
-static esp_err_t protocol_send_data(void * buf, uint32_t len);
+#if CONFIG_JPEG_PACKET_SINK
+static esp_err_t protocol_packet_pool_init(void);
+static unsigned char * protocol_packet_sink(void * arg, unsigned char * buf, unsigned size, int last, unsigned * next_size);
+#else
+static esp_err_t protocol_send_data(void * buf, uint32_t len, const jpeg_frame_info_t * info);
+#endif
+static esp_err_t protocol_sendto(const void * buf, uint32_t len);
+static void protocol_reconfigure(const uint8_t * payload);
+static uint8_t protocol_frame_type(const uint8_t * payload, uint32_t len);
+static void protocol_frame_info(protocol_packet_hdr_t * hdr, const jpeg_frame_info_t * info, int64_t send_us);
 int protocol_recv_ctrl(void** buf, struct sockaddr_in * source_addr);
 static void process_network_rcv(uint8_t * packet, int len, struct sockaddr_in * source);
 static void session_timeout_cb(void* arg);
@@ -108,7 +134,20 @@ transition_t protocol_transitions[] = //protocol state transition table
 		}; //TODO: add state handling for if wifi is disconnected
 
 static m_protocol_ctrl session; //protocol session data
+#if CONFIG_JPEG_PACKET_SINK
+//packets are written by the JPEG encoders through protocol_packet_sink() and sent from the pool without copying
+static protocol_packet_t packet_pool[CONFIG_NETWORK_PACKET_POOL_SIZE];
+static m_packet_stream packet_streams[CONFIG_NUM_JPEG_ENCODE_TASKS]; //one per encode task
+
+static QueueHandle_t packet_free_queue;
+static StaticQueue_t packet_free_queue_data;
+static protocol_packet_t * packet_free_queue_buffer[CONFIG_NETWORK_PACKET_POOL_SIZE];
+static QueueHandle_t packet_send_queue; //full packets, in the order they were written
+static StaticQueue_t packet_send_queue_data;
+static protocol_packet_t * packet_send_queue_buffer[CONFIG_NETWORK_PACKET_POOL_SIZE];
+#else
 static uint8_t protocol_frame_buf[PROTOCOL_FRAME_SIZE];
+#endif
 
 SemaphoreHandle_t session_data_mutx = NULL;
 StaticSemaphore_t session_data_mutx_buf;
@@ -156,7 +195,17 @@ esp_err_t network_module_init()
     }
 
 	session.current_frame_id = 0;
+#if CONFIG_JPEG_PACKET_SINK
+	session.frame_buf = NULL;
+
+	ret_val = protocol_packet_pool_init();
+	if (ret_val != ESP_OK)
+	{
+		return ret_val;
+	}
+#else
 	session.frame_buf = protocol_frame_buf;
+#endif
 
 	//initialize wifi stack
 	wifi_init_sta();
@@ -184,6 +233,35 @@ esp_err_t network_module_init()
 	return ret_val;
 }
 
+#if CONFIG_JPEG_PACKET_SINK
+static void network_data_send_task(void *pvParameter)
+{
+	esp_err_t frame_status = ESP_OK; //of the packets sent since the last frame was done
+
+	while(1)
+	{
+		protocol_packet_t * packet = NULL;
+		xQueueReceive(packet_send_queue, (void *) &packet, portMAX_DELAY);
+
+		//packets of a frame that was being encoded when the stream stopped are dropped
+		if (network_fsm.curr_state == STATE_SESSION_STREAMING)
+		{
+			if (protocol_sendto(packet->val, packet->hdr.payload_len + PROTOCOL_HEADER_SIZE) != ESP_OK)
+			{
+				frame_status = ESP_FAIL;
+			}
+
+			if (packet->hdr.total_packets != 0) //last packet of the frame, sent since its first one was
+			{
+				camera_report_send((esp_timer_get_time() - packet->hdr.capture_us - packet->hdr.send_us) / 1000, frame_status);
+				frame_status = ESP_OK;
+			}
+		}
+
+		xQueueSend(packet_free_queue, (void *) &packet, 0); //can't fail, the queue holds the whole pool
+	}
+}
+#else
 static void network_data_send_task(void *pvParameter)
 {
 	while(1)
@@ -198,9 +276,8 @@ static void network_data_send_task(void *pvParameter)
 			vTaskDelay(200/portTICK_PERIOD_MS);
 		}
 
-		void * buf = NULL;
-		uint32_t size = 0;
-		esp_err_t ret_val = camera_get_jpeg(&buf, &size, portMAX_DELAY);
+		frame_t * frame = NULL;
+		esp_err_t ret_val = camera_get_frame(&frame, portMAX_DELAY);
 		if (ret_val != ESP_OK)
 		{
 			ESP_LOGE(TAG, "Frame get error.");
@@ -208,14 +285,15 @@ static void network_data_send_task(void *pvParameter)
 		}
 
 		TickType_t frame_send_time = xTaskGetTickCount();
-		protocol_send_data(buf, size);
+		ret_val = protocol_send_data(frame->data, frame->size, &frame->info);
 		frame_send_time = xTaskGetTickCount() - frame_send_time;
+		camera_report_send(frame_send_time * portTICK_PERIOD_MS, ret_val);
 
 //		ESP_LOGI(TAG, "free DMA-capable heap size: %d, frame send time %d0 ms", heap_caps_get_minimum_free_size(MALLOC_CAP_DMA), frame_send_time);
 
-		//TODO: implement a back off depending on memory availability
+		//back off is done by the camera module's controller (CONFIG_CAMERA_ADAPTIVE), from the reported send time
 //		vTaskDelay(50/portTICK_PERIOD_MS);
-		ret_val = camera_return_jpeg(buf);
+		ret_val = camera_frame_release(frame);
 		if (ret_val != ESP_OK)
 		{
 			ESP_LOGE(TAG, "Frame return error.");
@@ -223,6 +301,7 @@ static void network_data_send_task(void *pvParameter)
 		}
 	}
 }
+#endif
 
 static void network_rcv_task(void *parameters)
 {
@@ -280,7 +359,104 @@ static esp_err_t udp_server_init(void)
 	return ret_val;
 }
 
-static esp_err_t protocol_send_data(void * buf, uint32_t len)
+#if CONFIG_JPEG_PACKET_SINK
+static esp_err_t protocol_packet_pool_init(void)
+{
+	packet_free_queue = xQueueCreateStatic(CONFIG_NETWORK_PACKET_POOL_SIZE, sizeof(protocol_packet_t *), (uint8_t *) packet_free_queue_buffer, &packet_free_queue_data);
+	packet_send_queue = xQueueCreateStatic(CONFIG_NETWORK_PACKET_POOL_SIZE, sizeof(protocol_packet_t *), (uint8_t *) packet_send_queue_buffer, &packet_send_queue_data);
+	if (packet_free_queue == NULL || packet_send_queue == NULL)
+	{
+		return ESP_FAIL;
+	}
+
+	for (uint32_t i = 0; i < CONFIG_NETWORK_PACKET_POOL_SIZE; i ++)
+	{
+		protocol_packet_t * packet = &packet_pool[i];
+		xQueueSend(packet_free_queue, (void *) &packet, 0);
+	}
+
+	for (uint32_t i = 0; i < CONFIG_NUM_JPEG_ENCODE_TASKS; i ++)
+	{
+		packet_streams[i].encoder = i;
+		esp_err_t ret_val = camera_set_jpeg_sink(i, protocol_packet_sink, &packet_streams[i]);
+		if (ret_val != ESP_OK)
+		{
+			return ret_val;
+		}
+	}
+
+	return ESP_OK;
+}
+
+//output sink of an encode task, see huffman_sink_t. Runs in the encode task: each full packet gets its header and is queued
+//for network_data_send_task, then the encoder continues in a free one. The number of packets of a frame is only known when
+//its last packet is written, so total_packets is 0 before that
+static unsigned char * protocol_packet_sink(void * arg, unsigned char * buf, unsigned size, int last, unsigned * next_size)
+{
+	m_packet_stream * stream = (m_packet_stream *) arg;
+	protocol_packet_t * packet = NULL;
+
+	if (buf == NULL && last == 0) //new frame
+	{
+		if (network_fsm.curr_state != STATE_SESSION_STREAMING)
+		{
+			return NULL; //nobody to send it to, the frame isn't encoded
+		}
+
+		xSemaphoreTake(session_data_mutx, portMAX_DELAY);
+		stream->frame_id = session.current_frame_id;
+		session.current_frame_id = (session.current_frame_id + 1) % 255;
+		xSemaphoreGive(session_data_mutx);
+
+		stream->pkt_sequence = 0;
+		stream->local_timestamp_ms = esp_timer_get_time() / 1000;
+		camera_get_frame_info(stream->encoder, &stream->info);
+	}
+	else if (buf != NULL && last < 0) //frame abandoned, packet wasn't sent
+	{
+		packet = (protocol_packet_t *) (buf - PROTOCOL_HEADER_SIZE);
+		xQueueSend(packet_free_queue, (void *) &packet, 0);
+	}
+	else if (buf != NULL)
+	{
+		packet = (protocol_packet_t *) (buf - PROTOCOL_HEADER_SIZE);
+		if (stream->pkt_sequence ++ == 0)
+		{
+			stream->frame_type = protocol_frame_type(buf, size);
+			stream->send_us = esp_timer_get_time();
+		}
+		if (last > 0)
+		{
+			stream->info.encode_end_us = esp_timer_get_time(); //the frame is done once its last packet is written
+		}
+
+		packet->hdr.frame_id = stream->frame_id;
+		packet->hdr.frame_type = stream->frame_type;
+		packet->hdr.total_packets = (last > 0) ? stream->pkt_sequence : 0;
+		packet->hdr.pkt_sequence = stream->pkt_sequence;
+		packet->hdr.payload_len = size;
+		packet->hdr.local_timestamp_ms = stream->local_timestamp_ms;
+		protocol_frame_info(&packet->hdr, &stream->info, stream->send_us);
+
+		xQueueSend(packet_send_queue, (void *) &packet, 0); //can't fail, the queue holds the whole pool
+	}
+
+	if (last != 0)
+	{
+		return NULL;
+	}
+
+	//total_packets is 8 bits, a larger frame is dropped
+	if (stream->pkt_sequence == UINT8_MAX || xQueueReceive(packet_free_queue, (void *) &packet, NETWORK_PACKET_WAIT) != pdTRUE)
+	{
+		return NULL;
+	}
+
+	*next_size = PROTOCOL_MAX_PAYLOAD_SIZE;
+	return packet->val + PROTOCOL_HEADER_SIZE;
+}
+#else
+static esp_err_t protocol_send_data(void * buf, uint32_t len, const jpeg_frame_info_t * info)
 {
 	if (buf == NULL || len == 0)
 		return ESP_ERR_INVALID_ARG;
@@ -292,12 +468,14 @@ static esp_err_t protocol_send_data(void * buf, uint32_t len)
 	}
 
 	protocol_packet_hdr_t packet;
+	memset(&packet, 0, sizeof(packet));
 
 	packet.frame_id = session.current_frame_id;
-	packet.frame_type = PROTOCOL_DATA_PKT;
+	packet.frame_type = protocol_frame_type(buf, len);
 	packet.pkt_sequence = 1;
 	packet.total_packets = (len - 1)/PROTOCOL_MAX_PAYLOAD_SIZE + 1;
 	packet.local_timestamp_ms = esp_timer_get_time() / 1000;
+	protocol_frame_info(&packet, info, esp_timer_get_time());
 
 	uint32_t bytes_remaining = len;
 	uint32_t payload_data_index = 0;
@@ -318,25 +496,7 @@ static esp_err_t protocol_send_data(void * buf, uint32_t len)
 
 //		ret_val = session_udp_client_send(/*payload*/session.frame_buf, /*size*/packet.payload_len + PROTOCOL_HEADER_SIZE);
 
-		if (xSemaphoreTake(socket_mutx, portMAX_DELAY) != pdTRUE)
-		{
-			ESP_LOGE(TAG, "Can't get socket mutx, shouldn't be here");
-			ret_val = ESP_FAIL;
-		}
-		else
-		{
-			int err = sendto(session.server.sock, session.frame_buf, packet.payload_len + PROTOCOL_HEADER_SIZE, 0, (struct sockaddr *)&session.server.remote, sizeof(session.server.remote));
-			if (err < 0) {
-				ret_val = ESP_FAIL;
-				ESP_LOGE(TAG, "Error occurred during sending: errno %d", errno);
-			}
-			else
-			{
-				ESP_LOGI(TAG, "Message sent");
-			}
-		}
-
-		xSemaphoreGive(socket_mutx);
+		ret_val = protocol_sendto(session.frame_buf, packet.payload_len + PROTOCOL_HEADER_SIZE);
 
 		if (ret_val != ESP_OK)
 			break;
@@ -353,6 +513,54 @@ static esp_err_t protocol_send_data(void * buf, uint32_t len)
 
 	return ret_val;
 }
+#endif
+
+//complete frames start with SOI, partial frames of conditional replenishment (CONFIG_JPEG_REPLENISH) with a stripe
+static uint8_t protocol_frame_type(const uint8_t * payload, uint32_t len)
+{
+	return (len >= 2 && payload[0] == 0xFF && payload[1] == 0xD8) ? PROTOCOL_DATA_PKT : PROTOCOL_PARTIAL_PKT;
+}
+
+//frame metadata of the header, times relative to the capture so they fit 32 bits
+static void protocol_frame_info(protocol_packet_hdr_t * hdr, const jpeg_frame_info_t * info, int64_t send_us)
+{
+	hdr->capture_us = info->capture_us;
+	hdr->encode_start_us = info->encode_start_us - info->capture_us;
+	hdr->encode_end_us = (info->encode_end_us != 0) ? info->encode_end_us - info->capture_us : 0;
+	hdr->send_us = send_us - info->capture_us;
+	hdr->frame_seq = info->seq;
+	hdr->width = info->width;
+	hdr->height = info->height;
+	hdr->quality = info->quality;
+}
+
+//sends one packet to the streaming client
+static esp_err_t protocol_sendto(const void * buf, uint32_t len)
+{
+	esp_err_t ret_val = ESP_OK;
+
+	if (xSemaphoreTake(socket_mutx, portMAX_DELAY) != pdTRUE)
+	{
+		ESP_LOGE(TAG, "Can't get socket mutx, shouldn't be here");
+		ret_val = ESP_FAIL;
+	}
+	else
+	{
+		int err = sendto(session.server.sock, buf, len, 0, (struct sockaddr *)&session.server.remote, sizeof(session.server.remote));
+		if (err < 0) {
+			ret_val = ESP_FAIL;
+			ESP_LOGE(TAG, "Error occurred during sending: errno %d", errno);
+		}
+		else
+		{
+			ESP_LOGI(TAG, "Message sent");
+		}
+	}
+
+	xSemaphoreGive(socket_mutx);
+
+	return ret_val;
+}
 
 int protocol_recv_ctrl(void** buf, struct sockaddr_in * source_addr)
 {
@@ -393,6 +601,48 @@ int protocol_recv_ctrl(void** buf, struct sockaddr_in * source_addr)
 	return recv_len;
 }
 
+//runs a reconfiguration the streaming client asked for and replies with a control packet of PROTOCOL_STREAM_RECONFIG and
+//the protocol_err_t result. Blocks the receive task for the frame or two the camera needs, keepalives queued meanwhile
+//are read after and the session timeout is much longer
+static void protocol_reconfigure(const uint8_t * payload)
+{
+	esp_err_t ret_val = camera_reconfigure((framesize_t) payload[1], (pixformat_t) payload[2], payload[3]);
+	if (ret_val != ESP_OK)
+	{
+		ESP_LOGE(TAG, "Camera reconfiguration failed: %x", ret_val);
+	}
+
+	protocol_packet_hdr_t header;
+	memset(&header, 0, sizeof(header));
+	header.frame_type = PROTOCOL_CTRL_PKT;
+	header.pkt_sequence = 1;
+	header.total_packets = 1;
+	header.payload_len = 2;
+	header.local_timestamp_ms = esp_timer_get_time() / 1000;
+
+	uint8_t reply[PROTOCOL_HEADER_SIZE + 2];
+	memcpy(reply, header.val, PROTOCOL_HEADER_SIZE);
+	reply[PROTOCOL_HEADER_SIZE] = PROTOCOL_STREAM_RECONFIG;
+	switch (ret_val)
+	{
+	case ESP_OK:
+		reply[PROTOCOL_HEADER_SIZE + 1] = PROTOCOL_OK;
+		break;
+	case ESP_ERR_INVALID_ARG:
+	case ESP_ERR_NOT_SUPPORTED:
+		reply[PROTOCOL_HEADER_SIZE + 1] = PROTOCOL_ERR_INVALID_ARG;
+		break;
+	case ESP_ERR_NO_MEM:
+		reply[PROTOCOL_HEADER_SIZE + 1] = PROTOCOL_ERR_NO_MEM;
+		break;
+	default:
+		reply[PROTOCOL_HEADER_SIZE + 1] = PROTOCOL_ERR_GENERIC;
+		break;
+	}
+
+	protocol_sendto(reply, sizeof(reply));
+}
+
 static void session_timeout_cb(void* arg)
 {
 	fsm_send_evt(&network_fsm, EVENT_SESSION_TIMEOUT, portMAX_DELAY);
@@ -441,6 +691,11 @@ static void process_network_rcv(uint8_t * packet, int len, struct sockaddr_in *
 			{
 				fsm_send_evt(&network_fsm, EVENT_STREAM_KEEPALIVE, 0);
 			}
+			else if (cmd == PROTOCOL_STREAM_RECONFIG && pkt_header->payload_len >= PROTOCOL_RECONFIG_PAYLOAD_SIZE
+					&& len >= sizeof(protocol_packet_hdr_t) + PROTOCOL_RECONFIG_PAYLOAD_SIZE)
+			{
+				protocol_reconfigure(&packet[sizeof(protocol_packet_hdr_t)]);
+			}
 			break;
 		default:
 			break;
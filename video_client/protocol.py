@@ -6,20 +6,32 @@ import time
 
 
 
+#protocol_packet_hdr_t. Frame metadata times are us of the camera's clock, all but capture_us relative to capture_us
+HEADER = struct.Struct('<BBBBIqqIIIIHHB3x')
+
 class packet:
 	def __init__(self, buffer):
-		header = struct.unpack('<BBBBIq', buffer[0:16])
+		header = HEADER.unpack(buffer[0:HEADER.size])
 		self.frame_id = header[0]
 		self.type = header[1]
 		self.total_packet_number = header[2]
 		self.pkt_sequence = header[3]
 		self.payload_len = header[4]
 		self.transmitter_timestamp = header[5]
-		self.payload = buffer[16:len(buffer)]
+		self.capture_us = header[6]
+		self.encode_start_us = header[7]
+		self.encode_end_us = header[8] #frames encoded straight into packets only carry it in their last packet
+		self.send_us = header[9]
+		self.frame_seq = header[10]
+		self.width = header[11]
+		self.height = header[12]
+		self.quality = header[13]
+		self.payload = buffer[HEADER.size:len(buffer)]
+		self.recv_time = time.time()
 
 class packet_out:
 	def __init__(self, frame_id, pkt_type, total_pkt_number, pkt_sequence, transmitter_timestamp, payload_len, payload):
-		self.buffer = struct.pack('<BBBBIq', frame_id, pkt_type, total_pkt_number, pkt_sequence, payload_len, transmitter_timestamp)
+		self.buffer = HEADER.pack(frame_id, pkt_type, total_pkt_number, pkt_sequence, payload_len, transmitter_timestamp, 0, 0, 0, 0, 0, 0, 0, 0)
 		self.buffer = self.buffer + struct.pack('<B', payload) 
 
 class frame:
@@ -28,6 +40,16 @@ class frame:
 		self.type = pkt.type
 		self.total_packet_number = pkt.total_packet_number
 		self.transmitter_timestamp = pkt.transmitter_timestamp
+		self.capture_us = pkt.capture_us
+		self.encode_start_us = pkt.encode_start_us
+		self.encode_end_us = pkt.encode_end_us
+		self.send_us = pkt.send_us
+		self.seq = pkt.frame_seq
+		self.width = pkt.width
+		self.height = pkt.height
+		self.quality = pkt.quality
+		self.first_recv_time = pkt.recv_time
+		self.last_recv_time = pkt.recv_time
 		self.payload_list = []
 		self.packets_received = 0
 		self.frame_complete = False
@@ -42,15 +64,35 @@ class frame:
 			return False 
 
 	def add_packet(self, pkt):
-		if self.id == pkt.frame_id and self.type == pkt.type and self.transmitter_timestamp == pkt.transmitter_timestamp and self.packets_received != self.total_packet_number:
+		if self.id == pkt.frame_id and self.type == pkt.type and self.transmitter_timestamp == pkt.transmitter_timestamp and not self.frame_complete:
 			self.payload_list.insert(pkt.pkt_sequence - 1, pkt.payload) #pkt sequence is indexed at 1 in current protocol design
 			self.packets_received += 1
+			if pkt.total_packet_number != 0: #frames encoded straight into packets only carry the count in their last packet
+				self.total_packet_number = pkt.total_packet_number
+			if pkt.encode_end_us != 0:
+				self.encode_end_us = pkt.encode_end_us
+			self.first_recv_time = min(self.first_recv_time, pkt.recv_time)
+			self.last_recv_time = max(self.last_recv_time, pkt.recv_time)
 			if self.packets_received == self.total_packet_number:
 				self.signal_frame_ready()
 			return True
 		else:
 			return False
 
+	def latency(self, clock_offset, display_time):
+		#per-stage delays in ms. The clocks aren't synchronized: clock_offset maps camera time to ours assuming the fastest
+		#frame seen took no time on the network, so network and glass-to-glass delays are relative to that frame
+		capture_time = self.capture_us / 1e6 + clock_offset
+		return {
+			'seq': self.seq,
+			'to_encoder': self.encode_start_us / 1e3,
+			'encode': (self.encode_end_us - self.encode_start_us) / 1e3 if self.encode_end_us else 0,
+			'to_sender': (self.send_us - self.encode_end_us) / 1e3 if self.encode_end_us and self.send_us > self.encode_end_us else 0,
+			'network': (self.last_recv_time - capture_time) * 1e3 - self.send_us / 1e3,
+			'display': (display_time - self.last_recv_time) * 1e3,
+			'glass_to_glass': (display_time - capture_time) * 1e3,
+		}
+
 	def signal_frame_ready(self):
 		self.frame_complete = True
 		# print("frame ready!")
@@ -66,6 +108,58 @@ class frame:
 			return -1
 
 
+class stripe_image:
+	#last image of a conditional replenishment stream, cut into its stripes (restart intervals). Keyframes are complete JPEGs,
+	#partial frames carry stripes that replace some of them, each started by 0xFF 0xF0 and the 16 bit stripe index
+	MARKER_STRIPE = 0xF0
+
+	def __init__(self, jpeg):
+		sos = jpeg.find(b'\xff\xda')
+		if sos < 0:
+			raise ValueError("no SOS")
+		data_start = sos + 2 + ((jpeg[sos + 2] << 8) | jpeg[sos + 3])
+		self.header = jpeg[0:data_start]
+		self.stripes = []
+		pos = data_start
+		while True:
+			end = self.next_marker(jpeg, pos)
+			self.stripes.append(jpeg[pos:end])
+			if end + 2 > len(jpeg) or jpeg[end + 1] == 0xD9: #EOI
+				break
+			pos = end + 2 #RSTn
+
+	@staticmethod
+	def next_marker(data, pos):
+		#a marker in entropy-coded data is 0xFF followed by anything but the 0x00 of byte stuffing
+		pos = data.find(b'\xff', pos)
+		while pos >= 0 and pos + 1 < len(data) and data[pos + 1] == 0:
+			pos = data.find(b'\xff', pos + 2)
+		return pos if pos >= 0 else len(data)
+
+	def patch(self, partial):
+		stripes = {}
+		pos = 0
+		while pos + 4 <= len(partial) and partial[pos] == 0xFF and partial[pos + 1] == self.MARKER_STRIPE:
+			index = (partial[pos + 2] << 8) | partial[pos + 3]
+			end = self.next_marker(partial, pos + 4)
+			stripes[index] = partial[pos + 4:end]
+			pos = end
+		if partial[pos:pos + 2] != b'\xff\xd9' or any(index >= len(self.stripes) for index in stripes):
+			return False #not a partial frame of this keyframe
+		for index in stripes:
+			self.stripes[index] = stripes[index]
+		return True
+
+	def jpeg(self):
+		data = bytearray(self.header)
+		for index, stripe in enumerate(self.stripes):
+			if index != 0:
+				data += bytes([0xFF, 0xD0 + (index - 1) % 8])
+			data += stripe
+		data += b'\xff\xd9'
+		return bytes(data)
+
+
 class camera:
 	STATE_IDLE = 0
 	STATE_STREAMING = 1
@@ -76,10 +170,19 @@ class camera:
 	PROTOCOL_CTRL_PKT = 0xF
 	PROTOCOL_DATA_PKT = 0xF + 1
 	PROTOCOL_ERR_PKT = 0xF + 2
+	PROTOCOL_PARTIAL_PKT = 0xF + 3
 
 	PROTOCOL_STREAM_RQST = 0xF
 	PROTOCOL_STREAM_STOP = 0xF + 1
 	PROTOCOL_STREAM_KEEPALIVE = 0xF + 2
+	PROTOCOL_STREAM_RECONFIG = 0xF + 3
+
+	#protocol_err_t of the camera's replies
+	PROTOCOL_ERRORS = ['ok', 'channel busy', 'no memory', 'not connected', 'invalid argument', 'failed']
+
+	#framesize_t and pixformat_t of the camera driver
+	FRAMESIZES = {'qqvga': 0, 'qcif': 2, 'hqvga': 3, 'qvga': 4}
+	PIXFORMAT_YUV422 = 1
 
 
 	def __init__(self, addr, port):
@@ -90,6 +193,11 @@ class camera:
 		self.out_pkt_list = [] 
 		self.state = self.STATE_IDLE
 		self.pkt_recved = 0 
+		self.image = None #last keyframe patched by the partial frames since
+		self.clock_offset = None #our time minus the camera's at the lowest network delay seen
+		self.last_frame = None #last complete frame, for its latency
+		self.last_seq = None
+		self.frames_lost = 0 #sequence number gaps, frames dropped or skipped by the camera or lost on the network
 		self.keepalive = threading.Thread(target = self.keepalive_thread, args = (), daemon = True)
 		self.conn_timeout = threading.Thread(target = self.conn_timeout_thread, args = (), daemon = True)
 		self.keepalive.start()
@@ -118,6 +226,9 @@ class camera:
 		if (self.state == self.STATE_STREAMING):
 			self.pkt_recved = 1 
 
+			if pkt.type == self.PROTOCOL_CTRL_PKT:
+				return self.ctrl_reply(pkt)
+
 			for frame_item in self.frame_list:
 				if frame_item.is_part_of_frame(pkt):
 					if frame_item.add_packet(pkt):
@@ -128,6 +239,19 @@ class camera:
 		else: 
 			return False 
 
+	def ctrl_reply(self, pkt):
+		#result of a command, only reconfiguration is answered
+		if len(pkt.payload) < 2 or pkt.payload[0] != self.PROTOCOL_STREAM_RECONFIG:
+			return False
+		status = pkt.payload[1]
+		if status == 0:
+			self.image = None #partial frames of the old size don't fit
+			print("Reconfigured")
+		else:
+			error = self.PROTOCOL_ERRORS[status] if status < len(self.PROTOCOL_ERRORS) else str(status)
+			print("Reconfiguration failed: " + error)
+		return True
+
 	def get_frame(self):
 		for frame_item in self.frame_list:
 			if frame_item.frame_complete == True:
@@ -140,13 +264,41 @@ class camera:
 					# print("Popped incomplete frame")
 				# print("Size of list " + str(len(self.frame_list)) + " popping complete frame index " + str(index))
 				completed_frame = self.frame_list.pop(index - i) #effectively 0, as item originally at index will have been moved to front of list due to popping in while loop 
+				self.frame_timing(completed_frame)
 				frame_payload = completed_frame.get_frame_data() 
 				if frame_payload != -1:
-					return frame_payload
+					return self.replenish(completed_frame.type, frame_payload)
 				else:
 					break 
 		return False 
 
+	def frame_timing(self, completed_frame):
+		offset = completed_frame.first_recv_time - (completed_frame.capture_us + completed_frame.send_us) / 1e6
+		if self.clock_offset is None or offset < self.clock_offset:
+			self.clock_offset = offset
+		if self.last_seq is not None and completed_frame.seq > self.last_seq + 1:
+			self.frames_lost += completed_frame.seq - self.last_seq - 1
+		self.last_seq = completed_frame.seq
+		self.last_frame = completed_frame
+
+	def latency(self, display_time):
+		#delays of the last complete frame, see frame.latency()
+		if self.last_frame is None:
+			return None
+		return self.last_frame.latency(self.clock_offset, display_time)
+
+	def replenish(self, frame_type, frame_payload):
+		#keyframes are kept to be patched by the partial frames that follow, partial frames are returned as the patched image
+		if frame_type == self.PROTOCOL_PARTIAL_PKT:
+			if self.image is None or not self.image.patch(bytes(frame_payload)):
+				return False #no keyframe yet
+			return list(self.image.jpeg())
+		try:
+			self.image = stripe_image(bytes(frame_payload))
+		except (ValueError, IndexError):
+			self.image = None
+		return frame_payload
+
 	def stream_rqst(self):
 		if self.state == self.STATE_IDLE:
 			self.state = self.STATE_STREAMING
@@ -165,6 +317,19 @@ class camera:
 			self.out_pkt_list.append(pkt)
 			self.pkt_recved = 0 
 
+	def reconfigure(self, frame_size, fb_count = 0):
+		#frame size by name, fb_count 0 keeps the camera's. Only while streaming, the camera's reply is handled by ctrl_reply().
+		#Frames of the new size follow a keyframe
+		if self.state != self.STATE_STREAMING:
+			print("Invalid state")
+			return
+		if frame_size not in self.FRAMESIZES:
+			print("Invalid frame size")
+			return
+		pkt = packet_out(self.out_frame_id, self.PROTOCOL_CTRL_PKT, 1, 1, 0, 4, self.PROTOCOL_STREAM_RECONFIG)
+		pkt.buffer = pkt.buffer + struct.pack('<BBB', self.FRAMESIZES[frame_size], self.PIXFORMAT_YUV422, fb_count)
+		self.out_pkt_list.append(pkt)
+
 	def get_outbound_pkt(self):
 		if (len(self.out_pkt_list) > 0): 
 			return self.out_pkt_list.pop(0)
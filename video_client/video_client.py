@@ -27,6 +27,8 @@ CAM1_IP = '192.168.1.77' #devkitC
 CAM2_IP = '192.168.1.1' #filler
 CAM3_IP = '192.168.1.2' #filler 
 
+LATENCY_REPORT_FRAMES = 30 #frames between latency reports, by camera sequence number
+
 camera0 = protocol.camera(CAM0_IP, PORT)
 camera1 = protocol.camera(CAM1_IP, PORT)
 camera2 = protocol.camera(CAM2_IP, PORT)
@@ -103,6 +105,7 @@ class img_display:
                 complete_frame = camera_list[camera_index].get_frame()
                 if complete_frame:
                     self.build_new_img(complete_frame, camera_index)
+                    self.report_latency(camera_index)
                 camera_index += 1                    
 
             img_display = self.clear_old_frames() 
@@ -128,6 +131,14 @@ class img_display:
 
             time.sleep(0.01)
 
+    def report_latency(self, camera_index):
+        latency = self.cameras[camera_index].latency(time.time())
+        if latency is None or latency['seq'] % LATENCY_REPORT_FRAMES != 0:
+            return
+        print("camera " + str(camera_index) + " frame " + str(latency['seq']) + " lost " + str(self.cameras[camera_index].frames_lost)
+              + " ms: to encoder %.1f encode %.1f to sender %.1f network %.1f display %.1f glass to glass %.1f"
+              % (latency['to_encoder'], latency['encode'], latency['to_sender'], latency['network'], latency['display'], latency['glass_to_glass']))
+
     def start_display(self):
         self.img_thread = threading.Thread(target = self.display_thread, args = (), daemon = True)
         self.img_thread.start()
@@ -152,10 +163,10 @@ def camera_outbox_thread (cameras, socket, socket_lock):
 
 def user_input_thread(cameras):
     while True:
-        input_cmd = input("Command (ex. stream, stop): ")
+        input_cmd = input("Command (ex. stream, stop, size): ")
         input_num = input("Camera number (from 0): ")
 
-        if input_cmd != "stream" and input_cmd != "stop" or int(input_num) >= len(cameras):
+        if input_cmd != "stream" and input_cmd != "stop" and input_cmd != "size" or int(input_num) >= len(cameras):
             print("Invalid input")
             continue 
 
@@ -163,6 +174,9 @@ def user_input_thread(cameras):
             cameras[int(input_num)].stream_rqst()
         elif input_cmd == "stop":
             cameras[int(input_num)].stream_stop()
+        elif input_cmd == "size":
+            frame_size = input("Frame size (qqvga, qcif, hqvga, qvga): ")
+            cameras[int(input_num)].reconfigure(frame_size)
 
 if IP_VERSION == 'IPv4':
     family_addr = socket.AF_INET